@@ -0,0 +1,350 @@
+//
+//  bench.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include "src/bpnn.hpp"
+#include "src/utils.hpp"
+#include "src/predictor.hpp"
+#include "src/quantize.hpp"
+#include <regex>
+#include <ctime>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <algorithm>
+
+#define BENCH_SAMPLES 10 // Timed samples per benchmark, after an untimed warm-up.
+#define BENCH_SAMPLE_MS 20 // Each sample repeats the benchmark until it has run for at least this long.
+#define BENCH_ROWS_PATH "./bench_rows.txt"
+#define BENCH_SCHEMA 1 // Bumped whenever the JSON layout changes, so old baselines are recognised.
+
+// Set by CMake; a build without it can't say how it was optimized.
+#ifndef JACOBIAN_BUILD
+#define JACOBIAN_BUILD "unknown"
+#endif
+#ifndef JACOBIAN_FLAGS
+#define JACOBIAN_FLAGS ""
+#endif
+
+using namespace Jacobian;
+
+// A named piece of work. prepare() builds its inputs and returns one run of it, so benchmarks that
+// are filtered out never allocate anything; items is how many elements, samples or rows a run
+// processes, for throughput.
+struct Benchmark {
+	std::string name;
+	double items;
+	std::function<std::function<void()>()> prepare;
+};
+
+// Seconds per run.
+struct Result {
+	double mean;
+	double stddev;
+	double min;
+	long iterations; // Runs per sample.
+	std::vector<double> samples; // Each sample's mean, which is what baselines are compared on.
+};
+
+static volatile float sink; // Results that would otherwise be optimized away go here.
+
+// Derived only to reach the batch loaders.
+class LoaderNetwork : public Network {
+public:
+	using Network::Network;
+	void load(int index) {read_batch(false, index % (instances / batch_size), own_view(0, batch_size));}
+};
+
+// Random features in [-1, 1] and a label below classes, one row after another as prep() lays them out.
+static std::vector<float> random_rows(int count, int features, int classes)
+{
+	std::mt19937 generator (42);
+	std::uniform_real_distribution<float> feature (-1, 1);
+	std::uniform_int_distribution<int> label (0, classes-1);
+	std::vector<float> rows;
+	for (int i = 0; i < count; i++) {
+		for (int j = 0; j < features; j++) rows.push_back(feature(generator));
+		rows.push_back(label(generator));
+	}
+	return rows;
+}
+
+// A network over in-memory rows, four batches of them, with hidden layers of the given widths.
+struct Fixture {
+	std::vector<float> rows;
+	std::shared_ptr<Dataset> data;
+	std::unique_ptr<LoaderNetwork> net;
+	Fixture(int inputs, const std::vector<int>& hidden, int classes, int batch)
+		:rows(random_rows(4 * batch, inputs, classes))
+	{
+		data = std::make_shared<Dataset>(rows.data(), 4 * batch, rows.data(), batch, inputs + 1);
+		net = std::make_unique<LoaderNetwork>(data, batch, 0.0001, 0.0001, Regularization::L2, 0);
+		net->silenced = true;
+		net->add_layer(inputs, activations::linear, activations::linear_deriv);
+		for (int width : hidden) net->add_layer(width, activations::relu, activations::relu_deriv);
+		net->add_layer(classes, activations::linear, activations::linear_deriv);
+		net->init_optimizer(optimizers::momentum(0.1));
+		net->initialize();
+		net->load(0);
+		net->feedforward();
+	}
+};
+
+static void write_rows(int count)
+{
+	std::vector<float> rows = random_rows(count, 4, 2);
+	FILE* file = fopen(BENCH_ROWS_PATH, "w");
+	if (!file) throw std::runtime_error{"The benchmarks could not write their data file."};
+	for (int i = 0; i < count; i++)
+		fprintf(file, "%g,%g,%g,%g,%g\n", rows[5*i], rows[5*i+1], rows[5*i+2], rows[5*i+3], rows[5*i+4]);
+	fclose(file);
+}
+
+static std::vector<Benchmark> benchmarks()
+{
+	std::vector<Benchmark> list;
+	const int sides[] = {32, 128, 512};
+	for (const activations::Named& named : activations::registry()) {
+		for (int side : sides) {
+			list.push_back({"activation/" + std::string(named.name) + "/" + std::to_string(side) + "x" + std::to_string(side),
+							static_cast<double>(side) * side, [&named, side] {
+				// Called through std::function a value at a time, as a layer's activation is.
+				std::function<float(float)> activation = named.activation;
+				std::function<float(float)> activation_deriv = named.activation_deriv;
+				auto input = std::make_shared<Eigen::MatrixXf>(Eigen::MatrixXf::Random(side, side));
+				auto output = std::make_shared<Eigen::MatrixXf>(side, side);
+				auto dZ = std::make_shared<Eigen::MatrixXf>(side, side);
+				return [=] {
+					for (int k = 0; k < side; k++) {
+						for (int j = 0; j < side; j++) {
+							(*dZ)(j,k) = activation_deriv((*input)(j,k));
+							(*output)(j,k) = activation((*input)(j,k));
+						}
+					}
+				};
+			}});
+		}
+	}
+	for (int batch : {32, 256}) {
+		for (int classes : {10, 100}) {
+			const std::string shape = std::to_string(batch) + "x" + std::to_string(classes);
+			list.push_back({"softmax/" + shape, static_cast<double>(batch), [batch, classes] {
+				auto fixture = std::make_shared<Fixture>(16, std::vector<int>{16}, classes, batch);
+				return [fixture] {fixture->net->softmax();};
+			}});
+			list.push_back({"cost/" + shape, static_cast<double>(batch), [batch, classes] {
+				auto fixture = std::make_shared<Fixture>(16, std::vector<int>{16}, classes, batch);
+				return [fixture] {sink = fixture->net->cost();};
+			}});
+			list.push_back({"accuracy/" + shape, static_cast<double>(batch), [batch, classes] {
+				auto fixture = std::make_shared<Fixture>(16, std::vector<int>{16}, classes, batch);
+				return [fixture] {sink = fixture->net->accuracy();};
+			}});
+		}
+	}
+	typedef std::function<void(Layer&, const Eigen::Ref<const Eigen::MatrixXf>&, float)> Optimizer;
+	const std::vector<std::pair<std::string, std::function<Optimizer()>>> optimizers {
+		{"momentum", [] {return optimizers::momentum(0.1);}},
+		{"demon", [] {return optimizers::demon(0.9, 1 << 30);}},
+		{"adam", [] {return optimizers::adam(0.9, 0.999, 1e-8);}},
+		{"adamax", [] {return optimizers::adamax(0.9, 0.999, 1e-8);}},
+	};
+	for (const auto& [name, make] : optimizers) {
+		for (int side : sides) {
+			list.push_back({"optimizer/" + name + "/" + std::to_string(side) + "x" + std::to_string(side),
+							static_cast<double>(side) * side, [make = make, side] {
+				auto layer = std::make_shared<Layer>(1, side);
+				layer->weights = Eigen::MatrixXf::Random(side, side);
+				layer->m = Eigen::MatrixXf::Zero(side, side);
+				layer->v = Eigen::MatrixXf::Zero(side, side);
+				auto delta = std::make_shared<Eigen::MatrixXf>(Eigen::MatrixXf::Random(side, side) * 0.001);
+				Optimizer optimizer = make();
+				return [=]() mutable {optimizer(*layer, *delta, 0.0001);};
+			}});
+		}
+	}
+	for (int width : {16, 128, 512}) {
+		for (int batch : {32, 256}) {
+			const std::string shape = "w" + std::to_string(width) + "/b" + std::to_string(batch);
+			list.push_back({"feedforward/" + shape, static_cast<double>(batch), [width, batch] {
+				auto fixture = std::make_shared<Fixture>(width, std::vector<int>{width, width}, 10, batch);
+				return [fixture] {fixture->net->feedforward();};
+			}});
+			list.push_back({"backpropagate/" + shape, static_cast<double>(batch), [width, batch] {
+				auto fixture = std::make_shared<Fixture>(width, std::vector<int>{width, width}, 10, batch);
+				return [fixture] {fixture->net->backpropagate();};
+			}});
+		}
+	}
+	// The same network served in fp32 and in int8. int8 has a fixed cost per tile of rows, so it only
+	// pulls ahead once the layers are wide enough for their products to dominate.
+	for (int width : {64, 256, 512}) {
+		const std::string shape = "w" + std::to_string(width) + "/b256";
+		list.push_back({"inference/fp32/" + shape, 256.0, [width] {
+			auto fixture = std::make_shared<Fixture>(width, std::vector<int>{width, width}, 10, 256);
+			auto predictor = std::make_shared<Predictor>(*fixture->net);
+			auto input = std::make_shared<Eigen::MatrixXf>(Eigen::MatrixXf::Random(256, width));
+			return [fixture, predictor, input] {sink = predictor->predict(*input)(0, 0);};
+		}});
+		list.push_back({"inference/int8/" + shape, 256.0, [width] {
+			auto fixture = std::make_shared<Fixture>(width, std::vector<int>{width, width}, 10, 256);
+			auto quantized = std::make_shared<QuantizedNetwork>(*fixture->net);
+			auto input = std::make_shared<Eigen::MatrixXf>(Eigen::MatrixXf::Random(256, width));
+			return [fixture, quantized, input] {sink = quantized->predict(*input)(0, 0);};
+		}});
+	}
+	for (int batch : {32, 256}) {
+		list.push_back({"loader/fill_batch/b" + std::to_string(batch), static_cast<double>(batch), [batch] {
+			auto fixture = std::make_shared<Fixture>(4, std::vector<int>{8}, 2, batch);
+			auto index = std::make_shared<int>(0);
+			return [fixture, index] {fixture->net->load((*index)++);};
+		}});
+		list.push_back({"loader/load_batch/b" + std::to_string(batch), static_cast<double>(batch), [batch] {
+			write_rows(64 * batch);
+			auto net = std::make_shared<LoaderNetwork>(BENCH_ROWS_PATH, batch, 0.0001, 0.0001, Regularization::L2, 0, 0.9);
+			net->silenced = true;
+			net->add_layer(4, activations::linear, activations::linear_deriv);
+			net->add_layer(2, activations::linear, activations::linear_deriv);
+			net->init_optimizer(optimizers::momentum(0.1));
+			net->initialize();
+			auto index = std::make_shared<int>(0);
+			return [net, index] {net->load((*index)++);};
+		}});
+	}
+	for (int rows : {1000, 20000}) {
+		list.push_back({"loader/dataset/" + std::to_string(rows), static_cast<double>(rows), [rows] {
+			write_rows(rows);
+			return [] {Dataset data (BENCH_ROWS_PATH, 0.9);};
+		}});
+	}
+	return list;
+}
+
+// Times runs of the benchmark in samples of at least sample_seconds each, after working out how many
+// runs that takes; the first sample is thrown away as a warm-up.
+static Result measure(const std::function<void()>& run, int samples, double sample_seconds)
+{
+	typedef std::chrono::steady_clock Clock;
+	auto time = [&run](long iterations) {
+		Clock::time_point start = Clock::now();
+		for (long i = 0; i < iterations; i++) run();
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	};
+	long iterations = 1;
+	for (double took = time(1); took < sample_seconds; took = time(iterations)) {
+		long scaled = took > 0 ? static_cast<long>(iterations * sample_seconds / took * 1.1) : iterations * 10;
+		iterations = std::clamp(scaled, iterations + 1, iterations * 10);
+	}
+	time(iterations);
+	std::vector<double> runs;
+	for (int s = 0; s < samples; s++) runs.push_back(time(iterations) / iterations);
+	Result result {0, 0, *std::min_element(runs.begin(), runs.end()), iterations, runs};
+	for (double seconds : runs) result.mean += seconds / samples;
+	for (double seconds : runs) result.stddev += (seconds - result.mean) * (seconds - result.mean);
+	result.stddev = samples > 1 ? std::sqrt(result.stddev / (samples - 1)) : 0;
+	return result;
+}
+
+static std::string human_time(double seconds)
+{
+	char text[32];
+	if (seconds < 1e-6) snprintf(text, sizeof(text), "%.1fns", seconds * 1e9);
+	else if (seconds < 1e-3) snprintf(text, sizeof(text), "%.2fus", seconds * 1e6);
+	else if (seconds < 1) snprintf(text, sizeof(text), "%.2fms", seconds * 1e3);
+	else snprintf(text, sizeof(text), "%.2fs", seconds);
+	return text;
+}
+
+static std::string json_string(const std::string& text)
+{
+	std::string quoted = "\"";
+	for (char c : text) {
+		if (c == '"' || c == '\\') quoted += '\\';
+		if (static_cast<unsigned char>(c) < 0x20) quoted += ' ';
+		else quoted += c;
+	}
+	return quoted + "\"";
+}
+
+static std::string cpu_model()
+{
+	std::ifstream cpuinfo ("/proc/cpuinfo");
+	std::string line;
+	while (std::getline(cpuinfo, line)) {
+		if (line.rfind("model name", 0) != 0) continue;
+		size_t colon = line.find(':');
+		return colon == std::string::npos ? "" : line.substr(line.find_first_not_of(' ', colon + 1));
+	}
+	return "unknown";
+}
+
+// What bench_compare.py reads: the build and machine, so runs that can't be compared fairly are
+// flagged, and every benchmark's samples, so differences can be tested for significance.
+static void write_json(const char* path, const std::vector<std::pair<const Benchmark*, Result>>& results, int samples, double sample_ms)
+{
+#if (RECKLESS)
+	const char* reckless = "true";
+#else
+	const char* reckless = "false";
+#endif
+	FILE* file = fopen(path, "w");
+	if (!file) throw std::runtime_error{"The benchmarks could not write their JSON results."};
+	fprintf(file, "{\n  \"schema\": %i,\n  \"timestamp\": %lld,\n", BENCH_SCHEMA, static_cast<long long>(time(NULL)));
+	fprintf(file, "  \"build\": {\"config\": %s, \"flags\": %s, \"compiler\": %s, \"reckless\": %s},\n", json_string(JACOBIAN_BUILD).c_str(),
+			json_string(JACOBIAN_FLAGS).c_str(), json_string(__VERSION__).c_str(), reckless);
+	fprintf(file, "  \"machine\": {\"cpu\": %s, \"hardware_threads\": %u, \"threads\": 1},\n", json_string(cpu_model()).c_str(),
+			std::thread::hardware_concurrency());
+	fprintf(file, "  \"samples\": %i,\n  \"sample_ms\": %g,\n  \"benchmarks\": [", samples, sample_ms);
+	for (size_t i = 0; i < results.size(); i++) {
+		const auto& [benchmark, result] = results[i];
+		fprintf(file, "%s\n    {\"name\": %s, \"items\": %.17g, \"iterations\": %li, \"mean\": %.17g, \"stddev\": %.17g, \"min\": %.17g, \"items_per_second\": %.17g, \"samples\": [",
+				i > 0 ? "," : "", json_string(benchmark->name).c_str(), benchmark->items, result.iterations, result.mean, result.stddev,
+				result.min, benchmark->items / result.mean);
+		for (size_t s = 0; s < result.samples.size(); s++) fprintf(file, "%s%.17g", s > 0 ? ", " : "", result.samples[s]);
+		fprintf(file, "]}");
+	}
+	fprintf(file, "\n  ]\n}\n");
+	fclose(file);
+}
+
+int main(int argc, char** argv)
+{
+	std::regex filter (".*");
+	int samples = BENCH_SAMPLES;
+	double sample_ms = BENCH_SAMPLE_MS;
+	bool list_only = false;
+	const char* json_path = nullptr;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--samples") == 0 && i+1 < argc) samples = std::max(1L, strtol(argv[++i], NULL, 10));
+		else if (strcmp(argv[i], "--sample-ms") == 0 && i+1 < argc) sample_ms = strtod(argv[++i], NULL);
+		else if (strcmp(argv[i], "--json") == 0 && i+1 < argc) json_path = argv[++i];
+		else if (strcmp(argv[i], "--list") == 0) list_only = true;
+		else if (argv[i][0] == '-') {
+			std::cout << "Usage: jacobian_bench [name regex] [--samples n] [--sample-ms ms] [--json path] [--list]\n";
+			exit(1);
+		}
+		else filter = std::regex(argv[i]);
+	}
+	std::vector<std::pair<const Benchmark*, Result>> results;
+	const std::vector<Benchmark> all = benchmarks();
+	if (!list_only) printf("%-36s %10s %7s %10s %16s\n", "benchmark", "mean", "stddev", "min", "throughput");
+	for (const Benchmark& benchmark : all) {
+		if (!std::regex_search(benchmark.name, filter)) continue;
+		if (list_only) {
+			printf("%s\n", benchmark.name.c_str());
+			continue;
+		}
+		Result result = measure(benchmark.prepare(), samples, sample_ms / 1000);
+		printf("%-36s %10s %6.1f%% %10s %14.4gM/s\n", benchmark.name.c_str(), human_time(result.mean).c_str(),
+			   100 * result.stddev / result.mean, human_time(result.min).c_str(), benchmark.items / result.mean / 1e6);
+		fflush(stdout);
+		results.emplace_back(&benchmark, std::move(result));
+	}
+	unlink(BENCH_ROWS_PATH);
+	if (json_path && !list_only) write_json(json_path, results, samples, sample_ms);
+	return 0;
+}
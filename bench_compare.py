@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""Compares a jacobian_bench --json run against a baseline run.
+
+Each benchmark's per-sample times are compared with Welch's t-test. A benchmark is a regression if
+it got slower by more than the threshold and the difference is significant at alpha. The exit
+status is 1 if anything regressed, so this can gate a build.
+
+    ./jacobian_bench --json baseline.json
+    ... change things, rebuild ...
+    ./jacobian_bench --json current.json
+    python3 bench_compare.py baseline.json current.json --threshold 5 --alpha 0.01
+"""
+
+import argparse
+import json
+import math
+import sys
+
+SCHEMA = 1
+
+
+def betacf(a, b, x):
+    """The continued fraction for the incomplete beta function (modified Lentz's method)."""
+    tiny = 1e-300
+    c, d = 1.0, 1.0 - (a + b) * x / (a + 1)
+    d = 1.0 / (d if abs(d) > tiny else tiny)
+    h = d
+    for m in range(1, 300):
+        for numerator in (m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m)),
+                          -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1))):
+            d = 1.0 + numerator * d
+            d = 1.0 / (d if abs(d) > tiny else tiny)
+            c = 1.0 + numerator / c
+            c = c if abs(c) > tiny else tiny
+            h *= d * c
+        if abs(d * c - 1.0) < 1e-12:
+            break
+    return h
+
+
+def betainc(a, b, x):
+    """The regularized incomplete beta function I_x(a, b)."""
+    if x <= 0:
+        return 0.0
+    if x >= 1:
+        return 1.0
+    front = math.exp(math.lgamma(a + b) - math.lgamma(a) - math.lgamma(b) + a * math.log(x) + b * math.log(1 - x))
+    if x < (a + 1) / (a + b + 2):
+        return front * betacf(a, b, x) / a
+    return 1.0 - front * betacf(b, a, 1 - x) / b
+
+
+def welch(baseline, current):
+    """Two-sided p-value of Welch's t-test that the two samples have the same mean."""
+    n1, n2 = len(baseline), len(current)
+    if n1 < 2 or n2 < 2:
+        return 1.0
+    m1, m2 = sum(baseline) / n1, sum(current) / n2
+    v1 = sum((x - m1) ** 2 for x in baseline) / (n1 - 1)
+    v2 = sum((x - m2) ** 2 for x in current) / (n2 - 1)
+    se = v1 / n1 + v2 / n2
+    if se == 0:
+        return 0.0 if m1 != m2 else 1.0
+    t = (m2 - m1) / math.sqrt(se)
+    df = se ** 2 / ((v1 / n1) ** 2 / (n1 - 1) + (v2 / n2) ** 2 / (n2 - 1))
+    return betainc(df / 2, 0.5, df / (df + t * t))
+
+
+def load(path):
+    with open(path) as f:
+        run = json.load(f)
+    if run.get("schema") != SCHEMA:
+        sys.exit("%s has schema %s, but this compares schema %d." % (path, run.get("schema"), SCHEMA))
+    return run
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare jacobian_bench JSON results against a baseline.")
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=5.0, help="percent slowdown that counts as a regression")
+    parser.add_argument("--alpha", type=float, default=0.01, help="significance level")
+    parser.add_argument("--filter", default="", help="only compare benchmarks whose names contain this")
+    args = parser.parse_args()
+    baseline, current = load(args.baseline), load(args.current)
+
+    for section, keys in (("build", ("config", "flags", "compiler", "reckless")), ("machine", ("cpu", "hardware_threads"))):
+        for key in keys:
+            before, after = baseline[section].get(key), current[section].get(key)
+            if before != after:
+                print("warning: %s %s differs: %r vs %r" % (section, key, before, after))
+
+    before = {b["name"]: b for b in baseline["benchmarks"]}
+    after = {b["name"]: b for b in current["benchmarks"]}
+    names = [name for name in after if name in before and args.filter in name]
+    print("%-36s %12s %12s %9s %9s  %s" % ("benchmark", "baseline", "current", "change", "p", "verdict"))
+    regressions = 0
+    for name in names:
+        old, new = before[name], after[name]
+        change = 100 * (new["mean"] - old["mean"]) / old["mean"]
+        p = welch(old["samples"], new["samples"])
+        verdict = ""
+        if p < args.alpha and change > args.threshold:
+            verdict = "REGRESSION"
+            regressions += 1
+        elif p < args.alpha and change < -args.threshold:
+            verdict = "improvement"
+        elif p < args.alpha:
+            verdict = "within threshold"
+        print("%-36s %10.4gus %10.4gus %+8.1f%% %9.2g  %s" % (name, 1e6 * old["mean"], 1e6 * new["mean"], change, p, verdict))
+    for name in sorted(set(before) - set(after)):
+        print("%-36s only in the baseline" % name)
+    for name in sorted(set(after) - set(before)):
+        print("%-36s only in the current run" % name)
+    print("%d of %d benchmarks regressed by more than %g%% (alpha %g)." % (regressions, len(names), args.threshold, args.alpha))
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -12,9 +12,18 @@
 
 #include "src/bpnn.hpp"
 #include "src/utils.hpp"
+#include "src/sweep.hpp"
+#include "src/server.hpp"
+#include "src/predictor.hpp"
+#include "src/quantize.hpp"
+#include "src/freeze.hpp"
+#include "src/scoring.hpp"
 #include "unistd.h"
 #include <ctime>
 #include <chrono>
+#include <cstring>
+#include <cmath>
+#include <functional>
 
 double bench(int batch_sz, int epochs)
 {
@@ -32,12 +41,368 @@ double bench(int batch_sz, int epochs)
 	return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / pow(10,9);
 }
 
+// Trains the same topology synchronously and with Hogwild so their throughput and convergence can be compared.
+void hogwild_bench(int batch_sz, int epochs, int threads)
+{
+	for (int hogwild = 0; hogwild <= 1; hogwild++) {
+		Jacobian::Network net ("./data_banknote_authentication.txt", batch_sz, 0.0155, 0.03, Jacobian::Regularization::L2, 0, 0.9);
+		net.add_layer(4, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+		net.add_layer(5, Jacobian::activations::lecun_tanh, Jacobian::activations::lecun_tanh_deriv);
+		net.add_layer(2, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+		net.init_optimizer(Jacobian::optimizers::momentum(0.1));
+		net.initialize();
+		std::cout << (hogwild ? "Hogwild" : "Synchronous") << ":\n";
+		float throughput = 0;
+		for (int i = 0; i < epochs; i++) {
+			if (hogwild) net.train_hogwild(threads);
+			else net.train();
+			throughput += net.get_throughput();
+		}
+		std::cout << "Mean throughput: " << throughput / epochs << " samples/s\n";
+	}
+}
+
+// One replica of a ring; start it once per rank, each in its own working directory.
+void ring_train(int rank, int world, const char* transport, int epochs)
+{
+	std::shared_ptr<Jacobian::Transport> link;
+	if (strcmp(transport, "tcp") == 0) {
+		std::vector<std::string> peers;
+		for (int r = 0; r < world; r++) peers.push_back("127.0.0.1:" + std::to_string(5600 + r));
+		link = std::make_shared<Jacobian::TcpTransport>(rank, peers);
+	}
+	else link = std::make_shared<Jacobian::ShmTransport>("/jacobian-ring", rank, world);
+	Jacobian::Network net ("./data_banknote_authentication.txt", 10, 0.0155, 0.03, Jacobian::Regularization::L2, 0, 0.9);
+	net.silenced = rank != 0;
+	net.add_layer(4, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.add_layer(5, Jacobian::activations::lecun_tanh, Jacobian::activations::lecun_tanh_deriv);
+	net.add_layer(2, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.init_optimizer(Jacobian::optimizers::momentum(0.1));
+	net.initialize();
+	net.distribute(link);
+	for (int i = 0; i < epochs; i++) net.train();
+}
+
+// Searches learning rate and hidden layer width together, every trial training on one shared copy of the data.
+void sweep_bench(int epochs, int threads)
+{
+	auto data = std::make_shared<Jacobian::Dataset>("./data_banknote_authentication.txt", 0.9);
+	Jacobian::Sweep sweep (data, threads);
+	for (float rate : {0.001f, 0.0155f, 0.1f, 1.0f}) {
+		for (int hidden : {3, 5, 8}) {
+			sweep.add({10, rate, 0.03, Jacobian::Regularization::L2, 0, [hidden](Jacobian::Network& net) {
+				net.add_layer(4, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+				net.add_layer(hidden, Jacobian::activations::lecun_tanh, Jacobian::activations::lecun_tanh_deriv);
+				net.add_layer(2, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+				net.init_optimizer(Jacobian::optimizers::momentum(0.1));
+			}});
+		}
+	}
+	auto start = std::chrono::steady_clock::now();
+	sweep.run(epochs);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	for (const Jacobian::TrialResult& result : sweep.results()) {
+		printf("Trial %i - %i epochs - val_cost %f - val_acc %f%s\n", result.id, result.epochs, result.val_cost, result.val_acc,
+			   result.diverged ? " - diverged" : result.stopped ? " - stopped early" : "");
+	}
+	printf("Best trial %i - %.3fs\n", sweep.best(), elapsed.count());
+}
+
+// Serves a briefly trained network to closed-loop clients (each sends a request, waits for the reply,
+// repeats) and reports how batching traded off against latency.
+void serve_bench(int clients, int requests, int deadline_us)
+{
+	Jacobian::Network net ("./data_banknote_authentication.txt", 32, 0.0155, 0.03, Jacobian::Regularization::L2, 0, 0.9);
+	net.add_layer(4, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.add_layer(5, Jacobian::activations::lecun_tanh, Jacobian::activations::lecun_tanh_deriv);
+	net.add_layer(2, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.init_optimizer(Jacobian::optimizers::momentum(0.1));
+	net.initialize();
+	for (int i = 0; i < 5; i++) net.train();
+	Jacobian::InferenceServer server (net, "./jacobian.sock", 2, 0, deadline_us);
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (int c = 0; c < clients; c++) {
+		threads.emplace_back([requests] {
+			Jacobian::InferenceClient client ("./jacobian.sock");
+			std::mt19937 gen (std::random_device{}());
+			std::normal_distribution<float> d (0, 3);
+			for (int r = 0; r < requests; r++) client.predict({d(gen), d(gen), d(gen), d(gen)}, 2);
+		});
+	}
+	for (std::thread& thread : threads) thread.join();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	Jacobian::LatencyReport report = server.report();
+	printf("%zu requests in %zu batches (mean %.1f) - %.0f requests/s\n", report.requests, report.batches,
+		   report.mean_batch, report.requests / elapsed.count());
+	printf("Latency - p50 %.0fus - p95 %.0fus - p99 %.0fus - max %.0fus\n", report.p50, report.p95, report.p99, report.max);
+}
+
+// Quantizes a trained network to int8 and compares its accuracy and inference speed with fp32.
+void quantize_bench(int epochs, int hidden)
+{
+	Jacobian::Network net ("./data_banknote_authentication.txt", 32, 0.0155, 0.03, Jacobian::Regularization::L2, 0, 0.9);
+	net.add_layer(4, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.add_layer(hidden, Jacobian::activations::relu, Jacobian::activations::relu_deriv);
+	net.add_layer(hidden, Jacobian::activations::relu, Jacobian::activations::relu_deriv);
+	net.add_layer(2, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.init_optimizer(Jacobian::optimizers::momentum(0.1));
+	net.initialize();
+	for (int i = 0; i < epochs; i++) net.train();
+	Jacobian::QuantizedNetwork quantized (net);
+	Jacobian::QuantizationReport report = quantized.compare(net);
+	printf("%i samples - fp32 acc %f - int8 acc %f - agreement %f - max delta %f - mean delta %f\n", report.samples,
+		   report.fp32_acc, report.int8_acc, report.agreement, report.max_delta, report.mean_delta);
+	printf("Weights - fp32 %zu bytes - int8 %zu bytes\n", report.fp32_bytes, report.int8_bytes);
+	Jacobian::Predictor predictor (net);
+	Eigen::MatrixXf input = Eigen::MatrixXf::Random(4096, 4) * 3;
+	auto time = [&input](auto& model) {
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < 20; i++) model.predict(input);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		return 20 * input.rows() / elapsed.count();
+	};
+	double fp32 = time(predictor);
+	double int8 = time(quantized);
+	printf("Throughput - fp32 %.0f rows/s - int8 %.0f rows/s (%.2fx)\n", fp32, int8, int8 / fp32);
+}
+
+// Prunes a wide network gradually over the first half of training and reports what it bought.
+void prune_bench(int epochs, int hidden, float sparsity)
+{
+	Jacobian::Network net ("./data_banknote_authentication.txt", 32, 0.0155, 0.03, Jacobian::Regularization::L2, 0, 0.9);
+	net.add_layer(4, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.add_layer(hidden, Jacobian::activations::relu, Jacobian::activations::relu_deriv);
+	net.add_layer(hidden, Jacobian::activations::relu, Jacobian::activations::relu_deriv);
+	net.add_layer(2, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.init_optimizer(Jacobian::optimizers::momentum(0.1));
+	net.initialize();
+	net.set_pruning({sparsity, 0, std::max(epochs / 2 - 1, 0)});
+	for (int i = 0; i < epochs; i++) net.train();
+	for (const Jacobian::SparsityReport& layer : net.sparsity_report())
+		printf("Layer %i - %ix%i - %.1f%% sparse%s - dense %.1fus - sparse %.1fus - %.2fx\n", layer.layer, layer.inputs,
+			   layer.outputs, 100 * layer.sparsity, layer.sparse ? " (CSR)" : "", layer.dense_us, layer.sparse_us, layer.speedup);
+}
+
+// Compares single-sample latency through a Network, a Predictor and a FrozenNetwork, then emits a header.
+void freeze_bench(int hidden)
+{
+	Jacobian::Network net ("./data_banknote_authentication.txt", 32, 0.0155, 0.03, Jacobian::Regularization::L2, 0, 0.9);
+	net.add_layer(4, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.add_layer(hidden, Jacobian::activations::relu, Jacobian::activations::relu_deriv);
+	net.add_layer(hidden, Jacobian::activations::relu, Jacobian::activations::relu_deriv);
+	net.add_layer(2, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.init_optimizer(Jacobian::optimizers::momentum(0.1));
+	net.initialize();
+	for (int i = 0; i < 5; i++) net.train();
+	Jacobian::Predictor predictor (net);
+	Jacobian::FrozenNetwork frozen (net);
+	Eigen::MatrixXf input = Eigen::MatrixXf::Random(1, 4) * 3;
+	auto time = [&input](auto& model) {
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < 10000; i++) model.predict(input);
+		std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count() / 10000;
+	};
+	double network = time(net);
+	double fp32 = time(predictor);
+	double compiled = time(frozen);
+	printf("Single row - network %.2fus - predictor %.2fus - frozen %.2fus (%.2fx)\n", network, fp32, compiled, fp32 / compiled);
+	printf("Max difference from the predictor %g - %zu bytes\n", (frozen.predict(input) - predictor.predict(input)).cwiseAbs().maxCoeff(), frozen.bytes());
+	frozen.emit_header("./frozen_model.h", "frozen_model");
+}
+
+// Writes rows random samples to CSV and binary files and scores both through a checkpoint.
+void score_bench(int threads, int rows)
+{
+	Jacobian::Network net ("./data_banknote_authentication.txt", 32, 0.0155, 0.03, Jacobian::Regularization::L2, 0, 0.9);
+	net.add_layer(4, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.add_layer(64, Jacobian::activations::relu, Jacobian::activations::relu_deriv);
+	net.add_layer(2, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.init_optimizer(Jacobian::optimizers::momentum(0.1));
+	net.initialize();
+	for (int i = 0; i < 5; i++) net.train();
+	net.save("./scoring_model.jcb");
+	FILE* csv = fopen("./scoring_input.csv", "w");
+	FILE* bin = fopen("./scoring_input.bin", "wb");
+	for (int i = 0; i < rows; i++) {
+		Eigen::Vector4f sample = Eigen::Vector4f::Random() * 8;
+		fprintf(csv, "%g,%g,%g,%g\n", sample(0), sample(1), sample(2), sample(3));
+		float row[5] = {sample(0), sample(1), sample(2), sample(3), 0};
+		fwrite(row, sizeof(float), 5, bin);
+	}
+	fclose(csv);
+	fclose(bin);
+	Jacobian::BatchScorer scorer (std::make_shared<Jacobian::Checkpoint>("./scoring_model.jcb"), threads);
+	for (const char* input : {"./scoring_input.csv", "./scoring_input.bin"}) {
+		for (const char* output : {"./scores.csv", "./scores.bin"}) {
+			Jacobian::ScoringReport report = scorer.score(input, output);
+			printf("%s -> %s - %zu rows in %.2fs - %.0f rows/s - busy: read %.2fs, compute %.2fs, write %.2fs\n", input, output,
+				   report.rows, report.seconds, report.rows_per_second, report.read_busy, report.compute_busy, report.write_busy);
+		}
+	}
+}
+
+// Trains the bench() network and breaks each epoch's time down by phase.
+void profile_bench(int batch_sz, int epochs)
+{
+#if (RECKLESS)
+	std::cout << "RECKLESS builds compile profiling out; build without it to profile.\n";
+	return;
+#endif
+	Jacobian::Network net ("./data_banknote_authentication.txt", batch_sz, 0.0155, 0.03, Jacobian::Regularization::L2, 0, 0.9);
+	net.add_layer(4, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.add_layer(5, Jacobian::activations::lecun_tanh, Jacobian::activations::lecun_tanh_deriv);
+	net.add_layer(2, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.init_optimizer(Jacobian::optimizers::momentum(0.1));
+	net.initialize();
+	net.silenced = true;
+	if (!net.set_counters(true)) std::cout << "Hardware counters aren't available here, so only timing phases.\n";
+	for (int i = 0; i < epochs; i++) {
+		net.train();
+		const Jacobian::Profile& profile = net.get_profile();
+		printf("Epoch %i - %i batches in %.2fms - %.0f samples/s - %.3f GFLOP/s\n", profile.epoch, profile.batches,
+			   1000 * profile.seconds, profile.samples_per_second, profile.gflops);
+		for (int p = 0; p < PROFILE_PHASES; p++) {
+			Jacobian::Phase phase = static_cast<Jacobian::Phase>(p);
+			if (profile.calls(phase) == 0) continue;
+			printf("  %-14s %8.3fms %5.1f%% %8li calls", Jacobian::phase_name(phase), 1000 * profile.time(phase),
+				   100 * profile.time(phase) / profile.seconds, profile.calls(phase));
+			if (profile.counted)
+				printf(" - IPC %.2f - LLC miss %.1f%% - branch miss %.1f%% - %.3f GFLOP/s", profile.ipc(phase),
+					   100 * profile.cache_miss_rate(phase), 100 * profile.branch_miss_rate(phase), profile.flops(phase) / 1e9);
+			printf("\n");
+		}
+	}
+}
+
+// Trains on a thread pool with background validation and writes the timeline to ./trace.json, for
+// chrome://tracing or ui.perfetto.dev.
+void trace_bench(int threads, int epochs)
+{
+	Jacobian::Network net ("./data_banknote_authentication.txt", 64, 0.0155, 0.03, Jacobian::Regularization::L2, 0, 0.9);
+	net.add_layer(4, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.add_layer(128, Jacobian::activations::relu, Jacobian::activations::relu_deriv);
+	net.add_layer(128, Jacobian::activations::relu, Jacobian::activations::relu_deriv);
+	net.add_layer(2, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.init_optimizer(Jacobian::optimizers::momentum(0.1));
+	net.initialize();
+	if (threads > 1) net.set_threads(threads);
+	net.set_async_validation(true);
+	net.set_tracing("./trace.json");
+	for (int i = 0; i < epochs; i++) net.train();
+	net.write_trace();
+	std::cout << "Wrote ./trace.json\n";
+}
+
+// What each layer holds, and what each epoch allocated and peaked at (allocations are only counted
+// when built with -DMEMORY_TRACKING=ON).
+void memory_bench(int batch_sz, int epochs)
+{
+	Jacobian::Network net ("./data_banknote_authentication.txt", batch_sz, 0.0155, 0.03, Jacobian::Regularization::L2, 0, 0.9);
+	net.add_layer(4, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.add_layer(256, Jacobian::activations::relu, Jacobian::activations::relu_deriv);
+	net.add_layer(256, Jacobian::activations::relu, Jacobian::activations::relu_deriv);
+	net.add_layer(2, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.init_optimizer(Jacobian::optimizers::adam(0.9, 0.999, 1e-8));
+	net.initialize();
+	net.silenced = true;
+	for (int i = 0; i < epochs; i++) {
+		net.train();
+		Jacobian::MemoryReport memory = net.memory_report();
+		printf("Epoch %i - peak RSS %.1fMB%s - RSS %.1fMB", memory.epoch, memory.peak_resident / 1e6,
+			   memory.peak_reset ? "" : " (since start)", memory.resident / 1e6);
+		if (memory.tracked)
+			printf(" - %.1f allocations/step - %.1fKB/step - heap peak %.1fMB", memory.allocations_per_step(),
+				   memory.steps > 0 ? memory.allocated / 1e3 / memory.steps : 0, memory.heap_peak / 1e6);
+		printf("\n");
+	}
+	Jacobian::MemoryReport memory = net.memory_report();
+	printf("%-6s", "layer");
+	for (int c = 0; c < MEMORY_CATEGORIES; c++) printf(" %12s", Jacobian::category_name(static_cast<Jacobian::Category>(c)));
+	printf("\n");
+	for (int i = 0; i < static_cast<int>(memory.layers.size()); i++) {
+		printf("%-6i", i);
+		for (int c = 0; c < MEMORY_CATEGORIES; c++) printf(" %10.1fKB", memory.layers[i].bytes[c] / 1e3);
+		printf("\n");
+	}
+	printf("%-6s", "total");
+	for (int c = 0; c < MEMORY_CATEGORIES; c++) printf(" %10.1fKB", memory.totals[c] / 1e3);
+	printf("\n");
+}
+
+// More threads than rows in a batch: the extra threads just get no shard.
+bool check_threads_over_batch()
+{
+	Jacobian::Network net ("./data_banknote_authentication.txt", 10, 0.0155, 0.03, Jacobian::Regularization::L2, 0, 0.9);
+	net.add_layer(4, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.add_layer(5, Jacobian::activations::lecun_tanh, Jacobian::activations::lecun_tanh_deriv);
+	net.add_layer(2, Jacobian::activations::linear, Jacobian::activations::linear_deriv);
+	net.init_optimizer(Jacobian::optimizers::momentum(0.1));
+	net.initialize();
+	net.silenced = true;
+	net.set_threads(16);
+	net.train();
+	return std::isfinite(net.get_cost());
+}
+
+// Regression checks for things that have gone wrong before. Exits nonzero if any of them fail.
+int check()
+{
+	const std::vector<std::pair<const char*, std::function<bool()>>> checks = {
+		{"threads over batch size", check_threads_over_batch},
+	};
+	int failed = 0;
+	for (const auto& [name, run] : checks) {
+		bool passed = run();
+		printf("%-40s %s\n", name, passed ? "ok" : "FAILED");
+		failed += !passed;
+	}
+	return failed > 0;
+}
+
 int main(int argc, char** argv)
 {
 	if (argc < 2) {
 		std::cout << "Invalid command! Either pass a special option or pass two integers - batch_size and epochs (in that order)."  << "\n";
 		exit(1);
 	}
+	else if (strcmp(argv[1], "hogwild") == 0 && argc >= 5) {
+		hogwild_bench(strtol(argv[2], NULL, 10), strtol(argv[3], NULL, 10), strtol(argv[4], NULL, 10));
+	}
+	else if (strcmp(argv[1], "sweep") == 0 && argc >= 4) {
+		sweep_bench(strtol(argv[2], NULL, 10), strtol(argv[3], NULL, 10));
+	}
+	else if (strcmp(argv[1], "serve") == 0 && argc >= 5) {
+		serve_bench(strtol(argv[2], NULL, 10), strtol(argv[3], NULL, 10), strtol(argv[4], NULL, 10));
+	}
+	else if (strcmp(argv[1], "quantize") == 0 && argc >= 4) {
+		quantize_bench(strtol(argv[2], NULL, 10), strtol(argv[3], NULL, 10));
+	}
+	else if (strcmp(argv[1], "prune") == 0 && argc >= 5) {
+		prune_bench(strtol(argv[2], NULL, 10), strtol(argv[3], NULL, 10), strtof(argv[4], NULL));
+	}
+	else if (strcmp(argv[1], "freeze") == 0 && argc >= 3) {
+		freeze_bench(strtol(argv[2], NULL, 10));
+	}
+	else if (strcmp(argv[1], "score") == 0 && argc >= 4) {
+		score_bench(strtol(argv[2], NULL, 10), strtol(argv[3], NULL, 10));
+	}
+	else if (strcmp(argv[1], "profile") == 0 && argc >= 4) {
+		profile_bench(strtol(argv[2], NULL, 10), strtol(argv[3], NULL, 10));
+	}
+	else if (strcmp(argv[1], "trace") == 0 && argc >= 4) {
+		trace_bench(strtol(argv[2], NULL, 10), strtol(argv[3], NULL, 10));
+	}
+	else if (strcmp(argv[1], "memory") == 0 && argc >= 4) {
+		memory_bench(strtol(argv[2], NULL, 10), strtol(argv[3], NULL, 10));
+	}
+	else if (strcmp(argv[1], "check") == 0) {
+		return check();
+	}
+	else if (strcmp(argv[1], "ring") == 0 && argc >= 6) {
+		ring_train(strtol(argv[2], NULL, 10), strtol(argv[3], NULL, 10), argv[4], strtol(argv[5], NULL, 10));
+	}
 	else {
 		sleep(strtol(argv[3], NULL, 10));
 		std::cout << bench(strtol(argv[1], NULL, 10), strtol(argv[2], NULL, 10)) << "\n";
@@ -0,0 +1,89 @@
+//
+//  arena.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <algorithm>
+#include <numeric>
+
+#include "bpnn.hpp"
+#include "arena.hpp"
+
+namespace Jacobian {
+inline size_t padded(size_t floats) {return (floats + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;}
+
+int Arena::reserve(int rows, int cols, int first_use, int last_use)
+{
+	Expects(rows > 0 && cols > 0 && first_use <= last_use);
+	slots.push_back({rows, cols, first_use, last_use, 0});
+	return slots.size() - 1;
+}
+
+// Greedy by size: the biggest buffers are placed first, each at the lowest offset that doesn't
+// collide with an already placed buffer it is live alongside.
+void Arena::plan()
+{
+	std::vector<int> order (slots.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+		return slots[a].rows * slots[a].cols > slots[b].rows * slots[b].cols;
+	});
+	std::vector<int> placed;
+	size_t end = 0;
+	for (int id : order) {
+		Slot& slot = slots[id];
+		size_t len = padded(slot.rows * slot.cols);
+		std::vector<std::pair<size_t, size_t>> taken;
+		for (int other : placed) {
+			const Slot& o = slots[other];
+			if (o.first_use <= slot.last_use && slot.first_use <= o.last_use)
+				taken.emplace_back(o.offset, o.offset + padded(o.rows * o.cols));
+		}
+		std::sort(taken.begin(), taken.end());
+		size_t offset = 0;
+		for (auto& [lo, hi] : taken) {
+			if (offset + len <= lo) break;
+			offset = std::max(offset, hi);
+		}
+		slot.offset = offset;
+		end = std::max(end, offset + len);
+		placed.push_back(id);
+	}
+	block.assign(end, 0);
+}
+
+void Arena::clear()
+{
+	slots.clear();
+	block.clear();
+	block.shrink_to_fit();
+}
+
+ArenaBuffer Arena::operator[](int id)
+{
+	Expects(id >= 0 && id < static_cast<int>(slots.size()) && !block.empty());
+	return ArenaBuffer(block.data() + slots[id].offset, slots[id].rows, slots[id].cols);
+}
+
+// Re-seats a map (e.g. a layer member) onto buffer id.
+void Arena::bind(ArenaBuffer& view, int id)
+{
+	new (&view) ArenaBuffer((*this)[id]);
+}
+
+// What buffer id takes up by itself, as the buffers it shares memory with are also counted by theirs.
+size_t Arena::bytes(int id) const
+{
+	Expects(id >= 0 && id < static_cast<int>(slots.size()));
+	return padded(slots[id].rows * slots[id].cols) * sizeof(float);
+}
+
+size_t Arena::naive_bytes() const
+{
+	size_t total = 0;
+	for (const Slot& slot : slots) total += padded(slot.rows * slot.cols);
+	return total * sizeof(float);
+}
+}
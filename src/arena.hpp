@@ -0,0 +1,61 @@
+//
+//  arena.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <Eigen/Dense>
+
+#include <vector>
+#include <cstddef>
+#include <new>
+
+namespace Jacobian {
+#define ARENA_ALIGN 16 // Buffer alignment in floats (64 bytes, one cache line).
+
+typedef Eigen::Map<Eigen::MatrixXf, Eigen::AlignedMax> ArenaBuffer;
+
+// Allocates on ARENA_ALIGN float boundaries, which Eigen's aligned_allocator only does up to
+// EIGEN_MAX_ALIGN_BYTES (16 or 32 bytes, depending on the instruction set).
+template <typename T>
+struct LineAllocator {
+	typedef T value_type;
+	static constexpr std::align_val_t alignment {ARENA_ALIGN * sizeof(float)};
+	LineAllocator() = default;
+	template <typename U> LineAllocator(const LineAllocator<U>&) {}
+	T* allocate(size_t n) {return static_cast<T*>(::operator new(n * sizeof(T), alignment));}
+	void deallocate(T* p, size_t) {::operator delete(p, alignment);}
+	template <typename U> bool operator==(const LineAllocator<U>&) const {return true;}
+	template <typename U> bool operator!=(const LineAllocator<U>&) const {return false;}
+};
+
+// Packs fixed-size float matrices into one aligned allocation. Every buffer is reserved with the
+// first and last step (in whatever unit the caller uses) at which it is live, and plan() lets
+// buffers whose lifetimes don't overlap share the same memory.
+class Arena {
+	struct Slot {
+		int rows;
+		int cols;
+		int first_use;
+		int last_use;
+		size_t offset;
+	};
+	std::vector<Slot> slots;
+	std::vector<float, LineAllocator<float>> block;
+public:
+	int reserve(int rows, int cols, int first_use, int last_use);
+	void plan();
+	void clear();
+	ArenaBuffer operator[](int id);
+	void bind(ArenaBuffer& view, int id);
+	int size() const {return slots.size();}
+	size_t peak_bytes() const {return block.size() * sizeof(float);}
+	size_t bytes(int id) const;
+	size_t naive_bytes() const;
+};
+}
+#endif /* ARENA_H */
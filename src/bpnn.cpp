@@ -7,7 +7,13 @@
 
 #include "bpnn.hpp"
 #include "utils.hpp"
+#include "predictor.hpp"
+#include "expression.hpp"
 #include <random>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <numeric>
 
 namespace Jacobian {
 Layer::Layer(int batch_sz, int nodes)
@@ -43,6 +49,34 @@ void Layer::init_weights(Layer next)
 	}
 }
 
+Workspace::Workspace(const std::vector<Layer>& layers, int rows)
+	:labels(Eigen::MatrixXf::Zero(rows, 1))
+{
+	for (const Layer& layer : layers) {
+		contents.push_back(Eigen::MatrixXf::Zero(rows, layer.contents.cols()));
+		dZ.push_back(Eigen::MatrixXf::Zero(rows, layer.contents.cols()));
+	}
+}
+
+BatchView Workspace::view()
+{
+	BatchView view {{}, {}, &labels, 0, static_cast<int>(labels.rows())};
+	for (int i = 0; i < static_cast<int>(contents.size()); i++) {
+		view.contents.push_back(&contents[i]);
+		view.dZ.push_back(&dZ[i]);
+	}
+	return view;
+}
+
+// No learning rate decay, and plain (momentum-less) updates, until init_decay() or init_optimizer().
+void Network::use_default_optimizer()
+{
+	decay = [](float&) -> void {};
+	update = [](Layer& layer, const Eigen::Ref<const Eigen::MatrixXf>& delta, const float learning_rate) {
+		layer.weights = (learning_rate * delta);
+	};
+}
+
 Network::Network(const char* path, int batch_sz, float learn_rate, float bias_rate, Regularization regularization, float l, float ratio, bool early_exit, float cutoff)
 	:batch_size(batch_sz), learning_rate(learn_rate), bias_lr(bias_rate), reg_type(regularization),
 	 lambda(l), early_stop(early_exit), threshold(cutoff)
@@ -56,18 +90,36 @@ Network::Network(const char* path, int batch_sz, float learn_rate, float bias_ra
 	data = open(TRAIN_BIN_PATH, O_RDONLY | O_NONBLOCK);
 	val_data = open(VAL_BIN_PATH, O_RDONLY | O_NONBLOCK);
 	instances = total_instances - val_instances;
-	decay = [](float& learning_rate) -> void {};
-	update = [](Layer& layer, const Eigen::MatrixXf delta, const float learning_rate) {
-		layer.weights = (learning_rate * delta);
-	};
+	use_default_optimizer();
 	// File descriptors are nonnegative integers and open() returns -1 on failure.
 	Ensures(batch_size < instances && data > 0 && val_data > 0);
 }
 
+// Trains on an already prepared dataset, which any number of networks can share; nothing is read
+// from or written to disk. The dataset decides the validation split.
+Network::Network(std::shared_ptr<Dataset> shared, int batch_sz, float learn_rate, float bias_rate, Regularization regularization, float l, bool early_exit, float cutoff)
+	:data(-1), val_data(-1), batch_size(batch_sz), learning_rate(learn_rate), bias_lr(bias_rate), reg_type(regularization),
+	 lambda(l), early_stop(early_exit), threshold(cutoff)
+{
+	Expects(shared && batch_size > 0 && learning_rate > 0 && bias_rate > 0 && l >= 0);
+	dataset = shared;
+	instances = dataset->train_instances;
+	val_instances = dataset->val_instances;
+	use_default_optimizer();
+	Ensures(batch_size < instances);
+}
+
 Network::~Network()
 {
-	close(data);
-	close(val_data);
+	if (pending_validation.valid()) pending_validation.wait();
+	if (tracer) {
+		try {
+			tracer->write();
+		}
+		catch (const std::runtime_error&) {} // Nowhere to report it from a destructor.
+	}
+	if (data >= 0) close(data);
+	if (val_data >= 0) close(val_data);
 }
 
 void Network::add_layer(int nodes, std::function<float(float)> activation, std::function<float(float)> activation_deriv)
@@ -82,8 +134,31 @@ void Network::add_layer(int nodes, std::function<float(float)> activation, std::
 void Network::initialize()
 {
 	Expects(length > 1);
-	labels = new Eigen::MatrixXf (batch_size,layers[length-1].contents.cols());
+	if (dataset && dataset->width != layers[0].contents.cols() + 1)
+		throw std::runtime_error{"The input layer doesn't match the dataset's features."};
+	labels = Eigen::MatrixXf::Zero(batch_size, layers[length-1].contents.cols());
 	for (int i = 0; i < length-1; i++) layers[i].init_weights(layers[i+1]);
+	plan_backprop(scratch, 0, batch_size, false);
+}
+
+// Backprop step k computes the error of layer length-2-k from the previous one and then updates that
+// layer's weights, so an error buffer is live for two steps and a weight delta for one. Deltas that
+// are reduced across shards before the update have to survive until the end instead, and when steps
+// run out of order (the task graph) nothing can share.
+void Network::plan_backprop(BackpropBuffers& buffers, int first, int rows, bool keep_deltas, bool keep_gradients)
+{
+	buffers.first = first;
+	buffers.rows = rows;
+	buffers.arena.clear();
+	buffers.gradient_ids.clear();
+	buffers.delta_ids.clear();
+	for (int k = 0; k < length-1; k++) {
+		buffers.gradient_ids.push_back(buffers.arena.reserve(rows, layers[length-1-k].contents.cols(),
+															 keep_gradients ? 0 : std::max(k-1, 0), keep_gradients ? length-1 : k));
+		buffers.delta_ids.push_back(buffers.arena.reserve(layers[length-2-k].contents.cols(), layers[length-1-k].contents.cols(),
+														  k, keep_deltas ? length-1 : k));
+	}
+	buffers.arena.plan();
 }
 
 void Network::set_activation(int index, std::function<float(float)> custom, std::function<float(float)> custom_deriv)
@@ -91,45 +166,124 @@ void Network::set_activation(int index, std::function<float(float)> custom, std:
 	Expects(index >= 0 && index < length);
 	layers[index].activation = custom;
 	layers[index].activation_deriv = custom_deriv;
+	layers[index].array_activation = nullptr;
+	layers[index].array_activation_deriv = nullptr;
 }
 
-void Network::softmax()
+// Each function gets a block of the layer's values before activation and overwrites it in place.
+// Anything that only knows per-element activations (quantization, say) gets them applied one at a
+// time, which works but is slow.
+void Network::set_array_activation(int index, ArrayActivation custom, ArrayActivation custom_deriv)
+{
+	Expects(index >= 0 && index < length && custom && custom_deriv);
+	auto single = [](ArrayActivation f) {
+		return [f](float x) {
+			Eigen::MatrixXf value = Eigen::MatrixXf::Constant(1, 1, x);
+			f(value);
+			return value(0, 0);
+		};
+	};
+	layers[index].activation = single(custom);
+	layers[index].activation_deriv = single(custom_deriv);
+	layers[index].array_activation = custom;
+	layers[index].array_activation_deriv = custom_deriv;
+}
+
+// Compiles an expression in x (see Expression) into a vectorised activation. The derivative is
+// derived symbolically unless one is given.
+void Network::set_expression(int index, const std::string& expression, const std::string& derivative)
 {
-	for (int i = 0; i < layers[length-1].contents.rows(); i++) {
-		Eigen::MatrixXf m = layers[length-1].contents.block(i,0,1,layers[length-1].contents.cols());
+	Expects(index >= 0 && index < length);
+	auto f = std::make_shared<const Expression>(expression);
+	auto f_deriv = std::make_shared<const Expression>(derivative.empty() ? f->derivative() : Expression(derivative));
+	set_array_activation(index, [f](Eigen::Ref<Eigen::MatrixXf> values) {f->apply(values);},
+						 [f_deriv](Eigen::Ref<Eigen::MatrixXf> values) {f_deriv->apply(values);});
+	layers[index].activation = [f](float x) {return (*f)(x);};
+	layers[index].activation_deriv = [f_deriv](float x) {return (*f_deriv)(x);};
+}
+
+BatchView Network::own_view(int first, int rows)
+{
+	BatchView view {{}, {}, &labels, first, rows};
+	for (Layer& layer : layers) {
+		view.contents.push_back(&layer.contents);
+		view.dZ.push_back(&layer.dZ);
+	}
+	return view;
+}
+
+// Records the derivative and then applies the activation, in place, to a block of a layer.
+inline void activate(const Layer& layer, Eigen::Ref<Eigen::MatrixXf> contents, Eigen::Ref<Eigen::MatrixXf> dZ)
+{
+	if (layer.array_activation) {
+		dZ = contents;
+		layer.array_activation_deriv(dZ);
+		layer.array_activation(contents);
+		return;
+	}
+	for (int k = 0; k < contents.cols(); k++) {
+		for (int j = 0; j < contents.rows(); j++) {
+			dZ(j,k) = layer.activation_deriv(contents(j,k));
+			contents(j,k) = layer.activation(contents(j,k));
+		}
+	}
+}
+
+void Network::softmax(const BatchView& view)
+{
+	PROFILE(Phase::softmax);
+	TRACE(tracer.get(), "softmax", length-1);
+	Eigen::MatrixXf& out = *view.contents[length-1];
+	for (int i = view.first; i < view.first + view.rows; i++) {
+		Eigen::MatrixXf m = out.block(i,0,1,out.cols());
 		Eigen::MatrixXf::Index maxRow, maxCol;
 		float max = m.maxCoeff(&maxRow, &maxCol);
 		m = (m.array() - max).matrix();
 		float sum = 0;
-		for (int j = 0; j < layers[length-1].contents.cols(); j++) {
+		for (int j = 0; j < out.cols(); j++) {
 			sum += exp(m(0,j));
 		}
-		for (int j = 0; j < layers[length-1].contents.cols(); j++) {
+		for (int j = 0; j < out.cols(); j++) {
 			m(0,j) = exp(m(0,j))/sum;
 		}
-		layers[length-1].contents.block(i,0,1,layers[length-1].contents.cols()) = m;
+		out.block(i,0,1,out.cols()) = m;
 	}
 }
 
-void Network::feedforward()
+void Network::softmax()
 {
-	for (int i = 0; i < length-1; i++) {
-		for (int j = 0; j < layers[i].contents.rows(); j++) {
-			for (int k = 0; k < layers[i].contents.cols(); k++) {
-				layers[i].dZ(j,k) = layers[i].activation_deriv(layers[i].contents(j,k));
-				layers[i].contents(j,k) = layers[i].activation(layers[i].contents(j,k));
-			}
-		}
-		layers[i+1].contents = layers[i].contents * layers[i].weights;
-		layers[i+1].contents += layers[i+1].bias;
-	}
-	for (int j = 0; j < layers[length-1].contents.rows(); j++) {
-		for (int k = 0; k < layers[length-1].contents.cols(); k++) {
-			layers[length-1].dZ(j,k) = layers[length-1].activation_deriv(layers[length-1].contents(j,k));
-			layers[length-1].contents(j,k) = layers[length-1].activation(layers[length-1].contents(j,k));
-		}
+	softmax(own_view(0, batch_size));
+}
+
+// Runs the weights of layers from to to-1, finishing with the output activation and softmax if to
+// is the output layer.
+void Network::forward(const std::vector<Layer>& params, const BatchView& view, int from, int to)
+{
+	for (int i = from; i < to; i++) {
+		TRACE(tracer.get(), "forward", i);
+		activate(params[i], view.contents[i]->middleRows(view.first, view.rows), view.dZ[i]->middleRows(view.first, view.rows));
+		multiply_weights(params, i, view.contents[i]->middleRows(view.first, view.rows), view.contents[i+1]->middleRows(view.first, view.rows));
+		view.contents[i+1]->middleRows(view.first, view.rows) += params[i+1].bias.middleRows(view.bias_row(), view.rows);
 	}
-	softmax();
+	if (to < length-1) return;
+	TRACE(tracer.get(), "forward", length-1);
+	activate(params[length-1], view.contents[length-1]->middleRows(view.first, view.rows), view.dZ[length-1]->middleRows(view.first, view.rows));
+	softmax(view);
+}
+
+void Network::forward(const std::vector<Layer>& params, const BatchView& view)
+{
+	forward(params, view, 0, length-1);
+}
+
+void Network::forward(const BatchView& view)
+{
+	forward(layers, view);
+}
+
+void Network::feedforward()
+{
+	forward(own_view(0, batch_size));
 }
 
 std::function<void(float&)> decays::step(float a_0, float k)
@@ -190,43 +344,60 @@ void Network::list_net()
 			  << "\n\n\u001b[31BIASES:\x1B[0;37m\n" << layers[length-1].bias <<  "\n\n\n";
 }
 
-float Network::cost()
+float Network::cost(const std::vector<Layer>& params, const BatchView& view)
 {
+	Eigen::MatrixXf& out = *view.contents[length-1];
 	float sum = 0;
 	float reg = 0; // Regularization term
-	for (int i = 0; i < layers[length-1].contents.rows(); i++) {
+	for (int i = view.first; i < view.first + view.rows; i++) {
 		float tempsum = 0;
-		for (int j = 0; j < layers[length-1].contents.cols(); j++) {
+		for (int j = 0; j < out.cols(); j++) {
 			float truth;
-			if (j==(*labels)(i,0)) truth = 1;
+			if (j==(*view.labels)(i,0)) truth = 1;
 			else truth = 0;
-			if (layers[length-1].contents(i,j) == 0) layers[length-1].contents(i,j) += 0.00001;
-			tempsum += truth * log(layers[length-1].contents(i,j));
+			if (out(i,j) == 0) out(i,j) += 0.00001;
+			tempsum += truth * log(out(i,j));
 		}
 		sum-=tempsum;
 	}
-	for (unsigned long i = 0; i < layers.size()-1; i++) {
-		if (reg_type == Regularization::L2) reg += layers[i].weights.cwiseProduct(layers[i].weights).sum();
-		else if (reg_type == Regularization::L1) reg += (layers[i].weights.array().abs().matrix()).sum();
+	for (unsigned long i = 0; i < params.size()-1; i++) {
+		if (reg_type == Regularization::L2) reg += params[i].weights.cwiseProduct(params[i].weights).sum();
+		else if (reg_type == Regularization::L1) reg += (params[i].weights.array().abs().matrix()).sum();
 	}
-	return ((1.0/batch_size) * sum) + (1/2*lambda*reg);
+	return ((1.0/view.rows) * sum) + (1/2*lambda*reg);
 }
 
-float Network::accuracy()
+float Network::cost(const BatchView& view)
+{
+	return cost(layers, view);
+}
+
+float Network::cost()
+{
+	return cost(own_view(0, batch_size));
+}
+
+float Network::accuracy(const BatchView& view)
 {
+	const Eigen::MatrixXf& out = *view.contents[length-1];
 	float correct = 0;
-	for (int i = 0; i < layers[length-1].contents.rows(); i++) {
+	for (int i = view.first; i < view.first + view.rows; i++) {
 		float ans = -INFINITY;
 		float index = -1;
-		for (int j = 0; j < layers[length-1].contents.cols(); j++) {
-			if (layers[length-1].contents(i, j) > ans) {
-				ans = layers[length-1].contents(i, j);
+		for (int j = 0; j < out.cols(); j++) {
+			if (out(i, j) > ans) {
+				ans = out(i, j);
 				index = j;
 			}
 		}
-		if ((*labels)(i, 0) == index) correct += 1;
+		if ((*view.labels)(i, 0) == index) correct += 1;
 	}
-	return (1.0/batch_size) * correct;
+	return (1.0/view.rows) * correct;
+}
+
+float Network::accuracy()
+{
+	return accuracy(own_view(0, batch_size));
 }
 
 Eigen::MatrixXf l1_deriv(Eigen::MatrixXf m)
@@ -241,60 +412,413 @@ Eigen::MatrixXf l1_deriv(Eigen::MatrixXf m)
 	return r;
 }
 
-Eigen::MatrixXf Network::backpropagate()
+void Network::output_error(const BatchView& view, Eigen::Ref<Eigen::MatrixXf> error)
 {
-	std::vector<Eigen::MatrixXf> gradients;
-	std::vector<Eigen::MatrixXf> deltas;
-	Eigen::MatrixXf error (layers[length-1].contents.rows(), layers[length-1].contents.cols());
+	const Eigen::MatrixXf& out = *view.contents[length-1];
 	for (int i = 0; i < error.rows(); i++) {
 		for (int j = 0; j < error.cols(); j++) {
 			float truth;
-			if (j==(*labels)(i,0)) truth = 1;
+			if (j==(*view.labels)(view.first+i,0)) truth = 1;
 			else truth = 0;
-			error(i,j) = layers[length-1].contents(i,j) - truth;
+			error(i,j) = out(view.first+i,j) - truth;
 		}
 	}
-	gradients.push_back(error);
-	deltas.push_back(layers[length-2].contents.transpose() * gradients[0]);
-	int counter = 1;
-	for (int i = length-2; i >= 1; i--) {
+}
+
+// Propagates the error at layer i+1 back to layer i through layer i's current weights.
+void Network::back_error(const std::vector<Layer>& params, const BatchView& view, int i, const Eigen::Ref<const Eigen::MatrixXf>& gradient, Eigen::Ref<Eigen::MatrixXf> next)
+{
+	if (&params == &layers && sparse.size() > 0 && sparse[i]) {
+		sparse[i]->multiply_transposed(gradient, next);
+		next.array() *= view.dZ[i]->middleRows(view.first, view.rows).array();
+	}
+	else next.noalias() = (gradient * params[i].weights.transpose()).cwiseProduct(view.dZ[i]->middleRows(view.first, view.rows));
+}
+
+void Network::weight_delta(const BatchView& view, int i, const Eigen::Ref<const Eigen::MatrixXf>& gradient, Eigen::Ref<Eigen::MatrixXf> delta)
+{
+	if (sparse.size() > 0 && sparse[i]) sparse[i]->masked_delta(view.contents[i]->middleRows(view.first, view.rows), gradient, delta);
+	else delta.noalias() = view.contents[i]->middleRows(view.first, view.rows).transpose() * gradient;
+}
+
+// Layer i's outgoing weights times in. Pruned layers only take the sparse path with the network's
+// own weights; replicas and snapshots stay dense (their pruned weights are zero all the same).
+void Network::multiply_weights(const std::vector<Layer>& params, int i, const Eigen::Ref<const Eigen::MatrixXf>& in, Eigen::Ref<Eigen::MatrixXf> out)
+{
+	if (&params == &layers && sparse.size() > 0 && sparse[i]) sparse[i]->multiply(in, out);
+	else out.noalias() = in * params[i].weights;
+}
+
+void Network::apply_update(int i, const Eigen::Ref<const Eigen::MatrixXf>& delta)
+{
+	PROFILE(Phase::update);
+	TRACE(tracer.get(), "update", i);
+	update(layers[i], delta, learning_rate);
+	if (reg_type == Regularization::L2) layers[i].weights -= ((lambda/batch_size) * (layers[i].weights));
+	else if (reg_type == Regularization::L1) layers[i].weights -= ((lambda/(2*batch_size)) * l1_deriv(layers[i].weights));
+	if (masks.empty()) return;
+	layers[i].weights.array() *= masks[i].array();
+	if (sparse[i]) sparse[i]->refresh(layers[i].weights);
+}
+
+// Backprop over the rows of view. With apply set, each layer is updated as soon as its delta is
+// ready; otherwise the deltas are left in buffers for the caller to reduce. Biases are per row, so
+// they are always updated here. ready(k), if given, is called once step k's delta and bias are done.
+// Errors are propagated through params' weights, which must hold the same values as the network's
+// (i.e. be a replica) if apply is set.
+void Network::backprop_rows(const std::vector<Layer>& params, const BatchView& view, BackpropBuffers& buffers, bool apply, const std::function<void(int)>& ready)
+{
+	output_error(view, buffers.arena[buffers.gradient_ids[0]]);
+	for (int k = 0; k < length-1; k++) {
+		int i = length-2-k; // Layer whose outgoing weights this step updates.
+		TRACE(tracer.get(), "backward", i);
+		ArenaBuffer gradient = buffers.arena[buffers.gradient_ids[k]];
 		// TODO: Add nesterov momentum | -p B -t conundrum -t coding -m Without causing segmentation faults.
-		// (*layers[i].weights-((learning_rate * *layers[i].weights) + (0.9 * *layers[i].v))).transpose()
-		//grad_calc(gradients, counter, i)
-		gradients.push_back((gradients[counter-1] * layers[i].weights.transpose()).cwiseProduct(layers[i].dZ));
-		deltas.push_back(layers[i-1].contents.transpose() * gradients[counter]);
-		counter++;
+		// The next error has to see this layer's weights before they're updated.
+		if (i >= 1) back_error(params, view, i, gradient, buffers.arena[buffers.gradient_ids[k+1]]);
+		ArenaBuffer delta = buffers.arena[buffers.delta_ids[k]];
+		weight_delta(view, i, gradient, delta);
+		if (apply) apply_update(i, delta);
+		layers[i+1].bias.middleRows(view.bias_row(), view.rows) -= bias_lr * gradient;
+		if (ready) ready(k);
+	}
+}
+
+void Network::backprop_rows(const BatchView& view, BackpropBuffers& buffers, bool apply, const std::function<void(int)>& ready)
+{
+	backprop_rows(layers, view, buffers, apply, ready);
+}
+
+Eigen::MatrixXf Network::backpropagate()
+{
+	backprop_rows(own_view(0, batch_size), scratch, true);
+	return scratch.arena[scratch.gradient_ids[length-2]];
+}
+
+// Softmax outputs for any number of rows of input, with none of the training machinery: no dZ, no
+// per-row biases (they are averaged) and no fixed batch size.
+Eigen::MatrixXf Network::predict(const Eigen::Ref<const Eigen::MatrixXf>& input)
+{
+	if (!predictor) predictor = std::make_unique<Predictor>(*this);
+	else predictor->refresh(*this);
+	return predictor->predict(input);
+}
+
+RowMatrixXf Network::predict_rows(const Eigen::Ref<const RowMatrixXf>& input)
+{
+	if (!predictor) predictor = std::make_unique<Predictor>(*this);
+	else predictor->refresh(*this);
+	RowMatrixXf output (input.rows(), predictor->outputs());
+	predictor->predict_rows(input, output);
+	return output;
+}
+
+void Network::save(const char* path, bool optimizer_state) const
+{
+	Checkpoint::save(*this, path, optimizer_state);
+}
+
+// Builds the layers from the checkpoint if none were added yet; otherwise they have to match it. A
+// checkpoint saved with another batch size has its biases averaged and broadcast over this one's rows.
+void Network::load(const Checkpoint& checkpoint)
+{
+	if (length == 0) {
+		for (int i = 0; i < checkpoint.layers(); i++) {
+			const activations::Named* named = activations::find(checkpoint.activation(i));
+			add_layer(checkpoint.nodes(i), named->activation, named->activation_deriv);
+		}
+		initialize();
+	}
+	Expects(length == checkpoint.layers());
+	masks.clear();
+	sparse.clear();
+	for (int i = 0; i < length; i++) {
+		Expects(layers[i].contents.cols() == checkpoint.nodes(i));
+		auto bias = checkpoint.bias(i);
+		if (bias.rows() == batch_size) layers[i].bias = bias;
+		else if (bias.size() > 0) layers[i].bias = bias.colwise().mean().replicate(batch_size, 1);
+		if (i == length-1) continue;
+		layers[i].weights = checkpoint.weights(i);
+		if (checkpoint.has_optimizer_state()) {
+			layers[i].m = checkpoint.m(i);
+			layers[i].v = checkpoint.v(i);
+		}
+	}
+}
+
+void Network::load(const char* path)
+{
+	Checkpoint checkpoint (path);
+	load(checkpoint);
+}
+
+void Network::set_pruning(const PruningSchedule& pruning)
+{
+	Expects(pruning.target >= 0 && pruning.target < 1 && pruning.initial >= 0 && pruning.initial <= pruning.target &&
+			pruning.start >= 0 && pruning.end >= pruning.start && pruning.frequency > 0);
+	schedule = pruning;
+	scheduled_pruning = true;
+}
+
+// Runs at the end of each epoch, before validation, so validation sees the pruned network.
+void Network::prune_epoch()
+{
+	if (epochs < schedule.start || epochs > schedule.end) return;
+	if ((epochs - schedule.start) % schedule.frequency != 0 && epochs != schedule.end) return;
+	float progress = schedule.end == schedule.start ? 1 : static_cast<float>(epochs - schedule.start) / (schedule.end - schedule.start);
+	prune(schedule.target + (schedule.initial - schedule.target) * std::pow(1 - progress, 3));
+}
+
+// Masks each layer's smallest weights (and their optimizer state) so that sparsity of them are zero.
+// Weights pruned earlier stay pruned. Layers whose density drops below the schedule's sparse_below
+// switch to CSR; their pattern is rebuilt here and only here.
+void Network::prune(float sparsity)
+{
+	Expects(length > 1 && sparsity >= 0 && sparsity < 1);
+	masks.resize(length-1);
+	sparse.resize(length-1);
+	for (int i = 0; i < length-1; i++) {
+		Layer& layer = layers[i];
+		Eigen::MatrixXf mask = magnitude_mask(layer.weights, sparsity);
+		masks[i] = masks[i].size() > 0 ? masks[i].cwiseProduct(mask) : mask;
+		layer.weights.array() *= masks[i].array();
+		if (layer.m.size() == masks[i].size()) layer.m.array() *= masks[i].array();
+		if (layer.v.size() == masks[i].size()) layer.v.array() *= masks[i].array();
+		if (masks[i].mean() < schedule.sparse_below) sparse[i] = std::make_unique<SparseWeights>(layer.weights, masks[i]);
+		else sparse[i].reset();
 	}
+}
+
+// Times one batch's forward product through each layer both ways, whether or not it has switched.
+std::vector<SparsityReport> Network::sparsity_report()
+{
+	std::vector<SparsityReport> report;
+	auto time = [](const std::function<void()>& product) {
+		const int repeats = 20;
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < repeats; r++) product();
+		std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count() / repeats;
+	};
 	for (int i = 0; i < length-1; i++) {
-		update(layers[length-2-i], deltas[i], learning_rate);
-		if (reg_type == Regularization::L2) layers[length-2-i].weights -= ((lambda/batch_size) * (layers[length-2-i].weights));
-		else if (reg_type == Regularization::L1) layers[length-2-i].weights -= ((lambda/(2*batch_size)) * l1_deriv(layers[length-2-i].weights));
-		layers[length-1-i].bias -= bias_lr * gradients[i];
+		const Eigen::MatrixXf& weights = layers[i].weights;
+		Eigen::MatrixXf mask = static_cast<int>(masks.size()) > i ? masks[i] : (weights.array() != 0).cast<float>().matrix();
+		SparseWeights csr (weights, mask);
+		Eigen::MatrixXf in = Eigen::MatrixXf::Random(batch_size, weights.rows());
+		Eigen::MatrixXf out (batch_size, weights.cols());
+		double dense_us = time([&] {out.noalias() = in * weights;});
+		double sparse_us = time([&] {csr.multiply(in, out);});
+		report.push_back({i, static_cast<int>(weights.rows()), static_cast<int>(weights.cols()), 1 - csr.density(),
+						  static_cast<int>(sparse.size()) > i && sparse[i] != nullptr, dense_us, sparse_us,
+						  static_cast<float>(dense_us / sparse_us)});
+	}
+	return report;
+}
+
+void Network::set_threads(int threads, int shard_num)
+{
+	Expects(threads > 0 && shard_num >= 0 && shard_num <= batch_size);
+	if (threads == 1 && shard_num <= 1) pool.reset();
+	else make_pool(threads);
+	shard_count = shard_num > 0 ? shard_num : std::min(threads, batch_size); // Every shard needs a row.
+	shards.clear();
+	step_graph.clear();
+}
+
+void Network::make_pool(int threads)
+{
+	if (!numa) {
+		worker_cpus.clear();
+		pool = std::make_shared<ThreadPool>(threads);
+		return;
 	}
-	return gradients.back();
+	topology = Topology::detect();
+	worker_cpus = topology.place(threads);
+	pool = std::make_shared<ThreadPool>(threads, worker_cpus);
+	if (silenced == false) printf("%s", topology.describe(worker_cpus).c_str());
+}
+
+// NUMA mode pins the pool's workers, filling one node before the next, and runs every shard on the
+// same worker each step, on activation and backprop buffers which that worker allocated and so first
+// touched on its own node. With replicate_weights, shards also read weights and biases from a copy
+// on their node, refreshed after every update, rather than from wherever the originals live.
+void Network::set_numa(bool enabled, bool replicate_weights)
+{
+	numa = enabled;
+	replicate = enabled && replicate_weights;
+	shards.clear();
+	shard_workspaces.clear();
+	replicas.clear();
+	step_graph.clear();
+	if (pool) make_pool(pool->size());
+}
+
+void Network::plan_shards()
+{
+	shards.resize(shard_count);
+	shard_workspaces.clear();
+	shard_workspaces.resize(numa ? shard_count : 0);
+	auto plan = [this](int s) {
+		int first = s * batch_size / shard_count;
+		plan_backprop(shards[s], first, (s+1) * batch_size / shard_count - first, true);
+		if (numa) shard_workspaces[s] = std::make_unique<Workspace>(layers, shards[s].rows);
+	};
+	if (numa) pool->parallel_for(shard_count, plan, true);
+	else for (int s = 0; s < shard_count; s++) plan(s);
+	replicas.clear();
+	replicas.resize(replicate ? topology.nodes() : 0);
+	refresh_replicas();
+}
+
+// Each node's replica is written by the first worker on that node, so that is where it lives.
+void Network::refresh_replicas()
+{
+	std::vector<std::future<void>> pending;
+	for (int node = 0; node < static_cast<int>(replicas.size()); node++) {
+		auto owner = std::find_if(worker_cpus.begin(), worker_cpus.end(), [this, node](int cpu) {return topology.node_of(cpu) == node;});
+		if (owner == worker_cpus.end()) continue;
+		pending.push_back(pool->submit_to(owner - worker_cpus.begin(), [this, node] {
+			std::vector<Layer>& replica = replicas[node];
+			for (int i = 0; i < length; i++) {
+				if (static_cast<int>(replica.size()) == i) {
+					replica.emplace_back(1, layers[i].contents.cols());
+					replica[i].activation = layers[i].activation;
+					replica[i].activation_deriv = layers[i].activation_deriv;
+					replica[i].array_activation = layers[i].array_activation;
+					replica[i].array_activation_deriv = layers[i].array_activation_deriv;
+				}
+				replica[i].weights = layers[i].weights;
+				replica[i].bias = layers[i].bias;
+			}
+		}));
+	}
+	for (std::future<void>& result : pending) result.get();
+}
+
+// Forward and backward passes run on disjoint row ranges of the batch, one shard per task, each
+// with private deltas. The deltas are then summed pairwise in a fixed tree so the result depends
+// only on the shard count (never on thread timing) before a single optimizer step per layer.
+void Network::parallel_step()
+{
+	if (static_cast<int>(shards.size()) != shard_count) plan_shards();
+	pool->parallel_for(shard_count, [this](int s) {
+		if (!numa) {
+			BatchView view = own_view(shards[s].first, shards[s].rows);
+			forward(view);
+			backprop_rows(view, shards[s], false);
+			return;
+		}
+		// The workspace holds just the shard's rows of the batch, which are copied in, and its outputs
+		// are copied back for cost() and accuracy().
+		const int first = shards[s].first;
+		const int rows = shards[s].rows;
+		Workspace& workspace = *shard_workspaces[s];
+		BatchView view = workspace.view();
+		view.bias_first = first;
+		workspace.contents[0] = layers[0].contents.middleRows(first, rows);
+		workspace.labels = labels.middleRows(first, rows);
+		const std::vector<Layer>& params = replicate ? replicas[topology.node_of(worker_cpus[s % pool->size()])] : layers;
+		forward(params, view);
+		backprop_rows(params, view, shards[s], false);
+		layers[length-1].contents.middleRows(first, rows) = workspace.contents[length-1];
+	}, numa);
+	for (int stride = 1; stride < shard_count; stride *= 2) {
+		pool->parallel_for(shard_count, [this, stride](int s) {
+			if (s % (2*stride) != 0 || s + stride >= shard_count) return;
+			for (int k = 0; k < length-1; k++)
+				shards[s].arena[shards[s].delta_ids[k]] += shards[s+stride].arena[shards[s+stride].delta_ids[k]];
+		}, numa);
+	}
+	for (int k = 0; k < length-1; k++) apply_update(length-2-k, shards[0].arena[shards[0].delta_ids[k]]);
+	if (replicate) refresh_replicas();
 }
 
 #include "data.cpp"
 
+// Runs the validation set through params on buffers of its own, so it never touches the training
+// batch and is safe to run on another thread as long as params doesn't change underneath it.
+Validation Network::evaluate(const std::vector<Layer>& params, int epoch)
+{
+	Validation result {epoch, 0, 0};
+	int count = val_instances / batch_size;
+	if (count == 0) return result;
+	TraceContext context (0, epoch); // Events are tagged with the epoch whose weights these are.
+	TRACE(tracer.get(), "validate", -1);
+	Workspace workspace (params, batch_size);
+	BatchView view = workspace.view();
+	for (int b = 0; b < count; b++) {
+		TraceContext batch_context (b, epoch);
+		read_batch(true, b, view);
+		forward(params, view);
+		result.cost += cost(params, view);
+		result.acc += accuracy(view);
+	}
+	result.cost /= count;
+	result.acc /= count;
+	return result;
+}
+
 void Network::validate(const char* path)
 {
 	if (val_instances == 0) return;
-	float costsum = 0;
-	float accsum = 0;
-	for (int i = 0; i <= val_instances-batch_size; i+=batch_size) {
-		next_batch(val_data);
-		feedforward();
-		costsum += cost();
-		accsum += accuracy();
-	}
-	val_acc = 1.0/(static_cast<float>(val_instances/batch_size)) * accsum;
-	val_cost = 1.0/(static_cast<float>(val_instances/batch_size)) * costsum;
-	val_data = open(VAL_BIN_PATH, O_RDONLY | O_NONBLOCK);
-	Ensures(lseek(val_data, 0, SEEK_CUR) == 0);
+	Validation result = evaluate(layers, epochs);
+	val_acc = result.acc;
+	val_cost = result.cost;
+}
+
+// Validates a snapshot of the current weights on a background thread. Only parameters are copied;
+// the snapshot's activation buffers are a single row since evaluate() brings its own.
+std::future<Validation> Network::validate_async()
+{
+	std::vector<Layer> snapshot;
+	for (const Layer& layer : layers) {
+		snapshot.emplace_back(1, layer.contents.cols());
+		snapshot.back().weights = layer.weights;
+		snapshot.back().bias = layer.bias;
+		snapshot.back().activation = layer.activation;
+		snapshot.back().activation_deriv = layer.activation_deriv;
+		snapshot.back().array_activation = layer.array_activation;
+		snapshot.back().array_activation_deriv = layer.array_activation_deriv;
+	}
+	return std::async(std::launch::async, [this, snapshot = std::move(snapshot), epoch = epochs] {
+		return evaluate(snapshot, epoch);
+	});
+}
+
+// When enabled, train() validates each epoch in the background while the next one trains. Results
+// are collected (and passed to callback, on the training thread) at the end of the next epoch or
+// by wait_validation().
+void Network::set_async_validation(bool enabled, std::function<void(Validation)> callback)
+{
+	wait_validation();
+	async_validation = enabled;
+	validation_callback = callback;
+}
+
+void Network::collect_validation()
+{
+	if (!pending_validation.valid()) return;
+	Validation result = pending_validation.get();
+	pending_validation = std::shared_future<Validation>();
+	val_acc = result.acc;
+	val_cost = result.cost;
+	if (silenced == false)
+		printf("Validation for epoch %i - val_cost %f - val_acc %f\n", result.epoch, val_cost, val_acc);
+	if (validation_callback) validation_callback(result);
+}
+
+void Network::wait_validation()
+{
+	collect_validation();
 }
 
 void Network::interactive_next_batch()
 {
+	if (dataset) {
+		read_batch(false, batches % (instances / batch_size), own_view(0, batch_size));
+		batches++;
+		return;
+	}
 	if (batches < instances/batch_size-batch_size) next_batch(data);
 	else {
 		batches = 0;
@@ -304,31 +828,547 @@ void Network::interactive_next_batch()
 	batches++;
 }
 
+// Starts the profile of a new epoch, on the calling thread. RECKLESS builds only measure memory.
+ProfileScope Network::profile_epoch()
+{
+	memory_epoch.start(memory, epochs);
+#if (!RECKLESS)
+	profile = Profile{};
+	profile.epoch = epochs;
+	if (count_hardware && !counters->owned_by_caller()) counters = std::make_unique<PerfCounters>();
+	return ProfileScope(profile, count_hardware ? counters.get() : nullptr);
+#else
+	return ProfileScope(profile);
+#endif
+}
+
+// Counts hardware events per phase from the next epoch on, if the system lets us. Returns whether
+// any counters could be opened; the profile just goes without them otherwise, and RECKLESS builds
+// never open them.
+bool Network::set_counters(bool enabled)
+{
+#if (RECKLESS)
+	enabled = false;
+#endif
+	count_hardware = enabled;
+	if (!enabled) {
+		counters.reset();
+		return false;
+	}
+	if (!counters || !counters->owned_by_caller()) counters = std::make_unique<PerfCounters>();
+	return counters->any();
+}
+
+// Records a timeline of training on every thread from now on, for write_trace() (or the
+// destructor) to write to path as Chrome trace events. An empty path stops and drops it.
+void Network::set_tracing(const std::string& path)
+{
+	if (pending_validation.valid()) pending_validation.wait();
+	tracer.reset();
+	if (!path.empty()) tracer = std::make_unique<Tracer>(path);
+}
+
+// Writes everything traced so far. Not while training, but background validation is waited for.
+void Network::write_trace()
+{
+	if (!tracer) throw std::runtime_error{"write_trace() needs set_tracing() first."};
+	if (pending_validation.valid()) pending_validation.wait();
+	tracer->write();
+}
+
+inline size_t matrix_bytes(const Eigen::MatrixXf& m) {return m.size() * sizeof(float);}
+
+// The buffers as they are now, along with the last epoch's measurements.
+MemoryReport Network::memory_report() const
+{
+	MemoryReport report = memory;
+	report.layers.assign(length, LayerMemory{});
+	for (int i = 0; i < length; i++) {
+		const Layer& layer = layers[i];
+		LayerMemory& used = report.layers[i];
+		used.add(Category::activations, matrix_bytes(layer.contents) + matrix_bytes(layer.dZ));
+		used.add(Category::params, matrix_bytes(layer.weights) + matrix_bytes(layer.bias));
+		if (i < static_cast<int>(masks.size())) used.add(Category::params, matrix_bytes(masks[i]));
+		if (i < static_cast<int>(sparse.size()) && sparse[i]) used.add(Category::params, sparse[i]->bytes());
+		used.add(Category::optimizer, matrix_bytes(layer.m) + matrix_bytes(layer.v));
+	}
+	// Backprop buffer k holds the gradient for layer length-1-k and the delta for the weights of
+	// layer length-2-k.
+	for (size_t k = 0; k < scratch.gradient_ids.size(); k++) {
+		report.layers[length-1-k].add(Category::scratch, scratch.arena.bytes(scratch.gradient_ids[k]));
+		report.layers[length-2-k].add(Category::scratch, scratch.arena.bytes(scratch.delta_ids[k]));
+	}
+	report.totals.fill(0);
+	for (const LayerMemory& used : report.layers) {
+		for (int c = 0; c < MEMORY_CATEGORIES; c++) {
+			if (c != static_cast<int>(Category::scratch)) report.totals[c] += used.bytes[c];
+		}
+	}
+	size_t& activations = report.totals[static_cast<int>(Category::activations)];
+	activations += matrix_bytes(labels);
+	for (const std::unique_ptr<Workspace>& workspace : shard_workspaces) {
+		activations += matrix_bytes(workspace->labels);
+		for (size_t i = 0; i < workspace->contents.size(); i++)
+			activations += matrix_bytes(workspace->contents[i]) + matrix_bytes(workspace->dZ[i]);
+	}
+	for (const std::vector<Layer>& replica : replicas) {
+		for (const Layer& layer : replica)
+			report.totals[static_cast<int>(Category::params)] += matrix_bytes(layer.weights) + matrix_bytes(layer.bias);
+	}
+	size_t& arenas = report.totals[static_cast<int>(Category::scratch)];
+	arenas = scratch.arena.peak_bytes() + graph_buffers.arena.peak_bytes() + accumulated.peak_bytes() + ring_buffers.arena.peak_bytes();
+	for (const BackpropBuffers& buffers : shards) arenas += buffers.arena.peak_bytes();
+	for (const BackpropBuffers& buffers : micro_buffers) arenas += buffers.arena.peak_bytes();
+	return report;
+}
+
 void Network::train()
 {
+	ProfileScope profiling = profile_epoch();
+	if (transport) {
+		distributed_epoch();
+		return;
+	}
+	if (pipeline_stages > 0) {
+		std::fill(stage_busy.begin(), stage_busy.end(), 0);
+		pipeline_wall = 0;
+	}
 	float cost_sum = 0;
 	float acc_sum = 0;
+	auto start = std::chrono::steady_clock::now();
 	for (int i = 0; i <= instances - batch_size; i += batch_size) {
-		if (i != instances - batch_size)
-			next_batch(data);
-		feedforward();
-		backpropagate();
-		cost_sum += cost();
-		acc_sum += accuracy();
+		if (tracer) {
+			tracer->batch = i / batch_size;
+			tracer->epoch = epochs;
+		}
+		{
+			PROFILE(Phase::next_batch);
+			TRACE(tracer.get(), "next_batch", -1);
+			if (dataset) read_batch(false, i / batch_size, own_view(0, batch_size));
+			else if (i != instances - batch_size)
+				next_batch(data);
+		}
+		if (pool) {
+			PROFILE(Phase::step);
+			if (pipeline_stages > 0) pipeline_step();
+			else if (task_graph) {
+				if (step_graph.size() == 0) build_step_graph();
+				step_graph.run(*pool);
+			}
+			else parallel_step();
+		}
+		else {
+			{
+				PROFILE(Phase::feedforward);
+				feedforward();
+			}
+			PROFILE(Phase::backpropagate);
+			backpropagate();
+		}
+		{
+			PROFILE(Phase::cost);
+			cost_sum += cost();
+		}
+		{
+			PROFILE(Phase::accuracy);
+			acc_sum += accuracy();
+		}
 		batches++;
 	}
-	epoch_acc =
-		1.0 / (static_cast<float>(instances / batch_size)) * acc_sum;
-	epoch_cost =
-		1.0 / (static_cast<float>(instances / batch_size)) * cost_sum;
-	validate(VAL_PATH);
-	if (silenced == false)
-		printf("Epoch %i complete - cost %f - acc %f - val_cost %f - val_acc %f\n",
-			   epochs, epoch_cost, epoch_acc, val_cost, val_acc);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	finish_epoch(cost_sum, acc_sum, instances / batch_size, elapsed.count());
+	if (pool && pipeline_stages > 0 && silenced == false) {
+		PipelineReport report = pipeline_report();
+		printf("Pipeline - %i stages x %i micro-batches - bubble %.0f%% (ideal %.0f%%) - utilization",
+			   report.stages, report.micro_batches, 100 * report.bubble, 100 * report.ideal_bubble);
+		for (float used : report.utilization) printf(" %.0f%%", 100 * used);
+		printf("\n");
+	}
 	batches = 1;
+	if (dataset) return;
 	data = open(TRAIN_BIN_PATH, O_RDONLY | O_NONBLOCK);
+	Ensures(lseek(data, 0, SEEK_CUR) == 0);
+}
+
+// Hogwild: every thread pulls whole batches and applies its updates straight to the shared weights
+// and biases without any locking. Threads only own their activations and backprop buffers.
+// Everything an update touches is shared and raced on, on purpose: the optimizer's moments (m and
+// v), any pruned layer's sparse copy, and whatever state the optimizer keeps in its closure, such
+// as demon's step count. Lost or mixed writes to those only add to the noise Hogwild already
+// accepts on the weights, and the buffers are all sized up front, so nothing is ever reallocated
+// under another thread. Optimizers that can't tolerate that shouldn't be trained this way.
+void Network::train_hogwild(int threads)
+{
+	Expects(threads > 0);
+	ProfileScope profiling = profile_epoch();
+	const int total = instances / batch_size;
+	std::atomic<int> next {0};
+	std::vector<float> cost_sums (threads, 0);
+	std::vector<float> acc_sums (threads, 0);
+	auto start = std::chrono::steady_clock::now();
+	PROFILE(Phase::step);
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++) {
+		workers.emplace_back([this, t, total, &next, &cost_sums, &acc_sums] {
+			Workspace workspace (layers, batch_size);
+			BatchView view = workspace.view();
+			BackpropBuffers buffers;
+			plan_backprop(buffers, 0, batch_size, false);
+			for (int b = next++; b < total; b = next++) {
+				TraceContext context (b, epochs);
+				{
+					TRACE(tracer.get(), "next_batch", -1);
+					read_batch(false, b, view);
+				}
+				forward(view);
+				backprop_rows(view, buffers, true);
+				cost_sums[t] += cost(view);
+				acc_sums[t] += accuracy(view);
+			}
+		});
+	}
+	for (std::thread& worker : workers) worker.join();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	float cost_sum = 0;
+	float acc_sum = 0;
+	for (int t = 0; t < threads; t++) {
+		cost_sum += cost_sums[t];
+		acc_sum += acc_sums[t];
+	}
+	finish_epoch(cost_sum, acc_sum, total, elapsed.count());
+}
+
+// One training step as a graph of per-layer ops, so that ops which don't depend on each other run
+// concurrently: a layer's weight delta, bias update and optimizer step overlap with propagating
+// the error further back. Optimizer steps stay in order since optimizers may carry state.
+void Network::build_step_graph()
+{
+	step_graph.clear();
+	plan_backprop(graph_buffers, 0, batch_size, true, true);
+	BatchView view = own_view(0, batch_size);
+	int previous = -1;
+	for (int i = 0; i < length; i++) {
+		int act = step_graph.add([this, view, i] {
+			activate(layers[i], *view.contents[i], *view.dZ[i]);
+		}, previous >= 0 ? std::vector<int>{previous} : std::vector<int>{});
+		if (i == length-1) {
+			previous = act;
+			break;
+		}
+		previous = step_graph.add([this, view, i] {
+			multiply_weights(layers, i, *view.contents[i], *view.contents[i+1]);
+			*view.contents[i+1] += layers[i+1].bias;
+		}, {act});
+	}
+	previous = step_graph.add([this, view] {softmax(view);}, {previous});
+	int gradient = step_graph.add([this, view] {
+		output_error(view, graph_buffers.arena[graph_buffers.gradient_ids[0]]);
+	}, {previous});
+	int last_update = -1;
+	for (int k = 0; k < length-1; k++) {
+		int i = length-2-k;
+		int next = -1;
+		if (i >= 1) {
+			next = step_graph.add([this, view, i, k] {
+				back_error(layers, view, i, graph_buffers.arena[graph_buffers.gradient_ids[k]], graph_buffers.arena[graph_buffers.gradient_ids[k+1]]);
+			}, {gradient});
+		}
+		int delta = step_graph.add([this, view, i, k] {
+			weight_delta(view, i, graph_buffers.arena[graph_buffers.gradient_ids[k]], graph_buffers.arena[graph_buffers.delta_ids[k]]);
+		}, {gradient});
+		step_graph.add([this, i, k] {
+			layers[i+1].bias -= bias_lr * graph_buffers.arena[graph_buffers.gradient_ids[k]];
+		}, {gradient});
+		std::vector<int> after {delta};
+		if (next >= 0) after.push_back(next); // The next error reads the weights before they change.
+		if (last_update >= 0) after.push_back(last_update);
+		last_update = step_graph.add([this, i, k] {
+			apply_update(i, graph_buffers.arena[graph_buffers.delta_ids[k]]);
+		}, after);
+		gradient = next;
+	}
+}
+
+// count is the number of batches cost_sum and acc_sum were summed over.
+void Network::finish_epoch(float cost_sum, float acc_sum, int count, double seconds)
+{
+	epoch_acc =
+		1.0 / (static_cast<float>(count)) * acc_sum;
+	epoch_cost =
+		1.0 / (static_cast<float>(count)) * cost_sum;
+	throughput = count * batch_size / seconds;
+#if (!RECKLESS)
+	double flops = 0; // Per sample: the forward product, the weight delta and (past the first layer) the error.
+	for (int i = 0; i < length-1; i++) flops += (i >= 1 ? 6.0 : 4.0) * layers[i].contents.cols() * layers[i+1].contents.cols();
+	profile.batches = count;
+	profile.seconds = seconds;
+	profile.samples_per_second = throughput;
+	profile.gflops = flops * count * batch_size / seconds / 1e9;
+#endif
+	memory_epoch.stop(transport ? count / transport->world() : count);
+	if (scheduled_pruning) prune_epoch();
+	if (async_validation) {
+		{
+			PROFILE(Phase::validate);
+			collect_validation();
+		}
+		if (silenced == false)
+			printf("Epoch %i complete - cost %f - acc %f - %.0f samples/s\n",
+				   epochs, epoch_cost, epoch_acc, throughput);
+		PROFILE(Phase::validate);
+		pending_validation = validate_async().share();
+	}
+	else {
+		{
+			PROFILE(Phase::validate);
+			validate(VAL_PATH);
+		}
+		if (silenced == false)
+			printf("Epoch %i complete - cost %f - acc %f - val_cost %f - val_acc %f - %.0f samples/s\n",
+				   epochs, epoch_cost, epoch_acc, val_cost, val_acc, throughput);
+	}
 	decay(learning_rate);
 	epochs++;
-	Ensures(lseek(data, 0, SEEK_CUR) == 0);
+}
+
+// Copies count of rank 0's rows, from root_rows or else from fd, into rows on every rank.
+void Network::broadcast_rows(std::vector<float>& rows, int count, const float* root_rows, int fd)
+{
+	rows.assign(static_cast<size_t>(count) * (layers[0].contents.cols() + 1), 0);
+	if (transport->rank() == 0 && root_rows) std::copy(root_rows, root_rows + rows.size(), rows.begin());
+	else if (transport->rank() == 0) {
+		ssize_t bytes = rows.size() * sizeof(float);
+		if (pread(fd, rows.data(), bytes, 0) != bytes)
+			throw std::runtime_error{"distribute() could not read rank 0's data."};
+	}
+	all_reduce(*transport, rows.data(), rows.size());
+}
+
+// Joins a ring of replicas, one per process. Every rank starts from rank 0's weights and trains on
+// rank 0's training set (each process splits and shuffles its own copy of the data, so they can't
+// be trusted to agree); both are broadcast as a sum that everyone else contributes zeros to. So is
+// rank 0's validation set, which every rank then validates on in full: the replicas are identical,
+// so they all get the same metrics and make the same early stopping decisions, and validating
+// needs no communication, so it can still run in the background. From then on train() runs
+// distributed epochs. Call after initialize() and the same way on every rank.
+void Network::distribute(std::shared_ptr<Transport> link)
+{
+	Expects(link && length > 1 && labels.rows() == batch_size);
+	transport = link;
+	const bool root = transport->rank() == 0;
+	for (Layer& layer : layers) {
+		if (!root) {
+			layer.weights.setZero();
+			layer.bias.setZero();
+		}
+		all_reduce(*transport, layer.weights.data(), layer.weights.size());
+		all_reduce(*transport, layer.bias.data(), layer.bias.size());
+	}
+	broadcast_rows(train_rows, instances, dataset ? dataset->train_rows(0) : nullptr, data);
+	broadcast_rows(val_rows, val_instances, dataset && val_instances > 0 ? dataset->val_rows(0) : nullptr, val_data);
+	plan_backprop(ring_buffers, 0, batch_size, true);
+	comm = std::make_shared<ThreadPool>(1);
+}
+
+// Rank r trains on batches r, r+world, r+2*world... so the shards are disjoint and every rank runs
+// the same number of steps. As backprop finishes each layer, that layer's delta and biases are
+// averaged across the ring on the comm thread while backprop carries on with the layers below.
+// Ring all-reduce hands every rank bit-identical sums, so the replicas never drift apart.
+void Network::distributed_epoch()
+{
+	const int world = transport->world();
+	const int width = layers[0].contents.cols() + 1;
+	const int steps = instances / batch_size / world;
+	BatchView view = own_view(0, batch_size);
+	float sums[2] = {0, 0}; // Cost, accuracy.
+	auto start = std::chrono::steady_clock::now();
+	for (int step = 0; step < steps; step++) {
+		if (tracer) {
+			tracer->batch = step;
+			tracer->epoch = epochs;
+		}
+		{
+			PROFILE(Phase::next_batch);
+			TRACE(tracer.get(), "next_batch", -1);
+			fill_batch(train_rows.data() + static_cast<size_t>(step * world + transport->rank()) * batch_size * width, view);
+		}
+		{
+			PROFILE(Phase::feedforward);
+			forward(view);
+		}
+		// One comm task per step walks the layers in backprop order, so every rank issues its
+		// all-reduces in the same order.
+		std::vector<std::promise<void>> ready (length-1);
+		std::vector<std::promise<void>> reduced (length-1);
+		std::vector<std::future<void>> delta_ready;
+		std::vector<std::future<void>> delta_reduced;
+		for (int k = 0; k < length-1; k++) {
+			delta_ready.push_back(ready[k].get_future());
+			delta_reduced.push_back(reduced[k].get_future());
+		}
+		std::future<void> reducing = comm->submit([this, world, &delta_ready, &reduced] {
+			int k = 0;
+			try {
+				for (; k < length-1; k++) {
+					delta_ready[k].wait();
+					ArenaBuffer delta = ring_buffers.arena[ring_buffers.delta_ids[k]];
+					Eigen::MatrixXf& bias = layers[length-1-k].bias;
+					all_reduce(*transport, delta.data(), delta.size());
+					all_reduce(*transport, bias.data(), bias.size());
+					delta /= world;
+					bias /= world;
+					reduced[k].set_value();
+				}
+			}
+			catch (...) {
+				for (; k < length-1; k++) reduced[k].set_exception(std::current_exception());
+				throw;
+			}
+		});
+		{
+			PROFILE(Phase::backpropagate);
+			backprop_rows(view, ring_buffers, false, [&ready](int k) {ready[k].set_value();});
+		}
+		{
+			PROFILE(Phase::update); // Including waiting on the all-reduces.
+			try {
+				for (int k = 0; k < length-1; k++) {
+					delta_reduced[k].get();
+					apply_update(length-2-k, ring_buffers.arena[ring_buffers.delta_ids[k]]);
+				}
+			}
+			catch (...) {
+				reducing.wait(); // It still holds references to the promises.
+				throw;
+			}
+			reducing.get();
+		}
+		{
+			PROFILE(Phase::cost);
+			sums[0] += cost(view);
+		}
+		PROFILE(Phase::accuracy);
+		sums[1] += accuracy(view);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	all_reduce(*transport, sums, 2);
+	finish_epoch(sums[0], sums[1], steps * world, elapsed.count());
+}
+
+// Splits the weight layers into stages contiguous ranges of about equal work (weight matrix size,
+// as every stage sees the same rows), each run by its own pool worker, and every batch into
+// micro_batch_count row ranges that flow through them GPipe style: a stage takes the micro-batches
+// forward one after another, and once the last of them is through it, backward again while the
+// stages behind it are still busy. Deltas accumulate over the micro-batches and the optimizer
+// steps once per batch. With NUMA mode on, stages are pinned like any other workers.
+void Network::set_pipeline(int stages, int micro_batch_count)
+{
+	Expects(length > 1 && stages >= 0 && stages <= length-1 && micro_batch_count > 0 && micro_batch_count <= batch_size);
+	pipeline_stages = stages;
+	micro_batches = micro_batch_count;
+	pipeline_graph.clear();
+	if (stages == 0) return;
+	std::vector<double> work;
+	for (int i = 0; i < length-1; i++) work.push_back(static_cast<double>(layers[i].contents.cols()) * layers[i+1].contents.cols());
+	double total = std::accumulate(work.begin(), work.end(), 0.0);
+	double done = 0;
+	stage_bounds = {0};
+	for (int i = 0; i < length-1; i++) {
+		int cuts = stage_bounds.size() - 1;
+		// Start a new stage at layer i if taking it would overshoot this stage's share by more than
+		// stopping short does, or if every layer left needs a stage of its own.
+		if (cuts < stages-1 && stage_bounds.back() < i &&
+			(done + work[i] / 2 > total * (cuts+1) / stages || length-1-i == stages-1-cuts))
+			stage_bounds.push_back(i);
+		done += work[i];
+	}
+	stage_bounds.push_back(length-1);
+	Ensures(static_cast<int>(stage_bounds.size()) == stages+1);
+	make_pool(stages);
+}
+
+void Network::build_pipeline()
+{
+	const int stages = pipeline_stages;
+	micro_buffers.resize(micro_batches);
+	for (int m = 0; m < micro_batches; m++) {
+		int first = m * batch_size / micro_batches;
+		plan_backprop(micro_buffers[m], first, (m+1) * batch_size / micro_batches - first, false, true);
+	}
+	accumulated.clear();
+	accumulated_ids.clear();
+	for (int k = 0; k < length-1; k++)
+		accumulated_ids.push_back(accumulated.reserve(layers[length-2-k].contents.cols(), layers[length-1-k].contents.cols(), 0, 0));
+	accumulated.plan();
+	stage_busy.assign(stages, 0);
+	pipeline_graph.clear();
+	auto timed = [this](int s, std::function<void()> work) {
+		return [this, s, work] {
+			auto start = std::chrono::steady_clock::now();
+			work();
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			stage_busy[s] += elapsed.count(); // Only stage s's worker runs its tasks.
+		};
+	};
+	std::vector<std::vector<int>> forward_ids (stages, std::vector<int>(micro_batches));
+	for (int m = 0; m < micro_batches; m++) {
+		for (int s = 0; s < stages; s++) {
+			std::vector<int> after;
+			if (s > 0) after.push_back(forward_ids[s-1][m]);
+			if (m > 0) after.push_back(forward_ids[s][m-1]);
+			forward_ids[s][m] = pipeline_graph.add(timed(s, [this, s, m] {
+				BackpropBuffers& buffers = micro_buffers[m];
+				BatchView view = own_view(buffers.first, buffers.rows);
+				forward(layers, view, stage_bounds[s], stage_bounds[s+1]);
+				if (s == pipeline_stages-1) output_error(view, buffers.arena[buffers.gradient_ids[0]]);
+			}), after, s);
+		}
+	}
+	std::vector<std::vector<int>> backward_ids (stages, std::vector<int>(micro_batches));
+	for (int s = stages-1; s >= 0; s--) {
+		for (int m = 0; m < micro_batches; m++) {
+			// The stage's first backward waits for its last forward; micro-batches then go in order,
+			// which also keeps the sums in the accumulated deltas in a fixed order.
+			std::vector<int> after {m > 0 ? backward_ids[s][m-1] : forward_ids[s][micro_batches-1]};
+			if (s < stages-1) after.push_back(backward_ids[s+1][m]);
+			backward_ids[s][m] = pipeline_graph.add(timed(s, [this, s, m] {
+				BackpropBuffers& buffers = micro_buffers[m];
+				BatchView view = own_view(buffers.first, buffers.rows);
+				for (int i = stage_bounds[s+1]-1; i >= stage_bounds[s]; i--) {
+					TRACE(tracer.get(), "backward", i);
+					int k = length-2-i;
+					ArenaBuffer gradient = buffers.arena[buffers.gradient_ids[k]];
+					if (i >= 1) back_error(layers, view, i, gradient, buffers.arena[buffers.gradient_ids[k+1]]);
+					ArenaBuffer delta = accumulated[accumulated_ids[k]];
+					if (m == 0) weight_delta(view, i, gradient, delta);
+					else delta.noalias() += view.contents[i]->middleRows(view.first, view.rows).transpose() * gradient;
+					layers[i+1].bias.middleRows(view.first, view.rows) -= bias_lr * gradient;
+				}
+			}), after, s);
+		}
+	}
+}
+
+void Network::pipeline_step()
+{
+	if (pipeline_graph.size() == 0) build_pipeline();
+	auto start = std::chrono::steady_clock::now();
+	pipeline_graph.run(*pool);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	pipeline_wall += elapsed.count();
+	for (int k = 0; k < length-1; k++) apply_update(length-2-k, accumulated[accumulated_ids[k]]);
+}
+
+PipelineReport Network::pipeline_report()
+{
+	const int stages = pipeline_stages;
+	PipelineReport report {stages, micro_batches, stage_bounds, {}, 0, 0};
+	if (stages == 0) return report;
+	report.ideal_bubble = static_cast<float>(stages-1) / (micro_batches+stages-1);
+	for (int s = 0; s < static_cast<int>(stage_busy.size()); s++) {
+		report.utilization.push_back(pipeline_wall > 0 ? stage_busy[s] / pipeline_wall : 0);
+		report.bubble += (1 - report.utilization.back()) / stages;
+	}
+	return report;
 }
 }
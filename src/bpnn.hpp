@@ -9,15 +9,36 @@
 #include <cstdio>
 #include <cmath>
 #include <random>
+#include <memory>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <gsl/gsl_assert>
 
+#include "arena.hpp"
+#include "threads.hpp"
+#include "distributed.hpp"
+#include "dataset.hpp"
+#include "topology.hpp"
+#include "checkpoint.hpp"
+#include "prune.hpp"
+#include "profile.hpp"
+#include "trace.hpp"
+#include "memory.hpp"
+
 namespace Jacobian {
 #define BUFFER_SIZE 600*1024
 #define LARGE_BUF 600*1024*15
+#define SHUFFLED_PATH "./shuffled.txt"
+#define VAL_PATH "./test.txt"
+#define TRAIN_PATH "./train.txt"
+#define VAL_BIN_PATH "./test.bin"
+#define TRAIN_BIN_PATH "./train.bin"
 enum class Regularization {L1, L2};
+// How NumPy lays out a C-contiguous array, so it can be used without copying.
+typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrixXf;
+// Applies an activation (or its derivative) in place to a whole block of a layer at once.
+typedef std::function<void(Eigen::Ref<Eigen::MatrixXf>)> ArrayActivation;
 
 class Layer {
 public:
@@ -29,6 +50,9 @@ public:
 	Eigen::MatrixXf m;
 	std::function<float(float)> activation;
 	std::function<float(float)> activation_deriv;
+	// When set, used instead of the per-element functions above, which then just wrap these.
+	ArrayActivation array_activation;
+	ArrayActivation array_activation_deriv;
 
 	Layer(int rows, int columns);
 	Layer(float* vals, int rows, int columns);
@@ -37,9 +61,61 @@ public:
 
 };
 
+// The per-layer activation buffers and labels a pass works on, restricted to rows [first, first+rows).
+// Lets the same kernels run over the whole batch or over one shard of it.
+struct BatchView {
+	std::vector<Eigen::MatrixXf*> contents;
+	std::vector<Eigen::MatrixXf*> dZ;
+	Eigen::MatrixXf* labels;
+	int first;
+	int rows;
+	int bias_first = -1; // Row of the batch's per-row biases that row first lines up with, if not first itself.
+	int bias_row() const {return bias_first >= 0 ? bias_first : first;}
+};
+
+// Backprop error and delta buffers for a block of rows [first, first+rows) of a batch.
+struct BackpropBuffers {
+	int first;
+	int rows;
+	Arena arena;
+	std::vector<int> gradient_ids;
+	std::vector<int> delta_ids;
+};
+
+class Network;
+class Predictor;
+
+struct Validation {
+	int epoch;
+	float cost;
+	float acc;
+};
+
+// Pipeline mode's timings, summed over the last epoch. Utilization is the fraction of the wall time
+// a stage spent computing; the bubble is the fraction it spent waiting, averaged over stages, and
+// ideal_bubble is what GPipe's schedule alone costs: (stages-1) / (micro_batches+stages-1).
+struct PipelineReport {
+	int stages;
+	int micro_batches;
+	std::vector<int> first_layers; // Stage s runs the weights of layers first_layers[s] to first_layers[s+1]-1.
+	std::vector<float> utilization;
+	float bubble;
+	float ideal_bubble;
+};
+
+// Private activation buffers and labels, for running the shared weights on a batch of its own.
+struct Workspace {
+	std::vector<Eigen::MatrixXf> contents;
+	std::vector<Eigen::MatrixXf> dZ;
+	Eigen::MatrixXf labels;
+	Workspace(const std::vector<Layer>& layers, int rows);
+	BatchView view();
+};
+
 class Network {
 	char buf[BUFFER_SIZE];
 	char* p;
+	friend class Sweep;
 protected:
 	int instances;
 	float epoch_acc;
@@ -48,7 +124,84 @@ protected:
 	float val_cost;
 	std::function<void(float&)> decay;
 	std::function<void(std::vector<Eigen::MatrixXf>, int, int)> grad_calc;
-	std::function<void(Layer&, Eigen::MatrixXf, float)> update;
+	std::function<void(Layer&, const Eigen::Ref<const Eigen::MatrixXf>&, float)> update;
+	BackpropBuffers scratch; // Planned by initialize().
+	std::shared_ptr<ThreadPool> pool;
+	int shard_count = 1;
+	std::vector<BackpropBuffers> shards;
+	bool task_graph = false;
+	TaskGraph step_graph;
+	BackpropBuffers graph_buffers;
+	float throughput = 0; // Training samples per second over the last epoch.
+	Profile profile; // Where the last epoch's time went.
+	bool count_hardware = false;
+	std::unique_ptr<PerfCounters> counters; // Opened by the thread that trains, as they only count that thread.
+	ProfileScope profile_epoch();
+	MemoryReport memory; // The last epoch's allocations and resident set.
+	MemoryEpoch memory_epoch;
+	std::unique_ptr<Tracer> tracer;
+	std::unique_ptr<Predictor> predictor; // predict()'s buffers, kept between calls.
+	void plan_backprop(BackpropBuffers& buffers, int first, int rows, bool keep_deltas, bool keep_gradients=false);
+	void plan_shards();
+	BatchView own_view(int first, int rows);
+	void forward(const BatchView& view);
+	void forward(const std::vector<Layer>& params, const BatchView& view);
+	void forward(const std::vector<Layer>& params, const BatchView& view, int from, int to);
+	void softmax(const BatchView& view);
+	void output_error(const BatchView& view, Eigen::Ref<Eigen::MatrixXf> error);
+	void back_error(const std::vector<Layer>& params, const BatchView& view, int i, const Eigen::Ref<const Eigen::MatrixXf>& gradient, Eigen::Ref<Eigen::MatrixXf> next);
+	void weight_delta(const BatchView& view, int i, const Eigen::Ref<const Eigen::MatrixXf>& gradient, Eigen::Ref<Eigen::MatrixXf> delta);
+	void apply_update(int i, const Eigen::Ref<const Eigen::MatrixXf>& delta);
+	void multiply_weights(const std::vector<Layer>& params, int i, const Eigen::Ref<const Eigen::MatrixXf>& in, Eigen::Ref<Eigen::MatrixXf> out);
+	std::vector<Eigen::MatrixXf> masks; // Once anything is pruned, 1 where a weight survives and 0 where it was pruned.
+	std::vector<std::unique_ptr<SparseWeights>> sparse; // CSR copies of the weights of layers sparse enough to use them.
+	bool scheduled_pruning = false;
+	PruningSchedule schedule {0, 0, 0};
+	void prune_epoch();
+	void backprop_rows(const BatchView& view, BackpropBuffers& buffers, bool apply, const std::function<void(int)>& ready=nullptr);
+	void backprop_rows(const std::vector<Layer>& params, const BatchView& view, BackpropBuffers& buffers, bool apply, const std::function<void(int)>& ready=nullptr);
+	bool numa = false;
+	bool replicate = false;
+	Topology topology;
+	std::vector<int> worker_cpus;
+	std::vector<std::unique_ptr<Workspace>> shard_workspaces; // NUMA mode: each shard's activations, on its worker's node.
+	std::vector<std::vector<Layer>> replicas; // Per node copies of the weights and biases, if replicating.
+	void make_pool(int threads);
+	void refresh_replicas();
+	int pipeline_stages = 0;
+	int micro_batches = 1;
+	std::vector<int> stage_bounds;
+	std::vector<BackpropBuffers> micro_buffers;
+	Arena accumulated; // Weight deltas summed over a batch's micro-batches.
+	std::vector<int> accumulated_ids;
+	TaskGraph pipeline_graph;
+	std::vector<double> stage_busy;
+	double pipeline_wall = 0;
+	void build_pipeline();
+	void pipeline_step();
+	void parallel_step();
+	void build_step_graph();
+	std::shared_ptr<Transport> transport;
+	std::shared_ptr<ThreadPool> comm; // Runs the all-reduces so they overlap with backprop.
+	BackpropBuffers ring_buffers;
+	std::vector<float> train_rows; // Rank 0's training set, as every rank trains on its shard of it.
+	std::vector<float> val_rows; // And its validation set, which every rank validates on in full.
+	void broadcast_rows(std::vector<float>& rows, int count, const float* root_rows, int fd);
+	void distributed_epoch();
+	void use_default_optimizer();
+	void finish_epoch(float cost_sum, float acc_sum, int count, double seconds);
+	float cost(const BatchView& view);
+	float cost(const std::vector<Layer>& params, const BatchView& view);
+	Validation evaluate(const std::vector<Layer>& params, int epoch);
+	std::shared_future<Validation> pending_validation;
+	std::function<void(Validation)> validation_callback;
+	bool async_validation = false;
+	void collect_validation();
+	float accuracy(const BatchView& view);
+	void load_batch(int fd, int index, const BatchView& view);
+	void fill_batch(const float* rows, const BatchView& view);
+	std::shared_ptr<Dataset> dataset; // Set when the network trains on a shared dataset instead of its own files.
+	void read_batch(bool validation, int index, const BatchView& view);
 	void next_batch(int fd);
 public:
 	int data;
@@ -67,20 +220,33 @@ public:
 	bool silenced = false;
 	int epochs = 0;
 	int batches = 0;
-	Eigen::MatrixXf* labels;
+	Eigen::MatrixXf labels;
 
 	Network(const char* path, int batch_sz, float learn_rate,
 			float bias_rate, Regularization regularization,
 			float l, float ratio, bool early_exit=true, float cutoff=0);
+	Network(std::shared_ptr<Dataset> shared, int batch_sz, float learn_rate,
+			float bias_rate, Regularization regularization,
+			float l, bool early_exit=true, float cutoff=0);
 	~Network();
 	void add_layer(int nodes, std::function<float(float)> activation, std::function<float(float)> activation_deriv);
 	void initialize();
-	void init_optimizer(std::function<void(Layer &, Eigen::MatrixXf, float)> f)
+	void init_optimizer(std::function<void(Layer &, const Eigen::Ref<const Eigen::MatrixXf>&, float)> f)
 	{
 		update = f;
 	};
 	void init_decay(std::function<void(float&)> f);
+	void set_threads(int threads, int shard_num=0);
+	void set_task_graph(bool enabled) {task_graph = enabled;}
+	void set_numa(bool enabled, bool replicate_weights=false);
+	void set_pipeline(int stages, int micro_batch_count);
+	PipelineReport pipeline_report();
+	void set_pruning(const PruningSchedule& pruning);
+	void prune(float sparsity);
+	std::vector<SparsityReport> sparsity_report();
 	void set_activation(int index, std::function<float(float)> custom, std::function<float(float)> custom_deriv);
+	void set_array_activation(int index, ArrayActivation custom, ArrayActivation custom_deriv);
+	void set_expression(int index, const std::string& expression, const std::string& derivative="");
 	void feedforward();
 	void softmax();
 	void list_net();
@@ -88,19 +254,37 @@ public:
 	float cost();
 	float accuracy();
 	Eigen::MatrixXf backpropagate();
+	Eigen::MatrixXf predict(const Eigen::Ref<const Eigen::MatrixXf>& input);
+	RowMatrixXf predict_rows(const Eigen::Ref<const RowMatrixXf>& input);
+	void save(const char* path, bool optimizer_state=false) const;
+	void load(const Checkpoint& checkpoint);
+	void load(const char* path);
 	void validate(const char* path);
+	int validation_rows(int limit, Eigen::MatrixXf& features, Eigen::MatrixXf& rows_labels);
+	std::future<Validation> validate_async();
+	void set_async_validation(bool enabled, std::function<void(Validation)> callback=nullptr);
+	void wait_validation();
 	void train();
+	void train_hogwild(int threads); // Lock-free; races on the weights and optimizer state are accepted.
+	void distribute(std::shared_ptr<Transport> link);
 	float get_acc() {return epoch_acc;}
+	float get_throughput() {return throughput;}
+	const Profile& get_profile() const {return profile;}
+	bool set_counters(bool enabled);
+	void set_tracing(const std::string& path);
+	void write_trace();
+	MemoryReport memory_report() const;
 	float get_val_acc() {return val_acc;}
 	float get_cost() {return epoch_cost;}
 	float get_val_cost()
 	{
 		return val_cost;
 	}
+	size_t scratch_bytes() {return scratch.arena.peak_bytes();}
 };
 
 int prep_file(const char *path, const char *out_path);
-int split_file(const char *path, int lines, float ratio);
+int split_file(const char *path, int lines, float ratio, const char *train_path=TRAIN_PATH, const char *val_path=VAL_PATH);
 
 void prep(const char *rname, const char *wname);
 void compress(const char *rname, const char *wname);
@@ -120,11 +304,5 @@ Eigen::MatrixXf l1_deriv(Eigen::MatrixXf m);
 #define Ensures(cond) GSL_ASSUME(cond);
 #endif
 
-#define SHUFFLED_PATH "./shuffled.txt"
-#define VAL_PATH "./test.txt"
-#define TRAIN_PATH "./train.txt"
-#define VAL_BIN_PATH "./test.bin"
-#define TRAIN_BIN_PATH "./train.bin"
-
 }
 #endif /* MODULE_H */
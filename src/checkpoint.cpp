@@ -0,0 +1,175 @@
+//
+//  checkpoint.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bpnn.hpp"
+#include "utils.hpp"
+#include "checkpoint.hpp"
+
+namespace Jacobian {
+inline uint64_t align_up(uint64_t offset)
+{
+	return (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+// A layer's activation has to be a built-in whose derivative is the built-in one too, or the
+// checkpoint would bring back a different network.
+inline std::string checked_name(const Layer& layer)
+{
+	std::string name = activations::name_of(layer.activation);
+	auto deriv = layer.activation_deriv.target<float(*)(float)>();
+	if (name.empty() || !deriv || *deriv != activations::find(name)->activation_deriv)
+		throw std::runtime_error{"Checkpoints can only record built-in activations."};
+	return name;
+}
+
+// Written to a temporary file that is renamed over path at the end, so a reader never maps half a
+// checkpoint.
+void Checkpoint::save(const Network& net, const char* path, bool optimizer_state)
+{
+	Expects(net.length > 1);
+	Header header {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, static_cast<uint32_t>(net.length),
+				   optimizer_state ? OPTIMIZER_STATE : 0u, static_cast<uint32_t>(net.batch_size), {0, 0, 0}};
+	std::vector<LayerRecord> records (net.length);
+	std::vector<const Eigen::MatrixXf*> blobs;
+	uint64_t end = align_up(sizeof(Header) + net.length * sizeof(LayerRecord));
+	auto place = [&blobs, &end](const Eigen::MatrixXf& matrix) -> uint64_t {
+		if (matrix.size() == 0) return 0;
+		uint64_t offset = end;
+		blobs.push_back(&matrix);
+		end = align_up(offset + matrix.size() * sizeof(float));
+		return offset;
+	};
+	for (int i = 0; i < net.length; i++) {
+		const Layer& layer = net.layers[i];
+		LayerRecord& record = records[i];
+		std::memset(&record, 0, sizeof(record));
+		std::string name = checked_name(layer);
+		std::strncpy(record.activation, name.c_str(), sizeof(record.activation)-1);
+		record.nodes = layer.contents.cols();
+		record.bias_rows = layer.bias.rows();
+		record.bias = place(layer.bias);
+		if (i == net.length-1) continue;
+		record.weights = place(layer.weights);
+		if (optimizer_state) {
+			record.m = place(layer.m);
+			record.v = place(layer.v);
+		}
+	}
+	const std::string temporary = std::string(path) + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (!file) throw std::runtime_error{"Checkpoint could not create its file."};
+	const char padding[CHECKPOINT_ALIGN] = {};
+	bool written = fwrite(&header, sizeof(Header), 1, file) == 1 &&
+		fwrite(records.data(), sizeof(LayerRecord), records.size(), file) == records.size();
+	for (const Eigen::MatrixXf* blob : blobs) {
+		long at = ftell(file);
+		written = written && fwrite(padding, 1, align_up(at) - at, file) == align_up(at) - at &&
+			fwrite(blob->data(), sizeof(float), blob->size(), file) == static_cast<size_t>(blob->size());
+	}
+	written = fclose(file) == 0 && written;
+	if (!written || rename(temporary.c_str(), path) != 0) {
+		unlink(temporary.c_str());
+		throw std::runtime_error{"Checkpoint could not write its file."};
+	}
+}
+
+Checkpoint::Checkpoint(const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) throw std::runtime_error{"Checkpoint could not open its file."};
+	struct stat info;
+	fstat(fd, &info);
+	size = info.st_size;
+	if (size < sizeof(Header)) {
+		close(fd);
+		throw std::runtime_error{"Checkpoint file is truncated."};
+	}
+	void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) throw std::runtime_error{"Checkpoint could not map its file."};
+	bytes = static_cast<const char*>(mapped);
+	header = reinterpret_cast<const Header*>(bytes);
+	records = reinterpret_cast<const LayerRecord*>(bytes + sizeof(Header));
+	try {
+		if (header->magic != CHECKPOINT_MAGIC) throw std::runtime_error{"Not a Jacobian checkpoint."};
+		if (header->version != CHECKPOINT_VERSION) throw std::runtime_error{"Unsupported checkpoint version."};
+		if (header->layers < 2 || size < sizeof(Header) + header->layers * sizeof(LayerRecord))
+			throw std::runtime_error{"Checkpoint file is truncated."};
+		auto check = [this](uint64_t offset, uint64_t rows, uint64_t cols, bool required) {
+			if (offset == 0 && !required) return;
+			if (offset % CHECKPOINT_ALIGN != 0 || offset < sizeof(Header) || offset > size ||
+				rows * cols * sizeof(float) > size - offset)
+				throw std::runtime_error{"Checkpoint matrix lies outside the file."};
+		};
+		for (int i = 0; i < layers(); i++) {
+			const LayerRecord& record = records[i];
+			if (!std::memchr(record.activation, 0, sizeof(record.activation)) || !activations::find(record.activation))
+				throw std::runtime_error{"Checkpoint names an unknown activation."};
+			check(record.bias, record.bias_rows, record.nodes, false);
+			if (i == layers()-1) continue;
+			check(record.weights, record.nodes, records[i+1].nodes, true);
+			check(record.m, record.nodes, records[i+1].nodes, has_optimizer_state());
+			check(record.v, record.nodes, records[i+1].nodes, has_optimizer_state());
+		}
+	}
+	catch (...) {
+		munmap(const_cast<char*>(bytes), size);
+		throw;
+	}
+}
+
+Checkpoint::~Checkpoint()
+{
+	munmap(const_cast<char*>(bytes), size);
+}
+
+Eigen::Map<const Eigen::MatrixXf> Checkpoint::matrix(uint64_t offset, int rows, int cols) const
+{
+	if (offset == 0) return Eigen::Map<const Eigen::MatrixXf>(nullptr, 0, 0);
+	return Eigen::Map<const Eigen::MatrixXf>(reinterpret_cast<const float*>(bytes + offset), rows, cols);
+}
+
+int Checkpoint::nodes(int i) const
+{
+	Expects(i >= 0 && i < layers());
+	return records[i].nodes;
+}
+
+std::string Checkpoint::activation(int i) const
+{
+	Expects(i >= 0 && i < layers());
+	return records[i].activation;
+}
+
+Eigen::Map<const Eigen::MatrixXf> Checkpoint::weights(int i) const
+{
+	Expects(i >= 0 && i < layers()-1);
+	return matrix(records[i].weights, records[i].nodes, records[i+1].nodes);
+}
+
+Eigen::Map<const Eigen::MatrixXf> Checkpoint::bias(int i) const
+{
+	Expects(i >= 0 && i < layers());
+	return matrix(records[i].bias, records[i].bias_rows, records[i].nodes);
+}
+
+Eigen::Map<const Eigen::MatrixXf> Checkpoint::m(int i) const
+{
+	Expects(i >= 0 && i < layers()-1);
+	return matrix(records[i].m, records[i].nodes, records[i+1].nodes);
+}
+
+Eigen::Map<const Eigen::MatrixXf> Checkpoint::v(int i) const
+{
+	Expects(i >= 0 && i < layers()-1);
+	return matrix(records[i].v, records[i].nodes, records[i+1].nodes);
+}
+}
@@ -0,0 +1,72 @@
+//
+//  checkpoint.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <string>
+#include <Eigen/Dense>
+
+namespace Jacobian {
+class Network;
+
+#define CHECKPOINT_MAGIC 0x4e42434a // "JCBN" as little-endian bytes.
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_ALIGN 64
+
+// A trained network on disk: a header, one record per layer, then every matrix as raw column-major
+// floats starting on a CHECKPOINT_ALIGN boundary. Files are written in host byte order and are only
+// meant to be read back on the same kind of machine. Opening one maps it read-only and checks that
+// every matrix lies inside the file; the weights are then used where they sit, with nothing parsed
+// or copied, so the cost of a cold start is paging them in.
+class Checkpoint {
+public:
+	struct Header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t layers;
+		uint32_t flags;
+		uint32_t batch_size;
+		uint32_t reserved[3];
+	};
+	struct LayerRecord {
+		uint32_t nodes;
+		uint32_t bias_rows;
+		char activation[24]; // A name from activations::registry(), NUL-terminated.
+		uint64_t weights; // Byte offsets of this layer's matrices, 0 where there is none.
+		uint64_t bias;
+		uint64_t m;
+		uint64_t v;
+	};
+	enum Flags : uint32_t {OPTIMIZER_STATE = 1};
+private:
+	const char* bytes = nullptr;
+	size_t size = 0;
+	const Header* header;
+	const LayerRecord* records;
+	Eigen::Map<const Eigen::MatrixXf> matrix(uint64_t offset, int rows, int cols) const;
+public:
+	Checkpoint(const char* path);
+	~Checkpoint();
+	Checkpoint(const Checkpoint&) = delete;
+	Checkpoint& operator=(const Checkpoint&) = delete;
+	// Optimizer state (m and v) is only needed to resume training, so it's left out by default.
+	static void save(const Network& net, const char* path, bool optimizer_state=false);
+	int layers() const {return header->layers;}
+	int batch_size() const {return header->batch_size;}
+	bool has_optimizer_state() const {return header->flags & OPTIMIZER_STATE;}
+	int nodes(int i) const;
+	std::string activation(int i) const;
+	// Weights, m and v lead out of layer i (so i < layers()-1); bias belongs to layer i.
+	Eigen::Map<const Eigen::MatrixXf> weights(int i) const;
+	Eigen::Map<const Eigen::MatrixXf> bias(int i) const;
+	Eigen::Map<const Eigen::MatrixXf> m(int i) const;
+	Eigen::Map<const Eigen::MatrixXf> v(int i) const;
+};
+}
+#endif /* CHECKPOINT_H */
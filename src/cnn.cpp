@@ -5,19 +5,18 @@
 //  Created by David Freifeld
 //
 
+#include <cstring>
+
 #include "bpnn.hpp"
 #include "utils.hpp"
 
 //#include <Eigen/unsupported/CXX11/Tensor>
 #include "cnn.hpp"
 
-#define LARGE_NUM 1000000 // Remove me.
-
-#if (!RECKLESS)
-#define checknan(x, loc) if(x==INFINITY || x==NAN || x == -INFINITY) throw ValueError("Detected NaN in operation", loc)
-#else
-#define checknan(x, loc)
-#endif
+namespace Jacobian {
+#define CONV_TILE 16 // Pooled outputs per tile edge. Keeps a tile's conv outputs well inside L1/L2.
+#define CNN_EPOCH 100 // Images trained on per epoch.
+#define CNN_CHECK_STEPS 8 // Training steps check_fused() compares.
 
 // NOTE: Below three functions not mine, from https://compvisionlab.wordpress.com/2014/01/01/c-code-for-reading-mnist-data-set/
 int ReverseInt (int i)
@@ -30,10 +29,10 @@ int ReverseInt (int i)
     return((int)ch1<<24)+((int)ch2<<16)+((int)ch3<<8)+ch4;
 }   
 
-void ReadMNIST(int NumberOfImages, int DataOfAnImage,std::vector<std::vector<double>> &arr)
+void ReadMNIST(std::string full_path, int NumberOfImages, int DataOfAnImage,std::vector<std::vector<double>> &arr)
 {
     arr.resize(NumberOfImages,std::vector<double>(DataOfAnImage));
-    std::ifstream file ("./t10k-images-idx3-ubyte",std::ios::binary);
+    std::ifstream file (full_path,std::ios::binary);
     if (file.is_open())
     {
         int magic_number=0;
@@ -93,89 +92,173 @@ unsigned char* read_mnist_labels(std::string full_path, int number_of_labels) {
     }
 }
 
+
 ConvLayer::ConvLayer(int x, int y, int stride, int kern_x, int kern_y, int pad, std::function<float(float)> activ, std::function<float(float)> activ_deriv)
-    :stride_len(stride), padding(pad), activation(activ), activation_deriv(activ_deriv)
+    :stride_len(stride), padding(pad),
+     input(nullptr, x+2*pad, y+2*pad),
+     kernel(kern_x, kern_y),
+     output(nullptr, (x+2*pad-kern_x)/stride+1, (y+2*pad-kern_y)/stride+1),
+     dZ(nullptr, (x+2*pad-kern_x)/stride+1, (y+2*pad-kern_y)/stride+1),
+     activation(activ), activation_deriv(activ_deriv)
 {
-    pad*=2;
-    input = new Eigen::MatrixXf (x+pad,y+pad);
-    dZ = new Eigen::MatrixXf (x+pad,y+pad);
-    for (int i = 0; i < (x+pad)*(y+pad); i++) {
-        (*input)((int)i / (y+pad),i%(y+pad)) = 0;
-        (*dZ)((int)i / (y+pad),i%(y+pad)) = 0;        
-    }
-    kernel = new Eigen::MatrixXf (kern_x, kern_y);
     for (int i = 0; i < kern_x*kern_y; i++) {
-        (*kernel)((int)i / kern_y,i%kern_y) = (float) rand() / RAND_MAX;
-    }
-    output = new Eigen::MatrixXf ((x-kern_x+1+pad/stride_len), (y-kern_y+1+pad/stride_len));
-    for (int i = 0; i < (x-kern_y+1+pad/stride_len)*(y-kern_x+1+pad/stride_len); i++) {
-        (*output)((int)i / (y-kern_y+1+pad/stride_len),i%(y-kern_y+1+pad/stride_len)) = 0;
+        kernel((int)i / kern_y,i%kern_y) = (float) rand() / RAND_MAX;
     }
     bias = 0;
 };
 
+// The conv outputs are computed exactly as convolute_pooled() computes them, so the two paths agree.
 void ConvLayer::convolute()
 {
-    for (int i = 0; i < (*input).rows(); i++) {
-        for (int j = 0; j < (*input).cols(); j++) {
-            (*dZ)(i, j) = activation_deriv((*input)(i, j));
-            (*input)(i, j) = activation((*input)(i, j));
+    const int kern_rows = kernel.rows();
+    const int kern_cols = kernel.cols();
+    for (int j = 0; j < output.cols(); j++) {
+        for (int i = 0; i < output.rows(); i++) {
+            float z = kernel.cwiseProduct(input.block(i * stride_len, j * stride_len, kern_rows, kern_cols)).sum() + bias;
+            dZ(i, j) = activation_deriv(z);
+            output(i, j) = activation(z);
+        }
+    }
+}
+
+// Computes pool(activation(conv(input) + bias)) one tile at a time. The conv outputs for a tile only
+// ever live in a small scratch block; the pooled values, the derivative at each winning position and
+// the winner's index (which is all backprop needs) are the only things written back.
+void ConvLayer::convolute_pooled(PoolingLayer& pool)
+{
+    const int kern_rows = kernel.rows();
+    const int kern_cols = kernel.cols();
+    const int pool_rows = pool.kernel.rows();
+    const int pool_cols = pool.kernel.cols();
+    const int pool_stride = pool.stride_len;
+    const int conv_rows = (input.rows() - kern_rows) / stride_len + 1;
+    const int conv_cols = (input.cols() - kern_cols) / stride_len + 1;
+    const int out_rows = (conv_rows - pool_rows) / pool_stride + 1;
+    const int out_cols = (conv_cols - pool_cols) / pool_stride + 1;
+    Expects(pool.output.rows() == out_rows && pool.output.cols() == out_cols);
+    const int max_tile_rows = (CONV_TILE - 1) * pool_stride + pool_rows;
+    const int max_tile_cols = (CONV_TILE - 1) * pool_stride + pool_cols;
+    Eigen::MatrixXf tile (max_tile_rows, max_tile_cols);
+    Eigen::MatrixXf tile_deriv (max_tile_rows, max_tile_cols);
+    for (int tj = 0; tj < out_cols; tj += CONV_TILE) {
+        for (int ti = 0; ti < out_rows; ti += CONV_TILE) {
+            const int tile_out_rows = std::min(CONV_TILE, out_rows - ti);
+            const int tile_out_cols = std::min(CONV_TILE, out_cols - tj);
+            const int first_row = ti * pool_stride;
+            const int first_col = tj * pool_stride;
+            const int tile_rows = (tile_out_rows - 1) * pool_stride + pool_rows;
+            const int tile_cols = (tile_out_cols - 1) * pool_stride + pool_cols;
+            for (int c = 0; c < tile_cols; c++) {
+                for (int r = 0; r < tile_rows; r++) {
+                    float z = kernel.cwiseProduct(input.block((first_row + r) * stride_len,
+                                                              (first_col + c) * stride_len,
+                                                              kern_rows, kern_cols)).sum() + bias;
+                    tile_deriv(r, c) = activation_deriv(z);
+                    tile(r, c) = activation(z);
+                }
+            }
+            for (int j = 0; j < tile_out_cols; j++) {
+                for (int i = 0; i < tile_out_rows; i++) {
+                    Eigen::Index max_row, max_col;
+                    float max = tile.block(i * pool_stride, j * pool_stride, pool_rows, pool_cols).maxCoeff(&max_row, &max_col);
+                    max_row += i * pool_stride;
+                    max_col += j * pool_stride;
+                    pool.output(ti + i, tj + j) = max;
+                    pool.dZ(ti + i, tj + j) = tile_deriv(max_row, max_col);
+                    pool.argmax(ti + i, tj + j) = (first_row + max_row) * conv_cols + first_col + max_col;
+                }
+            }
         }
     }
-    for (int i = 0; i < output->rows(); i+=stride_len) {
-        for (int j = 0; j < output->cols(); j+=stride_len) {
-            (*output)(i, j) = (*kernel * (input->block(i, j, kernel->rows(), kernel->cols()))).sum();            
+}
+
+Eigen::MatrixXf ConvLayer::backpropagate(const Eigen::MatrixXf& gradient, float learning_rate, float bias_rate)
+{
+    Expects(gradient.rows() == output.rows() && gradient.cols() == output.cols());
+    const int kern_rows = kernel.rows();
+    const int kern_cols = kernel.cols();
+    Eigen::MatrixXf kernel_delta = Eigen::MatrixXf::Zero(kern_rows, kern_cols);
+    Eigen::MatrixXf input_grad = Eigen::MatrixXf::Zero(input.rows(), input.cols());
+    for (int j = 0; j < gradient.cols(); j++) {
+        for (int i = 0; i < gradient.rows(); i++) {
+            const float g = gradient(i, j);
+            if (g == 0) continue; // Everything a pool didn't pick.
+            kernel_delta += g * input.block(i * stride_len, j * stride_len, kern_rows, kern_cols);
+            input_grad.block(i * stride_len, j * stride_len, kern_rows, kern_cols) += g * kernel;
         }
     }
-    *output = (output->array() + bias).matrix();
+    kernel -= learning_rate * kernel_delta;
+    bias -= bias_rate * gradient.sum();
+    return input_grad;
 }
 
 void ConvLayer::set_input(Eigen::MatrixXf* matrix)
 {
-    input->block(padding, padding, matrix->rows(), matrix->cols()) = *matrix;
+    input.block(padding, padding, matrix->rows(), matrix->cols()) = *matrix;
 }
 
 // Will eventually be different from ConvLayer
 PoolingLayer::PoolingLayer(int x, int y, int stride, int kern_x, int kern_y, int pad)
-    :stride_len(stride), padding(pad)
+    :stride_len(stride), padding(pad),
+     input(nullptr, x+pad, y+pad),
+     kernel(kern_x, kern_y),
+     output(nullptr, (x-kern_x)/stride+1, (y-kern_y)/stride+1),
+     dZ(nullptr, (x-kern_x)/stride+1, (y-kern_y)/stride+1),
+     argmax(Eigen::MatrixXi::Zero((x-kern_x)/stride+1, (y-kern_y)/stride+1))
 {
-    input = new Eigen::MatrixXf (x+pad,y+pad);
-    for (int i = 0; i < (x+pad)*(y+pad); i++) {
-        (*input)((int)i / (y+pad),i%(y+pad)) = 0;
-    }
-    kernel = new Eigen::MatrixXf (kern_x, kern_y);
     for (int i = 0; i < kern_x*kern_y; i++) {
-        (*kernel)((int)i / kern_y,i%kern_y) = (float) rand()/RAND_MAX;
-    }
-    output = new Eigen::MatrixXf (x-kern_x+1, y-kern_y+1);
-    for (int i = 0; i < (x-kern_x+1)*(y-kern_y+1); i++) {
-        (*output)((int)i / (y-kern_y+1),i%(y-kern_y+1)) = (float) rand()/RAND_MAX;
+        kernel((int)i / kern_y,i%kern_y) = (float) rand()/RAND_MAX;
     }
 };
 
-void PoolingLayer::pool()
+// Records the same winners, in the same order of precedence, as convolute_pooled().
+void PoolingLayer::pool(const ConvLayer& conv)
 {
-  // It doesn't look like anything better than O(n^4) is doable for this as kernel needs to go through matrix and you need to index kernel. LOOK INTO ME!! 
-    float maxnum = -LARGE_NUM;
-    for (int i = 0; i < input->cols() - kernel->cols(); i+=stride_len) {
-        for (int j = 0; j < input->rows() - kernel->rows(); j+=stride_len) {
-            for (int k = 0; k < kernel->cols(); k++) {
-                for (int l = 0; l < kernel->rows(); l++) {
-                    if ((input->block(j, i, kernel->rows(), kernel->cols()))(l, k) > maxnum) {
-                        maxnum = (input->block(j, i, kernel->rows(), kernel->cols()))(l, k);
-                    }
-                }
-            }
+    const int pool_rows = kernel.rows();
+    const int pool_cols = kernel.cols();
+    for (int j = 0; j < output.cols(); j++) {
+        for (int i = 0; i < output.rows(); i++) {
+            Eigen::Index max_row, max_col;
+            float max = input.block(i * stride_len, j * stride_len, pool_rows, pool_cols).maxCoeff(&max_row, &max_col);
+            max_row += i * stride_len;
+            max_col += j * stride_len;
+            output(i, j) = max;
+            dZ(i, j) = conv.dZ(max_row, max_col);
+            argmax(i, j) = max_row * input.cols() + max_col;
         }
     }
 }
 
+// Routes a gradient w.r.t. the pooled output back to the conv output it came from (rows x cols),
+// scaled by the activation derivative recorded by pool() or convolute_pooled().
+Eigen::MatrixXf PoolingLayer::unpool(const Eigen::MatrixXf& grad, int rows, int cols)
+{
+    Eigen::MatrixXf result = Eigen::MatrixXf::Zero(rows, cols);
+    for (int j = 0; j < grad.cols(); j++) {
+        for (int i = 0; i < grad.rows(); i++) {
+            int index = argmax(i, j);
+            result(index / cols, index % cols) += grad(i, j) * dZ(i, j);
+        }
+    }
+    return result;
+}
+
 ConvNet::ConvNet(const char* path, float learn_rate, float bias_rate, Regularization reg, float l, float ratio)
     :Network(path, 1, learn_rate, bias_rate, reg, l, ratio), preprocess_length{0}
 {
-    ReadMNIST(10000,784,data);
-    data_labels = read_mnist_labels("./t10k-labels-idx1-ubyte",10000);
-    labels = new Eigen::MatrixXf (1, 1);
+    labels = Eigen::MatrixXf::Zero(1, 1);
+}
+
+ConvNet::~ConvNet()
+{
+    delete[] data_labels;
+}
+
+void ConvNet::load_mnist(const char* images, const char* labels_path, int count)
+{
+    ReadMNIST(images, count, 784, data);
+    delete[] data_labels;
+    data_labels = read_mnist_labels(labels_path, count);
 }
 
 void ConvNet::add_conv_layer(int x, int y, int stride, int kern_x, int kern_y, int pad, std::function<float(float)> activ, std::function<float(float)> activ_deriv)
@@ -190,142 +273,244 @@ void ConvNet::add_pool_layer(int x, int y, int stride, int kern_x, int kern_y, i
     pool_layers.emplace_back(x,y,stride,kern_x,kern_y,pad);
 }
 
+// What conv layer i hands on: its pool's output if it has a pool, or else its own.
+ArenaBuffer& ConvNet::output_of(int i)
+{
+    return i < static_cast<int>(pool_layers.size()) ? pool_layers[i].output : conv_layers[i].output;
+}
+
+// Backprop reads every conv input and derivative, so all of these buffers are live for the whole
+// step; the arena packs them into one block and makes each layer's input alias whatever feeds it.
 void ConvNet::initialize()
 {
-    for (int i = 0; i < length-1; i++) {
-        layers[i].init_weights(layers[i+1]);
+    Expects(preprocess_length > 0 && pool_layers.size() <= conv_layers.size());
+    Network::initialize();
+    conv_buffers.clear();
+    const bool fusing = fused();
+    std::vector<int> input_ids, output_ids, dZ_ids, pool_ids, pool_dZ_ids;
+    int feed = -1;
+    for (int i = 0; i < preprocess_length; i++) {
+        ConvLayer& conv = conv_layers[i];
+        if (feed >= 0) {
+            // The aliased input takes the shape of the buffer feeding it.
+            const ArenaBuffer& source = output_of(i-1);
+            new (&conv.input) ArenaBuffer(nullptr, source.rows(), source.cols());
+            input_ids.push_back(feed);
+        }
+        else input_ids.push_back(conv_buffers.reserve(conv.input.rows(), conv.input.cols(), 0, 0));
+        Expects(conv.output.rows() == (conv.input.rows() - conv.kernel.rows()) / conv.stride_len + 1 &&
+                conv.output.cols() == (conv.input.cols() - conv.kernel.cols()) / conv.stride_len + 1);
+        // The fused kernel never materializes the conv output or its derivative.
+        output_ids.push_back(fusing ? -1 : conv_buffers.reserve(conv.output.rows(), conv.output.cols(), 0, 0));
+        dZ_ids.push_back(fusing ? -1 : conv_buffers.reserve(conv.output.rows(), conv.output.cols(), 0, 0));
+        if (i < static_cast<int>(pool_layers.size())) {
+            PoolingLayer& pool = pool_layers[i];
+            Expects(pool.output.rows() == (conv.output.rows() - pool.kernel.rows()) / pool.stride_len + 1 &&
+                    pool.output.cols() == (conv.output.cols() - pool.kernel.cols()) / pool.stride_len + 1);
+            new (&pool.input) ArenaBuffer(nullptr, conv.output.rows(), conv.output.cols());
+            pool_ids.push_back(conv_buffers.reserve(pool.output.rows(), pool.output.cols(), 0, 0));
+            pool_dZ_ids.push_back(conv_buffers.reserve(pool.output.rows(), pool.output.cols(), 0, 0));
+        }
+        feed = i < static_cast<int>(pool_layers.size()) ? pool_ids.back() : output_ids.back();
+    }
+    Expects(layers[0].contents.cols() == output_of(preprocess_length-1).size());
+    conv_buffers.plan();
+    for (int i = 0; i < preprocess_length; i++) {
+        conv_buffers.bind(conv_layers[i].input, input_ids[i]);
+        if (output_ids[i] >= 0) {
+            conv_buffers.bind(conv_layers[i].output, output_ids[i]);
+            conv_buffers.bind(conv_layers[i].dZ, dZ_ids[i]);
+        }
+        if (i < static_cast<int>(pool_layers.size())) {
+            if (output_ids[i] >= 0) conv_buffers.bind(pool_layers[i].input, output_ids[i]);
+            conv_buffers.bind(pool_layers[i].output, pool_ids[i]);
+            conv_buffers.bind(pool_layers[i].dZ, pool_dZ_ids[i]);
+        }
     }
 }
 
 void ConvNet::next_batch()
 {
+    ConvLayer& first = conv_layers[0];
     for (int i = 0; i < 784; i++) {
-        (*conv_layers[0].input)(i/28, i%28) = data[batches][i];
+        first.input(first.padding + i/28, first.padding + i%28) = data[batches][i];
     }
-    (*labels)(0,0) = (float)(int)data_labels[batches];
+    labels(0,0) = (float)(int)data_labels[batches];
 }
 
 void ConvNet::process()
 {
     // Assumes pooling is immediately after any conv layer.
-    for (int i = 0; i < preprocess_length-1; i++) {
-        conv_layers[i].convolute();
-        //   pool_layers[i].input = conv_layers[i].output;
-        //   pool_layers[i].pool();
-        conv_layers[i+1].input = conv_layers[i].output;
+    if (fused()) {
+        // Every conv layer has its pool, so run the fused kernel and never materialize conv outputs.
+        for (int i = 0; i < preprocess_length; i++) {
+            conv_layers[i].convolute_pooled(pool_layers[i]);
+        }
     }
-    conv_layers[preprocess_length-1].convolute(); 
-    //pool_layers[preprocess_length-1].input = conv_layers[preprocess_length-1].output;
-    //pool_layers[preprocess_length-1].pool();
-    //  std::cout << "Output:\n" << *pool_layers[preprocess_length-1].output << "\n\n";
-    Eigen::Map<Eigen::RowVectorXf> flattened (conv_layers[preprocess_length-1].output->data(), conv_layers[preprocess_length-1].output->size());
-    // std::cout << "Flattened:\n" << flattened << "\n\n";
-    for (int i = 0; i < flattened.cols(); i++) {
-        (*layers[0].contents)(0, i) = flattened[i];
+    else {
+        for (int i = 0; i < preprocess_length; i++) {
+            conv_layers[i].convolute();
+            if (i < static_cast<int>(pool_layers.size())) pool_layers[i].pool(conv_layers[i]);
+        }
     }
+    const ArenaBuffer& last = output_of(preprocess_length-1);
+    layers[0].contents.row(0) = Eigen::Map<const Eigen::RowVectorXf>(last.data(), last.size());
 }
 
 void ConvNet::set_label(Eigen::MatrixXf newlabels)
 {
-    *labels = newlabels;
+    labels = newlabels;
 }
 
 void ConvNet::list_net()
 {
     for (int i = 0; i < preprocess_length; i++) {
-        std::cout << "-----------------------\nCONVOLUTIONAL LAYER " << i << "\n-----------------------\n\n\u001b[31mGENERAL INFO:\x1B[0;37m\nStride: " << conv_layers[i].stride_len << "\nPadding: " << conv_layers[i].padding <<  "\n\n\u001b[31mINPUT:\x1B[0;37m\n" << *conv_layers[i].input << "\n\n\u001b[31mKERNEL:\x1B[0;37m\n" << *conv_layers[i].kernel << "\n\n\u001b[31mOUTPUT:\x1B[0;37m\n" << *conv_layers[i].output << "\n\n\u001b[31mBIAS:\x1B[0;37m\n" << conv_layers[i].bias << "\n\n\n";
-        //std::cout << "-----------------------\nPOOLING LAYER " << i << "\n-----------------------\n\n\u001b[31mGENERAL INFO:\x1B[0;37m\nStride: " << pool_layers[i].stride_len << "\nPadding: " << conv_layers[i].padding << "\n\n\u001b[31mINPUT:\x1B[0;37m\n" << *pool_layers[i].input << "\n\n\u001b[31mKERNEL:\x1B[0;37m\n-" << *pool_layers[i].kernel << "\n\n\u001b[31mOUTPUT:\x1B[0;37m\n" << *pool_layers[i].output << "\n\n\n";
-    }
-    std::cout << "-----------------------\nINPUT LAYER (LAYER 0)\n-----------------------\n\n\u001b[31mGENERAL INFO:\x1B[0;37m\nActivation Function: " << layers[0].activation_str << "\n\n\u001b[31mACTIVATIONS:\x1B[0;37m\n" << *layers[0].contents << "\n\n\u001b[31mWEIGHTS:\x1B[0;37m\n" << *layers[0].weights << "\n\n\u001b[31mBIASES:\x1B[0;37m\n" << *layers[0].bias << "\n\n\n";
-    for (int i = 1; i < length-1; i++) {
-        std::cout << "-----------------------\nLAYER " << i << "\n-----------------------\n\n\u001b[31mGENERAL INFO:\x1B[0;37m\nActivation Function: " << layers[i].activation_str << "\n\n\u001b[31mACTIVATIONS:\x1B[0;37m\n" << *layers[i].contents << "\n\n\u001b[31mBIASES:\x1B[0;37m\n" << *layers[i].bias << "\n\n\u001b[31mWEIGHTS:\x1B[0;37m\n" << *layers[i].weights << "\n\n\n";
+        std::cout << "-----------------------\nCONVOLUTIONAL LAYER " << i << "\n-----------------------\n\n\u001b[31mGENERAL INFO:\x1B[0;37m\nStride: " << conv_layers[i].stride_len << "\nPadding: " << conv_layers[i].padding << "\n\n\u001b[31mKERNEL:\x1B[0;37m\n" << conv_layers[i].kernel << "\n\n\u001b[31mOUTPUT:\x1B[0;37m\n" << output_of(i) << "\n\n\u001b[31mBIAS:\x1B[0;37m\n" << conv_layers[i].bias << "\n\n\n";
     }
-    std::cout << "-----------------------\nOUTPUT LAYER (LAYER " << length-1 << ")\n-----------------------\n\n\u001b[31mGENERAL INFO:\x1B[0;37m\nActivation Function: " << layers[length-1].activation_str <<"\n\n\u001b[31mACTIVATIONS:\x1B[0;37m\n" << *layers[length-1].contents << "\n\n\u001b[31mBIASES:\x1B[0;37m\n" << *layers[length-1].bias <<  "\n\n\n";
+    Network::list_net();
 }
 
+// The dense layers backpropagate as usual, and the error at their input is carried on back through
+// each pool (to the conv output that won) and conv layer in turn.
 void ConvNet::backpropagate()
 {
-    list_net();
-    char a;
-    std::cin >> a;
-    std::vector<Eigen::MatrixXf> gradients;
-    gradients.push_back(Network::backpropagate());    
-    Eigen::Map<Eigen::MatrixXf> reshaped(gradients[gradients.size()-1].data(),
-                           conv_layers.back().output->rows(),
-                           conv_layers.back().output->cols());
-    gradients[gradients.size()-1] = reshaped;
-    std::vector<Eigen::MatrixXf> conv_deltas;
-    for (int layer = conv_layers.size()-1; layer >= 0; layer--) {
-        conv_deltas.emplace_back(conv_layers[layer].kernel->rows(),
-                                 conv_layers[layer].kernel->cols());
-        std::cout << conv_layers[layer].input->cols() << " " << gradients.back().cols() << "\n";
-        for (int i = 0; i < conv_layers[layer].input->rows() - gradients.back().rows() + 1; i++) {
-            for (int j = 0; j < conv_layers[layer].input->cols() - gradients.back().cols() + 1; j++) {
-                conv_deltas[conv_deltas.size()-1](i, j) = (gradients.back() * conv_layers[layer].input->block(i, j, gradients.back().rows(), gradients.back().cols())).sum();
-            }
-        }
-        *conv_layers[layer].kernel -= conv_deltas.back();
-
-        Eigen::MatrixXf flipped_kernel =
-            Eigen::MatrixXf::Zero(conv_layers[layer].kernel->rows(), conv_layers[layer].kernel->cols());
-        flipped_kernel = conv_layers[layer].kernel->transpose().colwise().reverse().transpose().colwise().reverse();
-        Eigen::MatrixXf padded_grad = Eigen::MatrixXf::Zero(gradients.back().rows() + ((flipped_kernel.rows() - 1)*2), gradients.back().cols() + ((flipped_kernel.cols() - 1)*2));
-        padded_grad.block(flipped_kernel.rows() - 1, flipped_kernel.cols() - 1, gradients.back().rows(), gradients.back().cols()) = gradients.back();
-        Eigen::MatrixXf final_grad (padded_grad.rows() - flipped_kernel.rows() + 1, padded_grad.cols() - flipped_kernel.cols() + 1);
-        for (int i = 0; i < padded_grad.rows() - flipped_kernel.rows() + 1; i++) {
-            for (int j = 0; j < padded_grad.cols() - gradients.back().cols() + 1; j++) {
-                final_grad(i, j) = (flipped_kernel * padded_grad.block(i, j, flipped_kernel.rows(), flipped_kernel.cols())).sum();
-            }
-        }
-        gradients.push_back(final_grad.cwiseProduct(*conv_layers[layer].dZ));
+    Eigen::MatrixXf first_weights = layers[0].weights; // Network::backpropagate() updates them.
+    Eigen::MatrixXf hidden = Network::backpropagate(); // The error at layer 1.
+    Eigen::MatrixXf flattened = (hidden * first_weights.transpose()).cwiseProduct(layers[0].dZ);
+    const ArenaBuffer& last = output_of(preprocess_length-1);
+    Eigen::MatrixXf gradient = Eigen::Map<const Eigen::MatrixXf>(flattened.data(), last.rows(), last.cols());
+    for (int i = preprocess_length-1; i >= 0; i--) {
+        ConvLayer& conv = conv_layers[i];
+        if (i < static_cast<int>(pool_layers.size()))
+            gradient = pool_layers[i].unpool(gradient, conv.output.rows(), conv.output.cols());
+        else gradient = gradient.cwiseProduct(conv.dZ);
+        gradient = conv.backpropagate(gradient, learning_rate, bias_lr);
     }
-    list_net();
-    assert(2<1);
 }
 
 void ConvNet::train()
 {
+    ProfileScope profiling = profile_epoch();
     float cost_sum = 0;
     float acc_sum = 0;
-    for (int i = 0; i <= 100; i++) {
-        if (i != instances-batch_size) { // Don't try to advance batch on final batch.
+    const int count = std::min(CNN_EPOCH, static_cast<int>(data.size()));
+    Expects(count > 0);
+    batches = 0;
+    for (int i = 0; i < count; i++) {
+        {
+            PROFILE(Phase::next_batch);
             next_batch();
         }
-        process();
-        feedforward();
-        backpropagate();
-        cost_sum += cost();
-        acc_sum += accuracy();
+        {
+            PROFILE(Phase::convolve);
+            process();
+        }
+        {
+            PROFILE(Phase::feedforward);
+            feedforward();
+        }
+        {
+            PROFILE(Phase::backpropagate);
+            backpropagate();
+        }
+        {
+            PROFILE(Phase::cost);
+            cost_sum += cost();
+        }
+        {
+            PROFILE(Phase::accuracy);
+            acc_sum += accuracy();
+        }
         batches++;
     }
-    list_net();
-    epoch_acc = 1.0/(100) * acc_sum;
-    epoch_cost = 1.0/(100) * cost_sum;
-    printf("Epoch %i complete - cost %f - acc %f\n", epochs, epoch_cost, epoch_acc);
+    epoch_acc = 1.0/count * acc_sum;
+    epoch_cost = 1.0/count * cost_sum;
+    if (silenced == false)
+        printf("Epoch %i complete - cost %f - acc %f\n", epochs, epoch_cost, epoch_acc);
     batches=0;
-    decay();
+    decay(learning_rate);
     epochs++;
 }
+}
 
-int main()
+// Runs the same small net with the fused and the separate conv + pool kernels, from the same
+// weights and on the same images, and fails unless their activations and updates agree.
+int check_fused()
 {
-    ConvNet net ("../data_banknote_authentication.txt", 0.05, 0.01, L2, 0, 0.9);
-    Eigen::MatrixXf labels (1,1);
-    net.add_conv_layer(28, 28, 1, 9, 9, 0, lecun_tanh, lecun_tanh_deriv);
-    //  net.add_pool_layer(20,20,1,6,6,0);
-    net.add_conv_layer(20, 20, 1, 6, 6, 0, lecun_tanh, lecun_tanh_deriv);
-    std::cout << net.conv_layers[net.conv_layers.size()-1].output->rows() << "\n";
-    //net.add_pool_layer(10,10,1,2,2,0);
-    net.add_layer(400, "sigmoid", sigmoid, sigmoid_deriv);
-    net.add_layer(5, "lecun_tanh", lecun_tanh, lecun_tanh_deriv);
-    net.add_layer(10, "resig", rectifier(sigmoid), rectifier(sigmoid_deriv));
-    //  net.list_net();
-    //  net.init_decay("step", 1, 2);
-    net.initialize();
-    //net.list_net();
+    using namespace Jacobian;
+    std::vector<std::unique_ptr<ConvNet>> nets;
+    for (bool fuse : {true, false}) {
+        nets.push_back(std::make_unique<ConvNet>("./data_banknote_authentication.txt", 0.05, 0.01, Regularization::L2, 0, 0.9));
+        ConvNet& net = *nets.back();
+        net.silenced = true;
+        net.fuse = fuse;
+        net.add_conv_layer(12, 12, 1, 3, 3, 0, activations::lecun_tanh, activations::lecun_tanh_deriv);
+        net.add_pool_layer(10, 10, 2, 2, 2, 0);
+        net.add_conv_layer(5, 5, 1, 2, 2, 0, activations::sigmoid, activations::sigmoid_deriv);
+        net.add_pool_layer(4, 4, 1, 2, 2, 0);
+        net.add_layer(9, activations::linear, activations::linear_deriv);
+        net.add_layer(6, activations::sigmoid, activations::sigmoid_deriv);
+        net.add_layer(3, activations::linear, activations::linear_deriv);
+        net.init_optimizer(optimizers::momentum(0.1));
+        net.initialize();
+    }
+    ConvNet& fused = *nets[0];
+    ConvNet& separate = *nets[1];
+    Expects(fused.fused() && !separate.fused());
+    for (int i = 0; i < fused.preprocess_length; i++) {
+        separate.conv_layers[i].kernel = fused.conv_layers[i].kernel;
+        separate.conv_layers[i].bias = fused.conv_layers[i].bias;
+    }
+    for (int i = 0; i < fused.length; i++) {
+        separate.layers[i].weights = fused.layers[i].weights;
+        separate.layers[i].bias = fused.layers[i].bias;
+        separate.layers[i].m = fused.layers[i].m;
+        separate.layers[i].v = fused.layers[i].v;
+    }
+    float worst = 0;
+    auto compare = [&worst](const Eigen::MatrixXf& a, const Eigen::MatrixXf& b) {
+        worst = std::max(worst, (a - b).cwiseAbs().maxCoeff());
+    };
+    for (int step = 0; step < CNN_CHECK_STEPS; step++) {
+        Eigen::MatrixXf image = Eigen::MatrixXf::Random(12, 12);
+        for (ConvNet* net : {&fused, &separate}) {
+            net->conv_layers[0].set_input(&image);
+            net->labels(0, 0) = step % 3;
+            net->process();
+            net->feedforward();
+            net->backpropagate();
+        }
+        for (int i = 0; i < fused.preprocess_length; i++) {
+            compare(fused.pool_layers[i].output, separate.pool_layers[i].output);
+            compare(fused.pool_layers[i].dZ, separate.pool_layers[i].dZ);
+            compare(fused.conv_layers[i].kernel, separate.conv_layers[i].kernel);
+            worst = std::max(worst, std::abs(fused.conv_layers[i].bias - separate.conv_layers[i].bias));
+            if (fused.pool_layers[i].argmax != separate.pool_layers[i].argmax) worst = INFINITY;
+        }
+        for (int i = 0; i < fused.length; i++) compare(fused.layers[i].contents, separate.layers[i].contents);
+    }
+    printf("Fused and separate conv + pool over %i steps - largest difference %g\n", CNN_CHECK_STEPS, worst);
+    return worst <= 1e-5 ? 0 : 1;
+}
 
+// Trains on the first MNIST test images, from t10k-images-idx3-ubyte and t10k-labels-idx1-ubyte in
+// the working directory. "check" compares the fused conv + pool kernel with the separate ones instead.
+int main(int argc, char** argv)
+{
+    using namespace Jacobian;
+    if (argc >= 2 && strcmp(argv[1], "check") == 0) return check_fused();
+    ConvNet net ("./data_banknote_authentication.txt", 0.05, 0.01, Regularization::L2, 0, 0.9);
+    net.load_mnist("./t10k-images-idx3-ubyte", "./t10k-labels-idx1-ubyte", 10000);
+    net.add_conv_layer(28, 28, 1, 9, 9, 0, activations::lecun_tanh, activations::lecun_tanh_deriv);
+    net.add_pool_layer(20, 20, 2, 2, 2, 0);
+    net.add_conv_layer(10, 10, 1, 3, 3, 0, activations::lecun_tanh, activations::lecun_tanh_deriv);
+    net.add_pool_layer(8, 8, 2, 2, 2, 0);
+    net.add_layer(16, activations::linear, activations::linear_deriv);
+    net.add_layer(32, activations::lecun_tanh, activations::lecun_tanh_deriv);
+    net.add_layer(10, activations::linear, activations::linear_deriv);
+    net.init_optimizer(optimizers::momentum(0.1));
+    net.initialize();
     for (int i = 0; i < 1; i++) {
         net.train();
     }
-    net.list_net();
 }
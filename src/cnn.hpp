@@ -3,48 +3,73 @@
 
 #include <fstream>
 
+#include "bpnn.hpp"
+#include "arena.hpp"
+
+namespace Jacobian {
+class PoolingLayer;
+
+// Computes activation(conv(input) + bias). output holds the activations and dZ their derivatives,
+// both output-shaped, except when fused with a pool, where neither is ever materialized.
 class ConvLayer
 {
 public:
     int stride_len;
     int padding;
-    Eigen::MatrixXf* input;
-    Eigen::MatrixXf* kernel;
-    Eigen::MatrixXf* output;
-    Eigen::MatrixXf* dZ;
+    // Buffers live in the owning ConvNet's arena and are bound by ConvNet::initialize().
+    // Until then they are null maps that only carry their shapes.
+    ArenaBuffer input;
+    Eigen::MatrixXf kernel;
+    ArenaBuffer output;
+    ArenaBuffer dZ;
     std::function<float(float)> activation;
     std::function<float(float)> activation_deriv;
     float bias;
-  
+
     ConvLayer(int x, int y, int stride, int kern_x, int kern_y, int pad, std::function<float(float)> activ, std::function<float(float)> activ_deriv);
     void convolute();
+    void convolute_pooled(PoolingLayer& pool); // Fused conv + bias + activation + pool.
+    // Takes the gradient w.r.t. the conv's pre-activation values, updates the kernel and bias and
+    // returns the gradient w.r.t. the input (computed with the kernel as it was).
+    Eigen::MatrixXf backpropagate(const Eigen::MatrixXf& gradient, float learning_rate, float bias_rate);
     void set_input(Eigen::MatrixXf* matrix);
 };
 
+// Max pooling. Either way the conv layer below runs, the pooled values, the activation derivative at
+// each winning position and the winner's index end up here, and backprop only needs those.
 class PoolingLayer
 {
 public:
     int stride_len;
     int padding;
-    Eigen::MatrixXf* input;
-    Eigen::MatrixXf* kernel;
-    Eigen::MatrixXf* output;
-    
-    void pool();
+    ArenaBuffer input;
+    Eigen::MatrixXf kernel;
+    ArenaBuffer output;
+    ArenaBuffer dZ; // Activation derivative at each pooled position.
+    Eigen::MatrixXi argmax; // Flat (row-major) index into the conv output that won each pool window.
+
+    void pool(const ConvLayer& conv); // Pools conv's materialized output, which input is bound to.
+    Eigen::MatrixXf unpool(const Eigen::MatrixXf& grad, int rows, int cols);
     PoolingLayer(int x, int y, int stride, int kern_x, int kern_y, int pad);
 };
 
 class ConvNet : public Network
 {
+    Arena conv_buffers;
+    ArenaBuffer& output_of(int i);
 public:
     int preprocess_length;
+    bool fuse = true; // Run the fused kernel when every conv layer has its pool. Set before initialize().
     std::vector<std::vector<double>> data;
-    unsigned char* data_labels;
-    
+    unsigned char* data_labels = nullptr;
+
     std::vector<ConvLayer> conv_layers;
     std::vector<PoolingLayer> pool_layers;
-    
+
     ConvNet(const char* path, float learn_rate, float bias_rate, Regularization reg, float l, float ratio);
+    ~ConvNet();
+    void load_mnist(const char* images, const char* labels_path, int count);
+    bool fused() const {return fuse && pool_layers.size() == conv_layers.size();}
     void list_net();
     void process(); // Runs the convolutional and pooling layers.
     void next_batch();
@@ -55,4 +80,5 @@ public:
     void set_label(Eigen::MatrixXf newlabels);
     void initialize();
 };
+}
 #endif /* MODULE_H */
@@ -44,7 +44,7 @@ void Network::next_batch(int fd)
 				layers[0].contents(lines,i) = *(reinterpret_cast<float*>(p));
 				p += sizeof(float);
 			}
-			(*labels)(lines,0) = *(reinterpret_cast<float*>(p));
+			labels(lines,0) = *(reinterpret_cast<float*>(p));
 			p += sizeof(float);
 			++lines;
 		}
@@ -56,13 +56,66 @@ void Network::next_batch(int fd)
 				layers[0].contents(lines,i) = *(reinterpret_cast<float*>(p));
 				p += sizeof(float);
 			}
-			(*labels)(lines,0) = *(reinterpret_cast<float*>(p));
+			labels(lines,0) = *(reinterpret_cast<float*>(p));
 			p += sizeof(float);
 			++lines;
 		}
 	}
 }
 
+// Reads batch number index (of view.rows rows) straight from its offset, so any number of threads
+// can share one descriptor.
+void Network::load_batch(int fd, int index, const BatchView& view)
+{
+	Expects(fd > 0);
+	const int width = view.contents[0]->cols() + 1; // Features, then the label.
+	thread_local std::vector<float> rows;
+	rows.resize(view.rows * width);
+	size_t bytes = rows.size() * sizeof(float);
+	if (pread(fd, rows.data(), bytes, static_cast<off_t>(index) * bytes) != static_cast<ssize_t>(bytes))
+		throw std::runtime_error{"load_batch() could not read a full batch."};
+	fill_batch(rows.data(), view);
+}
+
+// Reads batch number index of the training or validation set, from the shared dataset if there is one.
+void Network::read_batch(bool validation, int index, const BatchView& view)
+{
+	if (validation && transport) fill_batch(val_rows.data() + static_cast<size_t>(index) * view.rows * (view.contents[0]->cols() + 1), view);
+	else if (!dataset) load_batch(validation ? val_data : data, index, view);
+	else if (validation) fill_batch(dataset->val_rows(index * view.rows), view);
+	else fill_batch(dataset->train_rows(index * view.rows), view);
+}
+
+// Up to limit validation rows, read a whole batch at a time (so a partial last batch is left out),
+// for calibrating or checking a model outside of training. Returns how many rows were read.
+int Network::validation_rows(int limit, Eigen::MatrixXf& features, Eigen::MatrixXf& rows_labels)
+{
+	Expects(limit > 0 && length > 0);
+	int count = std::min((limit + batch_size - 1) / batch_size, val_instances / batch_size);
+	int rows = std::min(limit, count * batch_size);
+	features.resize(rows, layers[0].contents.cols());
+	rows_labels.resize(rows, 1);
+	Workspace workspace (layers, batch_size);
+	BatchView view = workspace.view();
+	for (int b = 0; b < count; b++) {
+		read_batch(true, b, view);
+		int taken = std::min(batch_size, rows - b * batch_size);
+		features.middleRows(b * batch_size, taken) = workspace.contents[0].topRows(taken);
+		rows_labels.middleRows(b * batch_size, taken) = workspace.labels.topRows(taken);
+	}
+	return rows;
+}
+
+// Copies view.rows binary records (features, then the label) into the input layer and labels.
+void Network::fill_batch(const float* rows, const BatchView& view)
+{
+	const int width = view.contents[0]->cols() + 1;
+	for (int i = 0; i < view.rows; i++) {
+		for (int j = 0; j < width-1; j++) (*view.contents[0])(view.first+i, j) = rows[i*width + j];
+		(*view.labels)(view.first+i, 0) = rows[i*width + width-1];
+	}
+}
+
 int prep_file(const char* path, const char* out_path)
 {
 	FILE* rptr = fopen(path, "r");
@@ -88,12 +141,12 @@ int prep_file(const char* path, const char* out_path)
 	return count;
 }
 
-int split_file(const char* path, int lines, float ratio)
+int split_file(const char* path, int lines, float ratio, const char* train_path, const char* val_path)
 {
 	FILE* src = fopen(path, "r");
 	if (!src) throw std::runtime_error{"split_file() could not open file to split."};
-	FILE* test = fopen(VAL_PATH, "w");
-	FILE* train = fopen(TRAIN_PATH, "w");
+	FILE* test = fopen(val_path, "w");
+	FILE* train = fopen(train_path, "w");
 	int switch_line = round(ratio * lines);
 	char line[MAXLINE];
 	int tests = 0;
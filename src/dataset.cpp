@@ -0,0 +1,88 @@
+//
+//  dataset.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <cstdlib>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bpnn.hpp"
+#include "dataset.hpp"
+
+namespace Jacobian {
+Dataset::Dataset(const char* path, float ratio)
+{
+	Expects(ratio >= 0 && ratio <= 1);
+	char dir[] = "./jacobian-XXXXXX";
+	if (!mkdtemp(dir)) throw std::runtime_error{"Dataset could not create its scratch directory."};
+	const std::string base = dir;
+	const std::string shuffled = base + "/shuffled.txt";
+	const std::string train_txt = base + "/train.txt";
+	const std::string val_txt = base + "/test.txt";
+	const std::string train_bin = base + "/train.bin";
+	const std::string val_bin = base + "/test.bin";
+	try {
+		int total_instances = prep_file(path, shuffled.c_str());
+		val_instances = split_file(shuffled.c_str(), total_instances, ratio, train_txt.c_str(), val_txt.c_str());
+		train_instances = total_instances - val_instances;
+		prep(train_txt.c_str(), train_bin.c_str());
+		prep(val_txt.c_str(), val_bin.c_str());
+		train = map(train_bin, train_bytes);
+		val = map(val_bin, val_bytes);
+	}
+	catch (...) {
+		for (const std::string& file : {shuffled, train_txt, val_txt, train_bin, val_bin}) unlink(file.c_str());
+		rmdir(dir);
+		throw;
+	}
+	// The mappings outlive the files, so nothing is left on disk.
+	for (const std::string& file : {shuffled, train_txt, val_txt, train_bin, val_bin}) unlink(file.c_str());
+	rmdir(dir);
+	Ensures(train_bytes >= static_cast<size_t>(train_instances) * width * sizeof(float));
+}
+
+Dataset::Dataset(const float* train_rows, int train_count, const float* val_rows, int val_count, int row_width)
+	:train(train_rows), val(val_rows), borrowed(true), width(row_width), train_instances(train_count), val_instances(val_count)
+{
+	Expects(train_rows && val_rows && train_count > 0 && val_count > 0 && row_width > 1);
+}
+
+Dataset::~Dataset()
+{
+	if (borrowed) return;
+	if (train) munmap(const_cast<float*>(train), train_bytes);
+	if (val) munmap(const_cast<float*>(val), val_bytes);
+}
+
+const float* Dataset::map(const std::string& path, size_t& bytes)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) throw std::runtime_error{"Dataset could not open a converted file."};
+	struct stat info;
+	fstat(fd, &info);
+	bytes = info.st_size;
+	if (bytes == 0) {
+		close(fd);
+		return nullptr;
+	}
+	void* mapped = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) throw std::runtime_error{"Dataset could not map a converted file."};
+	return static_cast<const float*>(mapped);
+}
+
+const float* Dataset::train_rows(int first) const
+{
+	Expects(first >= 0 && first < train_instances);
+	return train + static_cast<size_t>(first) * width;
+}
+
+const float* Dataset::val_rows(int first) const
+{
+	Expects(first >= 0 && first < val_instances);
+	return val + static_cast<size_t>(first) * width;
+}
+}
@@ -0,0 +1,42 @@
+//
+//  dataset.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <string>
+#include <cstddef>
+
+namespace Jacobian {
+// A shuffled, split and binary-converted copy of a data file, memory-mapped read-only so any number
+// of networks (and threads) can train on it at once. Conversion goes through a private scratch
+// directory that is removed again before the constructor returns, so instances never collide on
+// the fixed paths a path-constructed Network uses. It can also wrap rows that are already in memory.
+class Dataset {
+	const float* train = nullptr;
+	const float* val = nullptr;
+	size_t train_bytes = 0;
+	size_t val_bytes = 0;
+	bool borrowed = false; // The rows belong to the caller rather than to a mapping of ours.
+	static const float* map(const std::string& path, size_t& bytes);
+public:
+	const int width = 5; // Floats per row, features then the label, as prep() writes them.
+	int train_instances;
+	int val_instances;
+
+	Dataset(const char* path, float ratio);
+	// Uses the caller's rows in place - row_width floats each, features then the label - without
+	// copying or shuffling them. They must stay alive and unchanged for as long as the dataset does.
+	Dataset(const float* train_rows, int train_count, const float* val_rows, int val_count, int row_width);
+	~Dataset();
+	Dataset(const Dataset&) = delete;
+	Dataset& operator=(const Dataset&) = delete;
+	const float* train_rows(int first) const;
+	const float* val_rows(int first) const;
+};
+}
+#endif /* DATASET_H */
@@ -0,0 +1,227 @@
+//
+//  distributed.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <cerrno>
+
+#include "bpnn.hpp"
+#include "distributed.hpp"
+
+namespace Jacobian {
+#define CONNECT_TIMEOUT 30 // Seconds to keep retrying the next rank while it starts up.
+
+inline addrinfo* resolve(const std::string& peer, bool passive)
+{
+	size_t colon = peer.rfind(':');
+	if (colon == std::string::npos) throw std::runtime_error{"TcpTransport peers must be host:port."};
+	addrinfo hints {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (passive) hints.ai_flags = AI_PASSIVE;
+	addrinfo* found;
+	if (getaddrinfo(passive ? nullptr : peer.substr(0, colon).c_str(), peer.substr(colon+1).c_str(), &hints, &found) != 0)
+		throw std::runtime_error{"TcpTransport could not resolve a peer address."};
+	return found;
+}
+
+TcpTransport::TcpTransport(int rank, const std::vector<std::string>& peers)
+	:self(rank), size(peers.size())
+{
+	Expects(rank >= 0 && rank < size);
+	if (size == 1) return;
+	// The destructor won't run if this throws, so whatever was opened is closed here.
+	try {
+		connect_ring(peers);
+	}
+	catch (...) {
+		close_all();
+		throw;
+	}
+}
+
+void TcpTransport::connect_ring(const std::vector<std::string>& peers)
+{
+	int on = 1;
+	addrinfo* local = resolve(peers[self], true);
+	listener = socket(local->ai_family, local->ai_socktype, local->ai_protocol);
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	bool bound = listener >= 0 && bind(listener, local->ai_addr, local->ai_addrlen) == 0 && listen(listener, 1) == 0;
+	freeaddrinfo(local);
+	if (!bound) throw std::runtime_error{"TcpTransport could not listen on its port."};
+	// The next rank may not be listening yet, so keep trying for a while.
+	addrinfo* remote = resolve(peers[(self+1) % size], false);
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(CONNECT_TIMEOUT);
+	while (next < 0) {
+		next = socket(remote->ai_family, remote->ai_socktype, remote->ai_protocol);
+		if (next >= 0 && connect(next, remote->ai_addr, remote->ai_addrlen) == 0) break;
+		if (next >= 0) close(next);
+		next = -1;
+		if (std::chrono::steady_clock::now() > deadline) {
+			freeaddrinfo(remote);
+			throw std::runtime_error{"TcpTransport could not connect to the next rank."};
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	freeaddrinfo(remote);
+	prev = accept(listener, nullptr, nullptr);
+	if (prev < 0) throw std::runtime_error{"TcpTransport could not accept the previous rank."};
+	for (int fd : {next, prev}) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+}
+
+TcpTransport::~TcpTransport()
+{
+	close_all();
+}
+
+void TcpTransport::close_all()
+{
+	for (int* fd : {&next, &prev, &listener}) {
+		if (*fd >= 0) close(*fd);
+		*fd = -1;
+	}
+}
+
+void TcpTransport::exchange(const float* out, size_t out_count, float* in, size_t in_count)
+{
+	const char* send_at = reinterpret_cast<const char*>(out);
+	char* recv_at = reinterpret_cast<char*>(in);
+	size_t to_send = out_count * sizeof(float);
+	size_t to_recv = in_count * sizeof(float);
+	while (to_send > 0 || to_recv > 0) {
+		pollfd fds[2] = {{next, static_cast<short>(to_send > 0 ? POLLOUT : 0), 0},
+						 {prev, static_cast<short>(to_recv > 0 ? POLLIN : 0), 0}};
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			throw std::runtime_error{"TcpTransport::exchange() could not poll its connections."};
+		}
+		if (fds[0].revents & (POLLERR | POLLHUP))
+			throw std::runtime_error{"TcpTransport::exchange() lost the next rank."};
+		if (to_send > 0 && (fds[0].revents & POLLOUT)) {
+			ssize_t sent = send(next, send_at, to_send, MSG_NOSIGNAL);
+			if (sent < 0 && errno != EAGAIN && errno != EINTR)
+				throw std::runtime_error{"TcpTransport::exchange() could not send to the next rank."};
+			if (sent > 0) send_at += sent, to_send -= sent;
+		}
+		if (to_recv > 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+			ssize_t got = recv(prev, recv_at, to_recv, 0);
+			if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR))
+				throw std::runtime_error{"TcpTransport::exchange() lost the previous rank."};
+			if (got > 0) recv_at += got, to_recv -= got;
+		}
+	}
+}
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory cursors must be lock-free");
+
+ShmTransport::ShmTransport(const std::string& segment_name, int rank, int world, size_t slots_per_rank)
+	:name(segment_name), self(rank), size(world), capacity(slots_per_rank)
+{
+	Expects(rank >= 0 && rank < world && capacity > 0);
+	segment_bytes = size * (sizeof(Mailbox) + capacity * sizeof(float));
+	int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+	if (fd < 0) throw std::runtime_error{"ShmTransport could not open the shared memory segment."};
+	// Every rank sizes the segment the same way; a fresh one comes back zeroed, i.e. every mailbox empty.
+	if (ftruncate(fd, segment_bytes) != 0) {
+		close(fd);
+		throw std::runtime_error{"ShmTransport could not size the shared memory segment."};
+	}
+	segment = mmap(nullptr, segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment == MAP_FAILED) throw std::runtime_error{"ShmTransport could not map the shared memory segment."};
+}
+
+ShmTransport::~ShmTransport()
+{
+	munmap(segment, segment_bytes);
+	if (self == 0) shm_unlink(name.c_str());
+}
+
+ShmTransport::Mailbox* ShmTransport::mailbox(int r) const
+{
+	return reinterpret_cast<Mailbox*>(static_cast<char*>(segment) + r * (sizeof(Mailbox) + capacity * sizeof(float)));
+}
+
+float* ShmTransport::slots(int r) const
+{
+	return reinterpret_cast<float*>(mailbox(r) + 1);
+}
+
+// Copies into the next rank's mailbox as space frees up and out of our own as data arrives. The
+// cursors only ever grow; the writer publishes with a release store after copying and the reader
+// hands space back the same way.
+void ShmTransport::exchange(const float* out, size_t out_count, float* in, size_t in_count)
+{
+	Mailbox& outbox = *mailbox((self+1) % size);
+	Mailbox& inbox = *mailbox(self);
+	float* out_slots = slots((self+1) % size);
+	const float* in_slots = slots(self);
+	size_t sent = 0;
+	size_t received = 0;
+	while (sent < out_count || received < in_count) {
+		bool progress = false;
+		if (sent < out_count) {
+			uint64_t written = outbox.written.value.load(std::memory_order_relaxed);
+			size_t room = capacity - (written - outbox.read.value.load(std::memory_order_acquire));
+			size_t n = std::min({room, out_count - sent, capacity - written % capacity});
+			if (n > 0) {
+				std::memcpy(out_slots + written % capacity, out + sent, n * sizeof(float));
+				outbox.written.value.store(written + n, std::memory_order_release);
+				sent += n;
+				progress = true;
+			}
+		}
+		if (received < in_count) {
+			uint64_t read = inbox.read.value.load(std::memory_order_relaxed);
+			size_t ready = inbox.written.value.load(std::memory_order_acquire) - read;
+			size_t n = std::min({ready, in_count - received, capacity - read % capacity});
+			if (n > 0) {
+				std::memcpy(in + received, in_slots + read % capacity, n * sizeof(float));
+				inbox.read.value.store(read + n, std::memory_order_release);
+				received += n;
+				progress = true;
+			}
+		}
+		if (!progress) std::this_thread::yield();
+	}
+}
+
+void all_reduce(Transport& transport, float* data, size_t count)
+{
+	const int world = transport.world();
+	const int rank = transport.rank();
+	if (world == 1 || count == 0) return;
+	auto begin = [count, world](int chunk) {return count * chunk / world;};
+	auto length = [&begin](int chunk) {return begin(chunk+1) - begin(chunk);};
+	std::vector<float> incoming (count / world + 1);
+	// After round s of the reduce-scatter, chunk r-s-1 on rank r holds the sum over s+2 ranks, so
+	// rank r ends up owning the finished chunk r+1.
+	for (int s = 0; s < world-1; s++) {
+		int send = (rank - s + world) % world;
+		int recv = (rank - s - 1 + world) % world;
+		transport.exchange(data + begin(send), length(send), incoming.data(), length(recv));
+		for (size_t j = 0; j < length(recv); j++) data[begin(recv) + j] += incoming[j];
+	}
+	for (int s = 0; s < world-1; s++) {
+		int send = (rank + 1 - s + world) % world;
+		int recv = (rank - s + world) % world;
+		transport.exchange(data + begin(send), length(send), data + begin(recv), length(recv));
+	}
+}
+}
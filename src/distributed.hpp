@@ -0,0 +1,80 @@
+//
+//  distributed.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace Jacobian {
+// A ring of processes. Rank r only ever talks to its neighbours: it sends to rank r+1 and
+// receives from rank r-1 (both mod world), which is all a ring all-reduce needs.
+class Transport {
+public:
+	virtual ~Transport() = default;
+	virtual int rank() const = 0;
+	virtual int world() const = 0;
+	// Sends out_count floats to the next rank while receiving in_count from the previous one. Both
+	// directions make progress together, so every rank can call this at once without deadlocking.
+	virtual void exchange(const float* out, size_t out_count, float* in, size_t in_count) = 0;
+};
+
+// One TCP connection to each neighbour. peers holds "host:port" for every rank, in rank order;
+// this rank listens on its own entry's port and connects to the next one's.
+class TcpTransport : public Transport {
+	int self;
+	int size;
+	int listener = -1;
+	int next = -1;
+	int prev = -1;
+	void connect_ring(const std::vector<std::string>& peers);
+	void close_all();
+public:
+	TcpTransport(int rank, const std::vector<std::string>& peers);
+	~TcpTransport();
+	int rank() const override {return self;}
+	int world() const override {return size;}
+	void exchange(const float* out, size_t out_count, float* in, size_t in_count) override;
+};
+
+// Processes on the same host share a POSIX shared memory segment holding one single-producer,
+// single-consumer ring buffer per rank, fed by the previous rank. Every rank opens the segment by
+// name; rank 0 unlinks it when it is done, and a segment left behind by a crashed job has to be
+// removed (from /dev/shm) before the name is reused.
+class ShmTransport : public Transport {
+	struct alignas(64) Cursor {
+		std::atomic<uint64_t> value {0};
+	};
+	struct Mailbox {
+		Cursor written;
+		Cursor read;
+	};
+	std::string name;
+	int self;
+	int size;
+	size_t capacity; // Floats per mailbox.
+	void* segment = nullptr;
+	size_t segment_bytes;
+	Mailbox* mailbox(int r) const;
+	float* slots(int r) const;
+public:
+	ShmTransport(const std::string& name, int rank, int world, size_t capacity = 1 << 16);
+	~ShmTransport();
+	int rank() const override {return self;}
+	int world() const override {return size;}
+	void exchange(const float* out, size_t out_count, float* in, size_t in_count) override;
+};
+
+// Sums data elementwise across every rank, leaving the same result on each. Ring algorithm: a
+// reduce-scatter and then an all-gather, each world-1 rounds of passing one chunk on.
+void all_reduce(Transport& transport, float* data, size_t count);
+}
+#endif /* DISTRIBUTED_H */
@@ -0,0 +1,384 @@
+//
+//  expression.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <cctype>
+#include <stdexcept>
+
+#include "expression.hpp"
+
+namespace Jacobian {
+// Recursive descent, loosest binding first: comparisons, sums, products, unary minus, then powers
+// (right associative, so 2^-x and x^2^2 work).
+struct Expression::Parser {
+	Expression& expression;
+	const std::string& source;
+	size_t pos = 0;
+
+	[[noreturn]] void fail(const std::string& what)
+	{
+		throw std::runtime_error{"Couldn't parse activation \"" + source + "\": " + what + " at position " + std::to_string(pos) + "."};
+	}
+	void skip()
+	{
+		while (pos < source.size() && std::isspace(static_cast<unsigned char>(source[pos]))) pos++;
+	}
+	bool accept(char c)
+	{
+		skip();
+		if (pos == source.size() || source[pos] != c) return false;
+		pos++;
+		return true;
+	}
+	void expect(char c)
+	{
+		if (!accept(c)) fail(std::string("expected '") + c + "'");
+	}
+	int comparison()
+	{
+		int left = sum();
+		if (accept('>')) return expression.make(Op::greater, left, sum());
+		if (accept('<')) return expression.make(Op::less, left, sum());
+		return left;
+	}
+	int sum()
+	{
+		int left = product();
+		while (true) {
+			if (accept('+')) left = expression.make(Op::add, left, product());
+			else if (accept('-')) left = expression.make(Op::sub, left, product());
+			else return left;
+		}
+	}
+	int product()
+	{
+		int left = unary();
+		while (true) {
+			if (accept('*')) left = expression.make(Op::mul, left, unary());
+			else if (accept('/')) left = expression.make(Op::div, left, unary());
+			else return left;
+		}
+	}
+	int unary()
+	{
+		if (accept('-')) return expression.make(Op::neg, unary());
+		if (accept('+')) return unary();
+		int base = atom();
+		if (accept('^')) return expression.make(Op::pow, base, unary());
+		return base;
+	}
+	int atom()
+	{
+		if (accept('(')) {
+			int inner = comparison();
+			expect(')');
+			return inner;
+		}
+		skip();
+		if (pos == source.size()) fail("unexpected end");
+		const char c = source[pos];
+		if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+			size_t used = 0;
+			float value = 0;
+			try {
+				value = std::stof(source.substr(pos), &used);
+			}
+			catch (const std::exception&) {
+				fail("bad number");
+			}
+			pos += used;
+			return expression.make(Op::constant, -1, -1, value);
+		}
+		if (!std::isalpha(static_cast<unsigned char>(c))) fail(std::string("unexpected '") + c + "'");
+		size_t start = pos;
+		while (pos < source.size() && std::isalnum(static_cast<unsigned char>(source[pos]))) pos++;
+		const std::string name = source.substr(start, pos - start);
+		if (name == "x") return expression.make(Op::variable);
+		static const std::pair<const char*, Op> unary_functions[] {
+			{"exp", Op::exp}, {"log", Op::log}, {"sqrt", Op::sqrt}, {"tanh", Op::tanh}, {"abs", Op::abs}
+		};
+		static const std::pair<const char*, Op> binary_functions[] {{"max", Op::max}, {"min", Op::min}};
+		for (const auto& function : unary_functions) {
+			if (name != function.first) continue;
+			expect('(');
+			int argument = comparison();
+			expect(')');
+			return expression.make(function.second, argument);
+		}
+		for (const auto& function : binary_functions) {
+			if (name != function.first) continue;
+			expect('(');
+			int first = comparison();
+			expect(',');
+			int second = comparison();
+			expect(')');
+			return expression.make(function.second, first, second);
+		}
+		pos = start;
+		fail("unknown name \"" + name + "\"");
+	}
+};
+
+Expression::Expression(const std::string& source)
+	:text(source)
+{
+	Parser parser {*this, source};
+	int root = parser.comparison();
+	parser.skip();
+	if (parser.pos != source.size()) parser.fail(std::string("unexpected '") + source[parser.pos] + "'");
+	compact(root);
+}
+
+float Expression::fold(Op op, float a, float b)
+{
+	switch (op) {
+	case Op::add: return a + b;
+	case Op::sub: return a - b;
+	case Op::mul: return a * b;
+	case Op::div: return a / b;
+	case Op::pow: return std::pow(a, b);
+	case Op::neg: return -a;
+	case Op::exp: return std::exp(a);
+	case Op::log: return std::log(a);
+	case Op::sqrt: return std::sqrt(a);
+	case Op::tanh: return std::tanh(a);
+	case Op::abs: return std::abs(a);
+	case Op::max: return std::max(a, b);
+	case Op::min: return std::min(a, b);
+	case Op::greater: return a > b;
+	case Op::less: return a < b;
+	default: return 0;
+	}
+}
+
+// Folds constant operands and drops the identities differentiation keeps producing (x*1, x+0, ...),
+// so derivatives stay about as small as a hand-written one.
+int Expression::make(Op op, int left, int right, float value)
+{
+	auto constant = [this](int node) {return node >= 0 && nodes[node].op == Op::constant;};
+	auto is = [this, &constant](int node, float v) {return constant(node) && nodes[node].value == v;};
+	if (op != Op::constant && op != Op::variable && constant(left) && (right < 0 || constant(right)))
+		return make(Op::constant, -1, -1, fold(op, nodes[left].value, right < 0 ? 0 : nodes[right].value));
+	switch (op) {
+	case Op::add:
+		if (is(left, 0)) return right;
+		if (is(right, 0)) return left;
+		break;
+	case Op::sub:
+		if (is(right, 0)) return left;
+		if (is(left, 0)) return make(Op::neg, right);
+		break;
+	case Op::mul:
+		if (is(left, 0) || is(right, 0)) return make(Op::constant, -1, -1, 0);
+		if (is(left, 1)) return right;
+		if (is(right, 1)) return left;
+		break;
+	case Op::div:
+		if (is(right, 1)) return left;
+		if (is(left, 0)) return make(Op::constant, -1, -1, 0);
+		break;
+	case Op::pow:
+		if (is(right, 1)) return left;
+		if (is(right, 0)) return make(Op::constant, -1, -1, 1);
+		break;
+	default:
+		break;
+	}
+	nodes.push_back({op, left, right, value});
+	return nodes.size() - 1;
+}
+
+// Keeps only the nodes the result depends on, in their original (topological) order, and makes the
+// result the last one.
+void Expression::compact(int root)
+{
+	std::vector<bool> reachable (root + 1, false);
+	reachable[root] = true;
+	for (int i = root; i >= 0; i--) {
+		if (!reachable[i]) continue;
+		if (nodes[i].left >= 0) reachable[nodes[i].left] = true;
+		if (nodes[i].right >= 0) reachable[nodes[i].right] = true;
+	}
+	std::vector<int> index (root + 1, -1);
+	std::vector<Node> kept;
+	for (int i = 0; i <= root; i++) {
+		if (!reachable[i]) continue;
+		Node node = nodes[i];
+		if (node.left >= 0) node.left = index[node.left];
+		if (node.right >= 0) node.right = index[node.right];
+		index[i] = kept.size();
+		kept.push_back(node);
+	}
+	nodes = std::move(kept);
+}
+
+// Memoized in derivatives, indexed by the original nodes, since subexpressions are shared.
+int Expression::differentiate(int node, std::vector<int>& derivatives)
+{
+	if (derivatives[node] >= 0) return derivatives[node];
+	const Node n = nodes[node]; // make() may reallocate nodes.
+	auto d = [this, &derivatives](int child) {return differentiate(child, derivatives);};
+	auto c = [this](float value) {return make(Op::constant, -1, -1, value);};
+	int result = 0;
+	switch (n.op) {
+	case Op::constant:
+	case Op::greater:
+	case Op::less:
+		result = c(0);
+		break;
+	case Op::variable:
+		result = c(1);
+		break;
+	case Op::add:
+		result = make(Op::add, d(n.left), d(n.right));
+		break;
+	case Op::sub:
+		result = make(Op::sub, d(n.left), d(n.right));
+		break;
+	case Op::mul:
+		result = make(Op::add, make(Op::mul, d(n.left), n.right), make(Op::mul, n.left, d(n.right)));
+		break;
+	case Op::div:
+		result = make(Op::div, make(Op::sub, make(Op::mul, d(n.left), n.right), make(Op::mul, n.left, d(n.right))),
+					  make(Op::mul, n.right, n.right));
+		break;
+	case Op::pow:
+		if (nodes[n.right].op == Op::constant) {
+			const float exponent = nodes[n.right].value;
+			result = make(Op::mul, make(Op::mul, c(exponent), make(Op::pow, n.left, c(exponent - 1))), d(n.left));
+		}
+		else {
+			result = make(Op::mul, node, make(Op::add, make(Op::mul, d(n.right), make(Op::log, n.left)),
+											  make(Op::div, make(Op::mul, n.right, d(n.left)), n.left)));
+		}
+		break;
+	case Op::neg:
+		result = make(Op::neg, d(n.left));
+		break;
+	case Op::exp:
+		result = make(Op::mul, node, d(n.left));
+		break;
+	case Op::log:
+		result = make(Op::div, d(n.left), n.left);
+		break;
+	case Op::sqrt:
+		result = make(Op::div, d(n.left), make(Op::mul, c(2), node));
+		break;
+	case Op::tanh:
+		result = make(Op::mul, make(Op::sub, c(1), make(Op::mul, node, node)), d(n.left));
+		break;
+	case Op::abs:
+		result = make(Op::mul, make(Op::sub, make(Op::greater, n.left, c(0)), make(Op::less, n.left, c(0))), d(n.left));
+		break;
+	case Op::max:
+	case Op::min: {
+		int first = make(n.op == Op::max ? Op::greater : Op::less, n.left, n.right);
+		result = make(Op::add, make(Op::mul, first, d(n.left)), make(Op::mul, make(Op::sub, c(1), first), d(n.right)));
+		break;
+	}
+	}
+	derivatives[node] = result;
+	return result;
+}
+
+Expression Expression::derivative() const
+{
+	Expression result = *this;
+	std::vector<int> derivatives (nodes.size(), -1);
+	result.compact(result.differentiate(nodes.size() - 1, derivatives));
+	result.text = result.print(result.nodes.size() - 1);
+	return result;
+}
+
+std::string Expression::print(int node) const
+{
+	const Node& n = nodes[node];
+	static const char* names[] {"", "x", " + ", " - ", " * ", " / ", "^", "-", "exp", "log", "sqrt", "tanh", "abs",
+								"max", "min", " > ", " < "};
+	const char* name = names[static_cast<int>(n.op)];
+	switch (n.op) {
+	case Op::constant: {
+		char number[32];
+		snprintf(number, sizeof(number), "%g", n.value);
+		return number;
+	}
+	case Op::variable:
+		return name;
+	case Op::neg:
+		return "(-" + print(n.left) + ")";
+	case Op::exp:
+	case Op::log:
+	case Op::sqrt:
+	case Op::tanh:
+	case Op::abs:
+		return std::string(name) + "(" + print(n.left) + ")";
+	case Op::max:
+	case Op::min:
+		return std::string(name) + "(" + print(n.left) + ", " + print(n.right) + ")";
+	default:
+		return "(" + print(n.left) + name + print(n.right) + ")";
+	}
+}
+
+// scratch holds EXPRESSION_CHUNK values per node. input and output may be the same.
+void Expression::evaluate(const float* input, float* output, int count, float* scratch) const
+{
+	typedef Eigen::Map<Eigen::ArrayXf> Values;
+	for (int first = 0; first < count; first += EXPRESSION_CHUNK) {
+		const int n = std::min(EXPRESSION_CHUNK, count - first);
+		for (size_t i = 0; i < nodes.size(); i++) {
+			const Node& node = nodes[i];
+			Values result (scratch + i * EXPRESSION_CHUNK, n);
+			Values a (scratch + std::max(node.left, 0) * EXPRESSION_CHUNK, n);
+			Values b (scratch + std::max(node.right, 0) * EXPRESSION_CHUNK, n);
+			switch (node.op) {
+			case Op::constant: result.setConstant(node.value); break;
+			case Op::variable: result = Eigen::Map<const Eigen::ArrayXf>(input + first, n); break;
+			case Op::add: result = a + b; break;
+			case Op::sub: result = a - b; break;
+			case Op::mul: result = a * b; break;
+			case Op::div: result = a / b; break;
+			case Op::pow:
+				if (nodes[node.right].op != Op::constant) result = a.binaryExpr(b, [](float x, float y) {return std::pow(x, y);});
+				else if (nodes[node.right].value == 2) result = a.square();
+				else if (nodes[node.right].value == 3) result = a.cube();
+				else result = a.pow(nodes[node.right].value);
+				break;
+			case Op::neg: result = -a; break;
+			case Op::exp: result = a.exp(); break;
+			case Op::log: result = a.log(); break;
+			case Op::sqrt: result = a.sqrt(); break;
+			case Op::tanh: result = a.tanh(); break;
+			case Op::abs: result = a.abs(); break;
+			case Op::max: result = a.max(b); break;
+			case Op::min: result = a.min(b); break;
+			case Op::greater: result = (a > b).cast<float>(); break;
+			case Op::less: result = (a < b).cast<float>(); break;
+			}
+		}
+		std::copy(scratch + (nodes.size() - 1) * EXPRESSION_CHUNK, scratch + (nodes.size() - 1) * EXPRESSION_CHUNK + n, output + first);
+	}
+}
+
+void Expression::apply(Eigen::Ref<Eigen::MatrixXf> values) const
+{
+	thread_local std::vector<float> scratch;
+	if (scratch.size() < nodes.size() * EXPRESSION_CHUNK) scratch.resize(nodes.size() * EXPRESSION_CHUNK);
+	if (values.outerStride() == values.rows()) {
+		evaluate(values.data(), values.data(), values.size(), scratch.data());
+		return;
+	}
+	for (int k = 0; k < values.cols(); k++) evaluate(values.col(k).data(), values.col(k).data(), values.rows(), scratch.data());
+}
+
+float Expression::operator()(float x) const
+{
+	thread_local std::vector<float> scratch;
+	if (scratch.size() < nodes.size() * EXPRESSION_CHUNK) scratch.resize(nodes.size() * EXPRESSION_CHUNK);
+	evaluate(&x, &x, 1, scratch.data());
+	return x;
+}
+}
@@ -0,0 +1,49 @@
+//
+//  expression.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef EXPRESSION_H
+#define EXPRESSION_H
+
+#include <string>
+#include <vector>
+#include <Eigen/Dense>
+
+namespace Jacobian {
+#define EXPRESSION_CHUNK 256 // Values evaluated per pass through the program, so its temporaries stay in L1.
+
+// An activation written as a formula in x, such as "max(x, 0.01*x)" or "x / (1 + abs(x))", compiled
+// into a small program whose every step runs over a whole chunk of values at once with Eigen's
+// vectorised array operations. Supports + - * / ^, unary minus, > and < (1 or 0), parentheses, and
+// exp, log, sqrt, tanh, abs, max and min. derivative() differentiates it symbolically, so a custom
+// activation needn't come with a hand-written derivative. Constant subexpressions are folded.
+class Expression {
+	enum class Op {constant, variable, add, sub, mul, div, pow, neg, exp, log, sqrt, tanh, abs, max, min, greater, less};
+	struct Node {
+		Op op;
+		int left; // Operand node indices, always lower than the node's own, or -1.
+		int right;
+		float value; // For constants.
+	};
+	struct Parser;
+	std::vector<Node> nodes; // In evaluation order; the last one is the result.
+	std::string text;
+	static float fold(Op op, float a, float b);
+	int make(Op op, int left=-1, int right=-1, float value=0);
+	int differentiate(int node, std::vector<int>& derivatives);
+	void compact(int root);
+	void evaluate(const float* input, float* output, int count, float* scratch) const;
+	std::string print(int node) const;
+public:
+	Expression(const std::string& source);
+	Expression derivative() const;
+	// Replaces every value in place - with any outer stride, so a block of a layer works too.
+	void apply(Eigen::Ref<Eigen::MatrixXf> values) const;
+	float operator()(float x) const;
+	const std::string& source() const {return text;}
+};
+}
+#endif /* EXPRESSION_H */
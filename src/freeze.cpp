@@ -0,0 +1,261 @@
+//
+//  freeze.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <algorithm>
+#include <cctype>
+
+#include "utils.hpp"
+#include "freeze.hpp"
+
+namespace Jacobian {
+// The built-in activations' bodies and their helpers as C++ source, for emit_header().
+#define ACTIVATION_SOURCE(name, expression) {#name, "return " #expression ";"},
+static const std::vector<std::pair<std::string, std::string>> activation_sources {
+	ACTIVATION_SOURCES(ACTIVATION_SOURCE)
+};
+#undef ACTIVATION_SOURCE
+
+#define HELPER_SOURCE(type, name, parameter, body) "inline " #type " " #name "(" #parameter ") {" #body "}\n"
+static const char* helper_sources = ACTIVATION_HELPERS(HELPER_SOURCE) "\n";
+#undef HELPER_SOURCE
+
+FrozenNetwork::Activation FrozenNetwork::resolve(const std::function<float(float)>& activation)
+{
+	std::string name = activations::name_of(activation);
+	if (name.empty()) return {Kind::custom, name, nullptr, activation};
+	float (*function)(float) = activations::find(name)->activation;
+	if (name == "linear") return {Kind::linear, name, function, nullptr};
+	if (name == "relu") return {Kind::relu, name, function, nullptr};
+	if (name == "leaky_relu") return {Kind::leaky_relu, name, function, nullptr};
+	if (name == "hard_tanh") return {Kind::hard_tanh, name, function, nullptr};
+	return {Kind::pointer, name, function, nullptr};
+}
+
+// The simple activations get loops the compiler can vectorise; the rest at least skip std::function.
+void FrozenNetwork::activate(const Activation& activation, float* values, int count)
+{
+	switch (activation.kind) {
+	case Kind::linear:
+		return;
+	case Kind::relu:
+		for (int c = 0; c < count; c++) values[c] = values[c] > 0 ? values[c] : 0;
+		return;
+	case Kind::leaky_relu:
+		for (int c = 0; c < count; c++) values[c] = values[c] > 0 ? values[c] : 0.01f * values[c];
+		return;
+	case Kind::hard_tanh:
+		for (int c = 0; c < count; c++) values[c] = std::min(1.0f, std::max(-1.0f, values[c]));
+		return;
+	case Kind::pointer:
+		for (int c = 0; c < count; c++) values[c] = activation.function(values[c]);
+		return;
+	case Kind::custom:
+		for (int c = 0; c < count; c++) values[c] = activation.custom(values[c]);
+		return;
+	}
+}
+
+FrozenNetwork::FrozenNetwork(const Network& net)
+{
+	Expects(net.length > 1);
+	input_activation = resolve(net.layers[0].activation);
+	size_t size = 0;
+	for (int i = 0; i < net.length-1; i++) {
+		const Eigen::MatrixXf& w = net.layers[i].weights;
+		FrozenLayer frozen {static_cast<int>(w.rows()), static_cast<int>(w.cols()),
+							static_cast<int>((w.cols() + FROZEN_PANEL - 1) / FROZEN_PANEL), 0, 0,
+							resolve(net.layers[i+1].activation)};
+		frozen.weights = size;
+		size += static_cast<size_t>(frozen.panels) * frozen.inputs * FROZEN_PANEL;
+		frozen.bias = size;
+		size += frozen.panels * FROZEN_PANEL;
+		layers.push_back(frozen);
+	}
+	blob.assign(size, 0);
+	for (int i = 0; i < net.length-1; i++) {
+		const FrozenLayer& frozen = layers[i];
+		const Eigen::MatrixXf& w = net.layers[i].weights;
+		for (int j = 0; j < frozen.outputs; j++) {
+			const int p = j / FROZEN_PANEL;
+			for (int k = 0; k < frozen.inputs; k++)
+				blob[frozen.weights + (static_cast<size_t>(p) * frozen.inputs + k) * FROZEN_PANEL + j % FROZEN_PANEL] = w(k, j);
+		}
+		Eigen::RowVectorXf bias = net.layers[i+1].bias.colwise().mean();
+		std::copy(bias.data(), bias.data() + bias.size(), blob.begin() + frozen.bias);
+	}
+}
+
+// acc[b] = row b of in times one panel. Rows is a constant so that the accumulators stay in registers
+// even for the last, partial block of rows, and fewer rows split k between more accumulators so that
+// a single sample isn't stuck waiting on one chain of dependent adds.
+template <int Rows>
+inline void accumulate(const float* in, int in_stride, const float* panel, int inputs, float (&acc)[FROZEN_ROWS][FROZEN_PANEL])
+{
+	constexpr int chains = FROZEN_ROWS / Rows;
+	typedef Eigen::Matrix<float, Rows, FROZEN_PANEL, Eigen::RowMajor> Sums;
+	typedef Eigen::Map<const Eigen::Matrix<float, 1, FROZEN_PANEL>> Weights;
+	Sums sums[chains];
+	for (Sums& chain : sums) chain.setZero();
+	int k = 0;
+	for (; k + chains <= inputs; k += chains)
+		for (int h = 0; h < chains; h++)
+			for (int b = 0; b < Rows; b++) sums[h].row(b) += in[b * in_stride + k + h] * Weights(panel + (k + h) * FROZEN_PANEL);
+	for (; k < inputs; k++)
+		for (int b = 0; b < Rows; b++) sums[0].row(b) += in[b * in_stride + k] * Weights(panel + k * FROZEN_PANEL);
+	for (int h = 1; h < chains; h++) sums[0] += sums[h];
+	for (int b = 0; b < Rows; b++) std::copy(sums[0].row(b).data(), sums[0].row(b).data() + FROZEN_PANEL, acc[b]);
+}
+
+// out gets rows x (panels x FROZEN_PANEL) values, the padding columns included. Only in's first
+// frozen.inputs columns are read, so the previous layer's padding never matters.
+void FrozenNetwork::layer(const FrozenLayer& frozen, const float* in, int in_stride, int rows, float* out) const
+{
+	const int out_stride = frozen.panels * FROZEN_PANEL;
+	const float* bias = blob.data() + frozen.bias;
+	for (int r = 0; r < rows; r += FROZEN_ROWS) {
+		const int block = std::min(FROZEN_ROWS, rows - r);
+		const float* rows_in = in + static_cast<size_t>(r) * in_stride;
+		for (int p = 0; p < frozen.panels; p++) {
+			const float* panel = blob.data() + frozen.weights + static_cast<size_t>(p) * frozen.inputs * FROZEN_PANEL;
+			float acc[FROZEN_ROWS][FROZEN_PANEL];
+			switch (block) {
+			case FROZEN_ROWS: accumulate<FROZEN_ROWS>(rows_in, in_stride, panel, frozen.inputs, acc); break;
+			case 3: accumulate<3>(rows_in, in_stride, panel, frozen.inputs, acc); break;
+			case 2: accumulate<2>(rows_in, in_stride, panel, frozen.inputs, acc); break;
+			default: accumulate<1>(rows_in, in_stride, panel, frozen.inputs, acc); break;
+			}
+			for (int b = 0; b < block; b++) {
+				float* result = out + static_cast<size_t>(r + b) * out_stride + p * FROZEN_PANEL;
+				for (int c = 0; c < FROZEN_PANEL; c++) result[c] = acc[b][c] + bias[p * FROZEN_PANEL + c];
+				activate(frozen.activation, result, FROZEN_PANEL);
+			}
+		}
+	}
+}
+
+// Like a Predictor, the input layer's activation is applied too and the output goes through softmax.
+void FrozenNetwork::predict(const float* input, int rows, float* output)
+{
+	size_t widest = inputs();
+	for (const FrozenLayer& frozen : layers) widest = std::max<size_t>(widest, frozen.panels * FROZEN_PANEL);
+	for (std::vector<float>& buffer : buffers)
+		if (buffer.size() < rows * widest) buffer.resize(rows * widest);
+	const float* in = input;
+	if (input_activation.kind != Kind::linear) {
+		std::copy(input, input + static_cast<size_t>(rows) * inputs(), buffers[1].begin());
+		activate(input_activation, buffers[1].data(), rows * inputs());
+		in = buffers[1].data();
+	}
+	int in_stride = inputs();
+	for (size_t i = 0; i < layers.size(); i++) {
+		float* out = buffers[i % 2].data();
+		layer(layers[i], in, in_stride, rows, out);
+		in = out;
+		in_stride = layers[i].panels * FROZEN_PANEL;
+	}
+	for (int r = 0; r < rows; r++) {
+		const float* last = in + static_cast<size_t>(r) * in_stride;
+		float* result = output + static_cast<size_t>(r) * outputs();
+		float max = *std::max_element(last, last + outputs());
+		float sum = 0;
+		for (int j = 0; j < outputs(); j++) sum += result[j] = std::exp(last[j] - max);
+		for (int j = 0; j < outputs(); j++) result[j] /= sum;
+	}
+}
+
+Eigen::MatrixXf FrozenNetwork::predict(const Eigen::Ref<const Eigen::MatrixXf>& input)
+{
+	return predict_rows(input);
+}
+
+// Rows already laid out back to back (a whole NumPy array, say) are used in place.
+RowMatrixXf FrozenNetwork::predict_rows(const Eigen::Ref<const RowMatrixXf>& input)
+{
+	Expects(input.cols() == inputs());
+	RowMatrixXf packed;
+	const float* rows = input.data();
+	if (input.outerStride() != input.cols()) {
+		packed = input;
+		rows = packed.data();
+	}
+	RowMatrixXf out (input.rows(), outputs());
+	predict(rows, input.rows(), out.data());
+	return out;
+}
+
+// The emitted predict() goes one sample at a time with every size a constant, leaving the compiler
+// free to unroll and vectorise each layer for its exact shape.
+void FrozenNetwork::emit_header(const std::string& path, const std::string& name) const
+{
+	std::vector<const Activation*> used {&input_activation};
+	for (const FrozenLayer& frozen : layers) used.push_back(&frozen.activation);
+	for (const Activation* activation : used)
+		if (activation->kind == Kind::custom) throw std::runtime_error{"emit_header() can only emit built-in activations."};
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file) throw std::runtime_error{"emit_header() could not create its file."};
+	std::string guard = name + "_JACOBIAN_H";
+	std::transform(guard.begin(), guard.end(), guard.begin(), [](unsigned char c) {return std::toupper(c);});
+	size_t widest = inputs();
+	for (const FrozenLayer& frozen : layers) widest = std::max<size_t>(widest, frozen.panels * FROZEN_PANEL);
+	fprintf(file, "//\n//  %s\n//  Generated by Jacobian's FrozenNetwork::emit_header().\n//\n\n", path.substr(path.rfind('/') + 1).c_str());
+	fprintf(file, "#ifndef %s\n#define %s\n\n#include <algorithm>\n#include <cmath>\n#include <cstring>\n\n", guard.c_str(), guard.c_str());
+	fprintf(file, "namespace %s {\nconstexpr int inputs = %i;\nconstexpr int outputs = %i;\nconstexpr int panel = %i;\n\n",
+			name.c_str(), inputs(), outputs(), FROZEN_PANEL);
+	fprintf(file, "%s", helper_sources);
+	std::vector<std::string> emitted;
+	for (const Activation* activation : used) {
+		if (std::find(emitted.begin(), emitted.end(), activation->name) != emitted.end()) continue;
+		emitted.push_back(activation->name);
+		auto source = std::find_if(activation_sources.begin(), activation_sources.end(),
+								   [activation](const std::pair<std::string, std::string>& entry) {return entry.first == activation->name;});
+		Ensures(source != activation_sources.end());
+		fprintf(file, "inline float %s(float x) {%s}\n", activation->name.c_str(), source->second.c_str());
+	}
+	for (size_t i = 0; i < layers.size(); i++) {
+		const FrozenLayer& frozen = layers[i];
+		size_t count = static_cast<size_t>(frozen.panels) * frozen.inputs * FROZEN_PANEL;
+		fprintf(file, "\nalignas(64) static const float weights_%zu[%zu] = {", i, count);
+		for (size_t v = 0; v < count; v++) fprintf(file, "%s%.9ef,", v % 8 == 0 ? "\n\t" : " ", blob[frozen.weights + v]);
+		fprintf(file, "\n};\nalignas(64) static const float bias_%zu[%i] = {", i, frozen.panels * FROZEN_PANEL);
+		for (int v = 0; v < frozen.panels * FROZEN_PANEL; v++) fprintf(file, "%s%.9ef,", v % 8 == 0 ? "\n\t" : " ", blob[frozen.bias + v]);
+		fprintf(file, "\n};\n");
+	}
+	fprintf(file, "\ntemplate <int In, int Panels, float (*Activation)(float)>\n"
+			"inline void layer(const float* in, const float* weights, const float* bias, float* out)\n"
+			"{\n"
+			"\tfor (int p = 0; p < Panels; p++) {\n"
+			"\t\tfloat acc[panel];\n"
+			"\t\tfor (int c = 0; c < panel; c++) acc[c] = bias[p * panel + c];\n"
+			"\t\tfor (int k = 0; k < In; k++)\n"
+			"\t\t\tfor (int c = 0; c < panel; c++) acc[c] += in[k] * weights[(p * In + k) * panel + c];\n"
+			"\t\tfor (int c = 0; c < panel; c++) out[p * panel + c] = Activation(acc[c]);\n"
+			"\t}\n"
+			"}\n\n");
+	fprintf(file, "// input holds rows samples of inputs floats each, one after another; output gets rows x outputs.\n"
+			"inline void predict(const float* input, int rows, float* output)\n"
+			"{\n"
+			"\talignas(64) float a[%zu];\n"
+			"\talignas(64) float b[%zu];\n"
+			"\tfor (int r = 0; r < rows; r++) {\n"
+			"\t\tfor (int k = 0; k < inputs; k++) a[k] = %s(input[r * inputs + k]);\n",
+			widest, widest, input_activation.name.c_str());
+	for (size_t i = 0; i < layers.size(); i++)
+		fprintf(file, "\t\tlayer<%i, %i, %s>(%s, weights_%zu, bias_%zu, %s);\n", layers[i].inputs, layers[i].panels,
+				layers[i].activation.name.c_str(), i % 2 ? "b" : "a", i, i, i % 2 ? "a" : "b");
+	fprintf(file, "\t\tconst float* last = %s;\n"
+			"\t\tfloat* result = output + r * outputs;\n"
+			"\t\tfloat max = *std::max_element(last, last + outputs);\n"
+			"\t\tfloat sum = 0;\n"
+			"\t\tfor (int j = 0; j < outputs; j++) sum += result[j] = std::exp(last[j] - max);\n"
+			"\t\tfor (int j = 0; j < outputs; j++) result[j] /= sum;\n"
+			"\t}\n"
+			"}\n"
+			"}\n"
+			"#endif /* %s */\n", layers.size() % 2 ? "b" : "a", guard.c_str());
+	if (fclose(file) != 0) throw std::runtime_error{"emit_header() could not write its file."};
+}
+}
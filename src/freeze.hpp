@@ -0,0 +1,62 @@
+//
+//  freeze.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef FREEZE_H
+#define FREEZE_H
+
+#include "bpnn.hpp"
+
+namespace Jacobian {
+#define FROZEN_PANEL 16 // Output columns per packed weight panel, and the width of the kernels' accumulators.
+#define FROZEN_ROWS 4 // Rows of input each kernel call works through together (layer() dispatches 1 to 4).
+
+// A trained network compiled for inference: its topology and activations are fixed once and for all.
+// Every layer's weights are repacked into panels of FROZEN_PANEL output columns (each input's slice of
+// a panel contiguous) and, with the biases, laid out in a single aligned blob. Activations are resolved
+// to dedicated kernels where they are simple enough and to plain function pointers otherwise (custom
+// std::function activations still work, but can't be emitted). Each panel's epilogue adds the bias
+// and activates it as soon as its accumulators are done, before the next panel starts. Biases are
+// averaged over rows like a Predictor's, and buffers are reused, so an instance must not be shared
+// between threads.
+class FrozenNetwork {
+	enum class Kind {linear, relu, leaky_relu, hard_tanh, pointer, custom};
+	struct Activation {
+		Kind kind;
+		std::string name; // The registry name, empty for a custom activation.
+		float (*function)(float);
+		std::function<float(float)> custom;
+	};
+	struct FrozenLayer {
+		int inputs;
+		int outputs;
+		int panels;
+		size_t weights; // Offsets into the blob: panels x inputs x FROZEN_PANEL packed weights,
+		size_t bias;    // then panels x FROZEN_PANEL biases.
+		Activation activation; // Of the layer this one leads into.
+	};
+	std::vector<float, Eigen::aligned_allocator<float>> blob;
+	Activation input_activation;
+	std::vector<FrozenLayer> layers;
+	std::vector<float> buffers[2]; // Alternate layers' outputs, a row of whole panels per sample.
+	static Activation resolve(const std::function<float(float)>& activation);
+	static void activate(const Activation& activation, float* values, int count);
+	void layer(const FrozenLayer& frozen, const float* in, int in_stride, int rows, float* out) const;
+public:
+	FrozenNetwork(const Network& net);
+	// input is rows samples of inputs() floats each, row after row; output gets rows x outputs() the same way.
+	void predict(const float* input, int rows, float* output);
+	Eigen::MatrixXf predict(const Eigen::Ref<const Eigen::MatrixXf>& input);
+	RowMatrixXf predict_rows(const Eigen::Ref<const RowMatrixXf>& input);
+	// Writes a self-contained C++ header holding the packed weights and a predict() for them, all in
+	// namespace name, to compile the model straight into another program.
+	void emit_header(const std::string& path, const std::string& name) const;
+	size_t bytes() const {return blob.size() * sizeof(float);}
+	int inputs() const {return layers.front().inputs;}
+	int outputs() const {return layers.back().outputs;}
+};
+}
+#endif /* FREEZE_H */
@@ -0,0 +1,190 @@
+//
+//  memory.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <malloc.h>
+
+#include "memory.hpp"
+
+#ifdef MEMORY_TRACKING
+// glibc lets a program replace malloc as long as it replaces free, calloc and realloc along with it,
+// and the aligned variants too if anything might free what they return. These count and pass each
+// call on to glibc's own. Counting can't allocate, so it's a handful of relaxed atomics.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void* __libc_valloc(size_t size);
+void* __libc_pvalloc(size_t size);
+void __libc_free(void* ptr);
+}
+
+namespace {
+std::atomic<long> allocations {0};
+std::atomic<long> frees {0};
+std::atomic<size_t> allocated {0};
+std::atomic<size_t> live {0};
+std::atomic<size_t> peak {0};
+
+void* counted(void* ptr)
+{
+	if (!ptr) return ptr;
+	size_t bytes = malloc_usable_size(ptr);
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	allocated.fetch_add(bytes, std::memory_order_relaxed);
+	size_t now = live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	size_t highest = peak.load(std::memory_order_relaxed);
+	while (now > highest && !peak.compare_exchange_weak(highest, now, std::memory_order_relaxed));
+	return ptr;
+}
+
+void uncounted(void* ptr)
+{
+	if (!ptr) return;
+	frees.fetch_add(1, std::memory_order_relaxed);
+	live.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+}
+}
+
+extern "C" {
+void* malloc(size_t size) noexcept {return counted(__libc_malloc(size));}
+void* calloc(size_t count, size_t size) noexcept {return counted(__libc_calloc(count, size));}
+void* memalign(size_t alignment, size_t size) noexcept {return counted(__libc_memalign(alignment, size));}
+void* aligned_alloc(size_t alignment, size_t size) noexcept {return counted(__libc_memalign(alignment, size));}
+void* valloc(size_t size) noexcept {return counted(__libc_valloc(size));}
+void* pvalloc(size_t size) noexcept {return counted(__libc_pvalloc(size));}
+
+void free(void* ptr) noexcept
+{
+	uncounted(ptr);
+	__libc_free(ptr);
+}
+
+void* realloc(void* ptr, size_t size) noexcept
+{
+	if (!ptr) return counted(__libc_malloc(size));
+	size_t before = malloc_usable_size(ptr);
+	void* moved = __libc_realloc(ptr, size);
+	if (!moved && size != 0) return moved; // Failed, and ptr is still there.
+	live.fetch_sub(before, std::memory_order_relaxed);
+	frees.fetch_add(1, std::memory_order_relaxed);
+	return counted(moved);
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) noexcept
+{
+	if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+	void* ptr = counted(__libc_memalign(alignment, size));
+	if (!ptr) return ENOMEM;
+	*out = ptr;
+	return 0;
+}
+}
+#endif
+
+namespace Jacobian {
+const char* category_name(Category category)
+{
+	static const char* names[MEMORY_CATEGORIES] = {"activations", "params", "optimizer", "scratch"};
+	return names[static_cast<int>(category)];
+}
+
+size_t LayerMemory::total() const
+{
+	size_t sum = 0;
+	for (size_t part : bytes) sum += part;
+	return sum;
+}
+
+size_t MemoryReport::total() const
+{
+	size_t sum = 0;
+	for (size_t part : totals) sum += part;
+	return sum;
+}
+
+AllocationCount allocation_count()
+{
+	AllocationCount count;
+#ifdef MEMORY_TRACKING
+	count.allocations = allocations.load(std::memory_order_relaxed);
+	count.frees = frees.load(std::memory_order_relaxed);
+	count.allocated = allocated.load(std::memory_order_relaxed);
+	count.live = live.load(std::memory_order_relaxed);
+	count.peak = peak.load(std::memory_order_relaxed);
+	count.tracked = count.allocations > 0; // Nothing at all gets to a malloc that isn't the one in use.
+#endif
+	return count;
+}
+
+void reset_heap_peak()
+{
+#ifdef MEMORY_TRACKING
+	peak.store(live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+#endif
+}
+
+// A "Name:   1234 kB" line of /proc/self/status.
+static size_t status_bytes(const char* name)
+{
+	std::ifstream status ("/proc/self/status");
+	std::string line;
+	const size_t length = strlen(name);
+	while (std::getline(status, line)) {
+		if (line.compare(0, length, name) == 0 && line.size() > length && line[length] == ':')
+			return std::stoull(line.substr(length + 1)) * 1024;
+	}
+	return 0;
+}
+
+size_t resident_bytes()
+{
+	return status_bytes("VmRSS");
+}
+
+size_t peak_resident_bytes()
+{
+	return status_bytes("VmHWM");
+}
+
+bool reset_peak_resident()
+{
+	FILE* refs = fopen("/proc/self/clear_refs", "w");
+	if (!refs) return false;
+	bool written = fputs("5", refs) >= 0;
+	return fclose(refs) == 0 && written;
+}
+
+void MemoryEpoch::start(MemoryReport& into, int epoch)
+{
+	report = &into;
+	report->epoch = epoch;
+	report->peak_reset = reset_peak_resident();
+	reset_heap_peak();
+	started = allocation_count();
+}
+
+void MemoryEpoch::stop(int steps)
+{
+	if (!report) return;
+	AllocationCount now = allocation_count();
+	report->steps = steps;
+	report->tracked = now.tracked;
+	report->allocations = now.allocations - started.allocations;
+	report->allocated = now.allocated - started.allocated;
+	report->heap_peak = now.peak;
+	report->resident = resident_bytes();
+	report->peak_resident = peak_resident_bytes();
+	report = nullptr;
+}
+}
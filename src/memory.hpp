@@ -0,0 +1,86 @@
+//
+//  memory.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <array>
+#include <vector>
+#include <cstddef>
+
+namespace Jacobian {
+#define MEMORY_CATEGORIES 4 // Number of entries in Category.
+
+// activations are a layer's batch-sized values and derivatives (contents and dZ), params its weights
+// and biases (which are batch-sized too) along with any pruning mask and sparse copy, optimizer its
+// momentum buffers (m and v) and scratch the backprop buffers planned in arenas.
+enum class Category {activations, params, optimizer, scratch};
+
+const char* category_name(Category category);
+
+struct LayerMemory {
+	std::array<size_t, MEMORY_CATEGORIES> bytes {};
+	size_t get(Category category) const {return bytes[static_cast<int>(category)];}
+	void add(Category category, size_t amount) {bytes[static_cast<int>(category)] += amount;}
+	size_t total() const;
+};
+
+// Heap allocations since the process started, on every thread. These are only counted in builds
+// with MEMORY_TRACKING, which counts in malloc itself (Eigen allocates its matrices with it directly,
+// so there's no allocator of Eigen's to hook), and only where that malloc is the one the process
+// uses: a program, but not a Python extension, which gets Python's. tracked says whether it is.
+struct AllocationCount {
+	bool tracked = false;
+	long allocations = 0;
+	long frees = 0;
+	size_t allocated = 0; // Bytes, counting what was freed since.
+	size_t live = 0;
+	size_t peak = 0; // Most bytes live at once since reset_heap_peak().
+};
+
+AllocationCount allocation_count();
+void reset_heap_peak();
+
+// The resident set size and its high water mark, from /proc/self/status, in bytes (0 if unknown).
+size_t resident_bytes();
+size_t peak_resident_bytes();
+// Lowers the high water mark to the current resident set. Returns false if the kernel won't.
+bool reset_peak_resident();
+
+// What a network holds, per layer and in total, and what its last epoch of training allocated.
+// totals also count what belongs to no one layer: labels, per-thread activations and weight copies,
+// and the arenas of every threading mode. Arenas share memory between buffers whose lifetimes don't
+// overlap, so a layer's scratch is what its own buffers need and the layers' scratch adds up to
+// more than the total's. peak_resident is the epoch's own if peak_reset, or else the process's.
+struct MemoryReport {
+	std::vector<LayerMemory> layers;
+	std::array<size_t, MEMORY_CATEGORIES> totals {};
+	int epoch = 0;
+	int steps = 0;
+	bool tracked = false;
+	long allocations = 0;
+	size_t allocated = 0;
+	size_t heap_peak = 0;
+	size_t resident = 0;
+	size_t peak_resident = 0;
+	bool peak_reset = false;
+	size_t bytes(int layer, Category category) const {return layers[layer].get(category);}
+	size_t total(Category category) const {return totals[static_cast<int>(category)];}
+	size_t total() const;
+	double allocations_per_step() const {return steps > 0 ? static_cast<double>(allocations) / steps : 0;}
+};
+
+// Measures an epoch into a report from start() until stop(), which is told how many steps it took.
+class MemoryEpoch {
+	MemoryReport* report = nullptr;
+	AllocationCount started;
+public:
+	void start(MemoryReport& into, int epoch);
+	void stop(int steps);
+};
+}
+#endif /* MEMORY_H */
@@ -0,0 +1,132 @@
+//
+//  predictor.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include "utils.hpp"
+#include "predictor.hpp"
+
+namespace Jacobian {
+// The built-ins simple enough to run as one vectorised expression over a whole buffer, instead of a
+// std::function call per value. Anything else is left to the per-value loop.
+ArrayActivation vectorized(const std::function<float(float)>& activation)
+{
+	std::string name = activations::name_of(activation);
+	if (name == "linear") return [](Eigen::Ref<Eigen::MatrixXf>) {};
+	if (name == "relu") return [](Eigen::Ref<Eigen::MatrixXf> values) {values = values.cwiseMax(0);};
+	if (name == "leaky_relu") return [](Eigen::Ref<Eigen::MatrixXf> values) {values = values.cwiseMax(0.01f * values);};
+	if (name == "hard_tanh") return [](Eigen::Ref<Eigen::MatrixXf> values) {values = values.cwiseMax(-1).cwiseMin(1);};
+	return nullptr;
+}
+
+Predictor::Predictor(const Network& net)
+{
+	refresh(net);
+}
+
+Predictor::Predictor(std::vector<Eigen::MatrixXf> layer_weights, const std::vector<Eigen::MatrixXf>& biases,
+					 std::vector<std::function<float(float)>> layer_activations)
+	:owned(std::move(layer_weights)), activations(std::move(layer_activations))
+{
+	Expects(!owned.empty() && biases.size() == owned.size() && activations.size() == owned.size()+1);
+	for (size_t i = 0; i < owned.size(); i++) {
+		Expects(biases[i].cols() == owned[i].cols() && (i == 0 || owned[i].rows() == owned[i-1].cols()));
+		weights.emplace_back(owned[i].data(), owned[i].rows(), owned[i].cols());
+		bias.push_back(biases[i].colwise().mean());
+	}
+	for (const std::function<float(float)>& activation : activations) array_activations.push_back(vectorized(activation));
+	buffers.resize(owned.size()+1);
+}
+
+Predictor::Predictor(std::shared_ptr<const Checkpoint> checkpoint)
+	:source(std::move(checkpoint))
+{
+	Expects(source);
+	for (int i = 0; i < source->layers(); i++) {
+		const activations::Named* named = activations::find(source->activation(i));
+		activations.push_back(named->activation);
+		if (i == 0) continue;
+		weights.push_back(source->weights(i-1));
+		auto layer_bias = source->bias(i);
+		if (layer_bias.size() > 0) bias.push_back(layer_bias.colwise().mean());
+		else bias.push_back(Eigen::RowVectorXf::Zero(source->nodes(i)));
+	}
+	for (const std::function<float(float)>& activation : activations) array_activations.push_back(vectorized(activation));
+	buffers.resize(source->layers());
+}
+
+// Maps the network's weights rather than copying them, so this is cheap enough to call before every
+// prediction; the biases have to be averaged again though.
+void Predictor::refresh(const Network& net)
+{
+	Expects(net.length > 1);
+	weights.clear();
+	owned.clear();
+	source.reset();
+	bias.clear();
+	activations.clear();
+	array_activations.clear();
+	for (int i = 0; i < net.length-1; i++) {
+		const Eigen::MatrixXf& w = net.layers[i].weights;
+		weights.emplace_back(w.data(), w.rows(), w.cols());
+		bias.push_back(net.layers[i+1].bias.colwise().mean());
+	}
+	for (const Layer& layer : net.layers) {
+		activations.push_back(layer.activation);
+		array_activations.push_back(layer.array_activation ? layer.array_activation : vectorized(layer.activation));
+	}
+	buffers.resize(net.length);
+}
+
+// Like feedforward(), the input layer's activation is applied too.
+template <typename Input>
+void Predictor::run(const Input& input)
+{
+	Expects(input.cols() == inputs());
+	const int rows = input.rows();
+	for (size_t i = 0; i < buffers.size(); i++) {
+		int cols = i == 0 ? inputs() : weights[i-1].cols();
+		if (buffers[i].rows() < rows || buffers[i].cols() != cols) buffers[i].resize(rows, cols);
+	}
+	buffers[0].topRows(rows) = input;
+	for (size_t i = 0; i < buffers.size(); i++) {
+		auto current = buffers[i].topRows(rows);
+		if (array_activations[i]) array_activations[i](current);
+		else {
+			const std::function<float(float)>& f = activations[i];
+			for (int k = 0; k < current.cols(); k++)
+				for (int j = 0; j < rows; j++) current(j,k) = f(current(j,k));
+		}
+		if (i+1 == buffers.size()) break;
+		buffers[i+1].topRows(rows).noalias() = current * weights[i];
+		buffers[i+1].topRows(rows).rowwise() += bias[i];
+	}
+	auto out = buffers.back().topRows(rows);
+	Eigen::VectorXf max = out.rowwise().maxCoeff();
+	out = (out.colwise() - max).array().exp().matrix();
+	Eigen::VectorXf sum = out.rowwise().sum();
+	out.array().colwise() /= sum.array();
+}
+
+Eigen::MatrixXf Predictor::predict(const Eigen::Ref<const Eigen::MatrixXf>& input)
+{
+	run(input);
+	return buffers.back().topRows(input.rows());
+}
+
+void Predictor::predict(const Eigen::Ref<const Eigen::MatrixXf>& input, Eigen::Ref<Eigen::MatrixXf> output)
+{
+	Expects(output.rows() == input.rows() && output.cols() == outputs());
+	run(input);
+	output = buffers.back().topRows(input.rows());
+}
+
+void Predictor::predict_rows(const Eigen::Ref<const RowMatrixXf>& input, Eigen::Ref<RowMatrixXf> output)
+{
+	Expects(output.rows() == input.rows() && output.cols() == outputs());
+	run(input);
+	output = buffers.back().topRows(input.rows());
+}
+}
@@ -0,0 +1,47 @@
+//
+//  predictor.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef PREDICTOR_H
+#define PREDICTOR_H
+
+#include "bpnn.hpp"
+
+namespace Jacobian {
+// The built-in activation's vectorized form, or null if it has none.
+ArrayActivation vectorized(const std::function<float(float)>& activation);
+
+// Inference only: the forward pass for any number of rows, without derivatives, labels or any other
+// training state. Each layer gets a single bias row, broadcast over every sample (a network's per-row
+// biases are averaged). The buffers grow to the most rows seen and are then reused, so a Predictor
+// must not be shared between threads - give each thread its own.
+class Predictor {
+	std::vector<Eigen::MatrixXf> owned; // Weights handed to the constructor; a network's or checkpoint's are mapped in place.
+	std::shared_ptr<const Checkpoint> source;
+	std::vector<Eigen::Map<const Eigen::MatrixXf>> weights;
+	std::vector<Eigen::RowVectorXf> bias;
+	std::vector<std::function<float(float)>> activations;
+	std::vector<ArrayActivation> array_activations; // A network's array activations, empty where it has none.
+	std::vector<Eigen::MatrixXf> buffers;
+	template <typename Input> void run(const Input& input);
+public:
+	Predictor(const Network& net);
+	// weights[i] and biases[i] lead into layer i+1 (biases may have one row or many, which are
+	// averaged); activations has one entry per layer, input included.
+	Predictor(std::vector<Eigen::MatrixXf> layer_weights, const std::vector<Eigen::MatrixXf>& biases,
+			  std::vector<std::function<float(float)>> layer_activations);
+	// Keeps the checkpoint mapped for as long as the predictor lives.
+	Predictor(std::shared_ptr<const Checkpoint> checkpoint);
+	void refresh(const Network& net); // Picks up a network's weights and biases after it trained further.
+	Eigen::MatrixXf predict(const Eigen::Ref<const Eigen::MatrixXf>& input);
+	void predict(const Eigen::Ref<const Eigen::MatrixXf>& input, Eigen::Ref<Eigen::MatrixXf> output);
+	// The same for row-major input and output, such as NumPy's, which then needn't be converted first.
+	void predict_rows(const Eigen::Ref<const RowMatrixXf>& input, Eigen::Ref<RowMatrixXf> output);
+	int inputs() const {return weights.front().rows();}
+	int outputs() const {return weights.back().cols();}
+};
+}
+#endif /* PREDICTOR_H */
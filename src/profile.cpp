@@ -0,0 +1,166 @@
+//
+//  profile.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "profile.hpp"
+
+namespace Jacobian {
+#if (!RECKLESS)
+thread_local Profile* ScopedTimer::target = nullptr;
+thread_local const PerfCounters* ScopedTimer::counters = nullptr;
+thread_local ScopedTimer* ScopedTimer::innermost = nullptr;
+#endif
+
+const char* phase_name(Phase phase)
+{
+	static const char* names[PROFILE_PHASES] = {"next_batch", "feedforward", "softmax", "backpropagate", "update",
+												"cost", "accuracy", "validate", "step", "convolve"};
+	return names[static_cast<int>(phase)];
+}
+
+const char* counter_name(Counter counter)
+{
+	static const char* names[PROFILE_COUNTERS] = {"cycles", "instructions", "cache_references", "cache_misses",
+												  "branches", "branch_misses", "flops"};
+	return names[static_cast<int>(counter)];
+}
+
+double Profile::ratio(Phase phase, Counter counter, Counter per) const
+{
+	double total = count(phase, per);
+	if (!counter_available[static_cast<int>(counter)] || !counter_available[static_cast<int>(per)] || total == 0) return 0;
+	return count(phase, counter) / total;
+}
+
+double Profile::flops(Phase phase) const
+{
+	if (!counter_available[static_cast<int>(Counter::flops)] || time(phase) == 0) return 0;
+	return count(phase, Counter::flops) / time(phase);
+}
+
+// Opens events (type, config) as one group, leaving out any that won't open. A group that can't
+// get its leader is left out altogether, as is one the PMU never schedules: perf_event_open()
+// succeeds for groups with more events than there are counters, which then never run at all.
+void PerfCounters::open_group(const std::vector<std::pair<unsigned, unsigned long long>>& events, const std::vector<Counter>& counts, const std::vector<double>& weights)
+{
+	Group group;
+	for (size_t i = 0; i < events.size(); i++) {
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].first;
+		attr.config = events[i].second;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		int leader = group.members.empty() ? -1 : group.members.front();
+		int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+		if (fd < 0) {
+			if (group.members.empty()) return;
+			continue;
+		}
+		group.members.push_back(fd);
+		group.counts.push_back(counts[i]);
+		group.weights.push_back(weights[i]);
+	}
+	uint64_t values[3 + 8]; // As in read().
+	size_t bytes = (3 + group.members.size()) * sizeof(uint64_t);
+	if (::read(group.members.front(), values, bytes) != static_cast<ssize_t>(bytes) || values[2] == 0) {
+		for (int fd : group.members) close(fd);
+		return;
+	}
+	for (Counter counted : group.counts) available[static_cast<int>(counted)] = true;
+	groups.push_back(std::move(group));
+}
+
+PerfCounters::PerfCounters()
+	:thread(syscall(SYS_gettid))
+{
+	// A group per ratio, so each pair is counted over the same time and small groups fit the PMU.
+	open_group({{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES}, {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS}},
+			   {Counter::cycles, Counter::instructions}, {1, 1});
+	open_group({{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES}, {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}},
+			   {Counter::cache_references, Counter::cache_misses}, {1, 1});
+	open_group({{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS}, {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}},
+			   {Counter::branches, Counter::branch_misses}, {1, 1});
+	// FP_ARITH_INST_RETIRED (event 0xc7) for scalar, 128, 256 and 512 bit packed singles. The same
+	// raw event means something else on other vendors' CPUs, so only ask Intel ones.
+	std::ifstream cpuinfo ("/proc/cpuinfo");
+	std::string line;
+	bool intel = false;
+	while (!intel && std::getline(cpuinfo, line)) intel = line.rfind("vendor_id", 0) == 0 && line.find("GenuineIntel") != std::string::npos;
+	if (intel)
+		open_group({{PERF_TYPE_RAW, 0x02c7}, {PERF_TYPE_RAW, 0x08c7}, {PERF_TYPE_RAW, 0x20c7}, {PERF_TYPE_RAW, 0x80c7}},
+				   {Counter::flops, Counter::flops, Counter::flops, Counter::flops}, {1, 4, 8, 16});
+}
+
+PerfCounters::~PerfCounters()
+{
+	for (const Group& group : groups) {
+		for (int fd : group.members) close(fd);
+	}
+}
+
+bool PerfCounters::owned_by_caller() const
+{
+	return thread == syscall(SYS_gettid);
+}
+
+// Adds each counter's running total to counts (which it zeroes first).
+void PerfCounters::read(std::array<double, PROFILE_COUNTERS>& counts) const
+{
+	counts.fill(0);
+	uint64_t values[3 + 8]; // Members, time enabled, time running, then a value per member.
+	for (const Group& group : groups) {
+		size_t bytes = (3 + group.members.size()) * sizeof(uint64_t);
+		if (::read(group.members.front(), values, bytes) != static_cast<ssize_t>(bytes) || values[2] == 0) continue;
+		double scale = static_cast<double>(values[1]) / values[2];
+		for (size_t i = 0; i < group.members.size(); i++)
+			counts[static_cast<int>(group.counts[i])] += values[3 + i] * scale * group.weights[i];
+	}
+}
+
+#if (!RECKLESS)
+void ScopedTimer::start_counting()
+{
+	counters->read(started);
+	nested_counts.fill(0);
+}
+
+void ScopedTimer::stop_counting()
+{
+	std::array<double, PROFILE_COUNTERS> now;
+	counters->read(now);
+	for (int c = 0; c < PROFILE_COUNTERS; c++) {
+		double counted = now[c] - started[c];
+		target->phase_counts[static_cast<int>(phase)][c] += counted - nested_counts[c];
+		if (parent) parent->nested_counts[c] += counted;
+	}
+}
+
+ProfileScope::ProfileScope(Profile& profile, const PerfCounters* hardware)
+	:previous(ScopedTimer::target), previous_counters(ScopedTimer::counters)
+{
+	ScopedTimer::target = &profile;
+	ScopedTimer::counters = hardware && hardware->any() ? hardware : nullptr;
+	profile.counted = ScopedTimer::counters != nullptr;
+	if (profile.counted) profile.counter_available = hardware->available;
+}
+
+ProfileScope::~ProfileScope()
+{
+	ScopedTimer::target = previous;
+	ScopedTimer::counters = previous_counters;
+}
+#endif
+}
@@ -0,0 +1,154 @@
+//
+//  profile.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <array>
+#include <chrono>
+#include <vector>
+#include <sys/types.h>
+
+namespace Jacobian {
+#define PROFILE_PHASES 10 // Number of entries in Phase.
+#define PROFILE_COUNTERS 7 // Number of entries in Counter.
+
+// step is a whole threaded training step (thread pool, task graph, pipeline or Hogwild), whose
+// parts run on workers and so aren't broken down. convolve is ConvNet's conv and pooling layers.
+enum class Phase {next_batch, feedforward, softmax, backpropagate, update, cost, accuracy, validate, step, convolve};
+
+// Cache references and misses are the last level cache's. flops counts single precision operations
+// (an FMA is two) from FP_ARITH_INST_RETIRED, so it's only there on Intel CPUs from Broadwell on.
+enum class Counter {cycles, instructions, cache_references, cache_misses, branches, branch_misses, flops};
+
+const char* phase_name(Phase phase);
+const char* counter_name(Counter counter);
+
+// Linux perf_event counters for the thread that opened them, counting in user space only. Whatever
+// the kernel, CPU or sandbox won't provide (often everything, in a VM or container) is just left
+// out: available says which counters are there, and read() leaves the rest at zero. So are groups
+// that open but never get scheduled. Groups sharing the PMU are multiplexed and scaled up by the
+// kernel's enabled and running times.
+class PerfCounters {
+	struct Group {
+		std::vector<int> members; // The first leads the group.
+		std::vector<Counter> counts; // What each member adds to...
+		std::vector<double> weights; // ...and how many times over.
+	};
+	std::vector<Group> groups;
+	pid_t thread;
+	void open_group(const std::vector<std::pair<unsigned, unsigned long long>>& events, const std::vector<Counter>& counts, const std::vector<double>& weights);
+public:
+	std::array<bool, PROFILE_COUNTERS> available {};
+	PerfCounters();
+	~PerfCounters();
+	PerfCounters(const PerfCounters&) = delete;
+	void operator=(const PerfCounters&) = delete;
+	bool any() const {return !groups.empty();}
+	bool owned_by_caller() const;
+	void read(std::array<double, PROFILE_COUNTERS>& counts) const;
+};
+
+// Where one epoch of train() went. Phase times are exclusive - softmax isn't also counted in
+// feedforward, nor update in backpropagate - so all but validate's add up to about seconds, the
+// training loop's wall time. GFLOP/s counts the forward and backward matrix products as if dense.
+// With hardware counters on, each phase's events are counted the same way, on the training thread
+// only; the ratios below are zero for counters that weren't available.
+struct Profile {
+	int epoch = 0;
+	int batches = 0;
+	double seconds = 0;
+	double samples_per_second = 0;
+	double gflops = 0;
+	std::array<double, PROFILE_PHASES> phase_seconds {};
+	std::array<long, PROFILE_PHASES> phase_calls {};
+	bool counted = false;
+	std::array<bool, PROFILE_COUNTERS> counter_available {};
+	std::array<std::array<double, PROFILE_COUNTERS>, PROFILE_PHASES> phase_counts {};
+	double time(Phase phase) const {return phase_seconds[static_cast<int>(phase)];}
+	long calls(Phase phase) const {return phase_calls[static_cast<int>(phase)];}
+	double count(Phase phase, Counter counter) const {return phase_counts[static_cast<int>(phase)][static_cast<int>(counter)];}
+	double ratio(Phase phase, Counter counter, Counter per) const;
+	double ipc(Phase phase) const {return ratio(phase, Counter::instructions, Counter::cycles);}
+	double cache_miss_rate(Phase phase) const {return ratio(phase, Counter::cache_misses, Counter::cache_references);}
+	double branch_miss_rate(Phase phase) const {return ratio(phase, Counter::branch_misses, Counter::branches);}
+	double flops(Phase phase) const; // Achieved, per second.
+};
+
+#if (!RECKLESS)
+// Times a phase into the profile the calling thread is recording into, if any, so only the thread
+// running train() is measured and shared code called from workers costs a thread-local load.
+// Everything run during validation counts as validation. Counters, when on, are read out of line
+// since doing so is a system call or two anyway.
+class ScopedTimer {
+	static thread_local Profile* target;
+	static thread_local const PerfCounters* counters;
+	static thread_local ScopedTimer* innermost;
+	ScopedTimer* parent;
+	Phase phase;
+	bool active;
+	double nested = 0; // Seconds spent in timers opened inside this one.
+	std::chrono::steady_clock::time_point start;
+	std::array<double, PROFILE_COUNTERS> started; // Only set while counting, like nested_counts.
+	std::array<double, PROFILE_COUNTERS> nested_counts;
+	void start_counting();
+	void stop_counting();
+	friend class ProfileScope;
+public:
+	ScopedTimer(Phase timed)
+		:parent(innermost), phase(timed)
+	{
+		active = target && !(parent && parent->phase == Phase::validate);
+		if (!active) return;
+		innermost = this;
+		if (counters) start_counting();
+		start = std::chrono::steady_clock::now();
+	}
+	~ScopedTimer()
+	{
+		if (!active) return;
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (counters) stop_counting();
+		target->phase_seconds[static_cast<int>(phase)] += elapsed - nested;
+		target->phase_calls[static_cast<int>(phase)]++;
+		if (parent) parent->nested += elapsed;
+		innermost = parent;
+	}
+	ScopedTimer(const ScopedTimer&) = delete;
+	void operator=(const ScopedTimer&) = delete;
+};
+
+// Points the calling thread's timers at profile until it goes out of scope, counting hardware
+// events as well if given counters that the calling thread opened.
+class ProfileScope {
+	Profile* previous;
+	const PerfCounters* previous_counters;
+public:
+	ProfileScope(Profile& profile, const PerfCounters* hardware=nullptr);
+	~ProfileScope();
+	ProfileScope(const ProfileScope&) = delete;
+	void operator=(const ProfileScope&) = delete;
+};
+#else
+// RECKLESS builds have no timers, so this does nothing and profiles are left empty.
+class ProfileScope {
+public:
+	ProfileScope(Profile&, const PerfCounters* =nullptr) {}
+	ProfileScope(const ProfileScope&) = delete;
+	void operator=(const ProfileScope&) = delete;
+};
+#endif
+
+#define PROFILE_CONCAT(a, b) a##b
+#define PROFILE_NAME(line) PROFILE_CONCAT(profile_timer_, line)
+#if (!RECKLESS)
+#define PROFILE(phase) Jacobian::ScopedTimer PROFILE_NAME(__LINE__) (phase)
+#else
+#define PROFILE(phase)
+#endif
+}
+#endif /* PROFILE_H */
@@ -0,0 +1,117 @@
+//
+//  prune.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <algorithm>
+
+#include "bpnn.hpp"
+#include "prune.hpp"
+
+namespace Jacobian {
+#define SPARSE_TILE 16 // Batch rows accumulated at once by the sparse products.
+
+SparseWeights::SparseWeights(const Eigen::MatrixXf& weights, const Eigen::MatrixXf& mask)
+	:inputs(weights.rows()), outputs(weights.cols())
+{
+	Expects(mask.rows() == weights.rows() && mask.cols() == weights.cols());
+	by_input.starts.push_back(0);
+	for (int k = 0; k < inputs; k++) {
+		for (int j = 0; j < outputs; j++) {
+			if (mask(k, j) == 0) continue;
+			by_input.indices.push_back(j);
+			by_input.values.push_back(weights(k, j));
+		}
+		by_input.starts.push_back(by_input.indices.size());
+	}
+	by_output.starts.push_back(0);
+	for (int j = 0; j < outputs; j++) {
+		for (int k = 0; k < inputs; k++) {
+			if (mask(k, j) == 0) continue;
+			by_output.indices.push_back(k);
+			by_output.values.push_back(weights(k, j));
+		}
+		by_output.starts.push_back(by_output.indices.size());
+	}
+}
+
+void SparseWeights::refresh(const Eigen::MatrixXf& weights)
+{
+	for (int k = 0; k < inputs; k++)
+		for (int p = by_input.starts[k]; p < by_input.starts[k+1]; p++) by_input.values[p] = weights(k, by_input.indices[p]);
+	for (int j = 0; j < outputs; j++)
+		for (int p = by_output.starts[j]; p < by_output.starts[j+1]; p++) by_output.values[p] = weights(by_output.indices[p], j);
+}
+
+size_t SparseWeights::bytes() const
+{
+	size_t total = 0;
+	for (const Compressed* lines : {&by_input, &by_output})
+		total += lines->starts.capacity() * sizeof(int) + lines->indices.capacity() * sizeof(int) + lines->values.capacity() * sizeof(float);
+	return total;
+}
+
+// out.col(l) = sum of value * in.col(index) over line l's nonzeros. A full tile of rows has a fixed
+// size so its accumulator lives in registers; a last, partial one doesn't.
+inline void gather(const Eigen::Ref<const Eigen::MatrixXf>& in, const std::vector<int>& starts, const std::vector<int>& indices,
+				   const std::vector<float>& values, Eigen::Ref<Eigen::MatrixXf> out)
+{
+	const int rows = in.rows();
+	const int lines = starts.size() - 1;
+	int first = 0;
+	for (; first + SPARSE_TILE <= rows; first += SPARSE_TILE) {
+		for (int l = 0; l < lines; l++) {
+			float acc[SPARSE_TILE] = {};
+			for (int p = starts[l]; p < starts[l+1]; p++) {
+				const float* column = in.data() + static_cast<size_t>(indices[p]) * in.outerStride() + first;
+				for (int r = 0; r < SPARSE_TILE; r++) acc[r] += values[p] * column[r];
+			}
+			float* result = out.data() + static_cast<size_t>(l) * out.outerStride() + first;
+			for (int r = 0; r < SPARSE_TILE; r++) result[r] = acc[r];
+		}
+	}
+	if (first == rows) return;
+	for (int l = 0; l < lines; l++) {
+		auto result = out.col(l).segment(first, rows - first);
+		result.setZero();
+		for (int p = starts[l]; p < starts[l+1]; p++) result += values[p] * in.col(indices[p]).segment(first, rows - first);
+	}
+}
+
+void SparseWeights::multiply(const Eigen::Ref<const Eigen::MatrixXf>& in, Eigen::Ref<Eigen::MatrixXf> out) const
+{
+	Expects(in.cols() == inputs && out.cols() == outputs && in.rows() == out.rows());
+	gather(in, by_output.starts, by_output.indices, by_output.values, out);
+}
+
+void SparseWeights::multiply_transposed(const Eigen::Ref<const Eigen::MatrixXf>& gradient, Eigen::Ref<Eigen::MatrixXf> out) const
+{
+	Expects(gradient.cols() == outputs && out.cols() == inputs && gradient.rows() == out.rows());
+	gather(gradient, by_input.starts, by_input.indices, by_input.values, out);
+}
+
+void SparseWeights::masked_delta(const Eigen::Ref<const Eigen::MatrixXf>& in, const Eigen::Ref<const Eigen::MatrixXf>& gradient,
+								 Eigen::Ref<Eigen::MatrixXf> delta) const
+{
+	Expects(in.cols() == inputs && gradient.cols() == outputs && in.rows() == gradient.rows());
+	delta.setZero();
+	for (int k = 0; k < inputs; k++)
+		for (int p = by_input.starts[k]; p < by_input.starts[k+1]; p++)
+			delta(k, by_input.indices[p]) = in.col(k).dot(gradient.col(by_input.indices[p]));
+}
+
+// Ties at the threshold are pruned too, so the result can be slightly sparser than asked.
+Eigen::MatrixXf magnitude_mask(const Eigen::MatrixXf& weights, float sparsity)
+{
+	Expects(sparsity >= 0 && sparsity <= 1);
+	const size_t count = std::lround(sparsity * weights.size());
+	if (count == 0) return Eigen::MatrixXf::Ones(weights.rows(), weights.cols());
+	std::vector<float> magnitudes (weights.data(), weights.data() + weights.size());
+	for (float& magnitude : magnitudes) magnitude = std::abs(magnitude);
+	std::nth_element(magnitudes.begin(), magnitudes.begin() + count - 1, magnitudes.end());
+	const float threshold = magnitudes[count - 1];
+	return (weights.array().abs() > threshold).cast<float>().matrix();
+}
+}
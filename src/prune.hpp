@@ -0,0 +1,73 @@
+//
+//  prune.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef PRUNE_H
+#define PRUNE_H
+
+#include <vector>
+#include <Eigen/Dense>
+
+namespace Jacobian {
+// Gradual magnitude pruning (Zhu & Gupta): at the end of every frequency-th epoch from start to end,
+// each layer's smallest weights are masked to zero until its sparsity reaches
+// target + (initial - target) * (1 - (epoch - start) / (end - start))^3, which prunes quickly at
+// first and then tapers off. start == end prunes once, straight to target. Layers whose density
+// falls below sparse_below switch to compressed sparse row kernels.
+struct PruningSchedule {
+	float target;
+	int start;
+	int end;
+	int frequency = 1;
+	float initial = 0;
+	float sparse_below = 0.3;
+};
+
+// Per weight layer: how much of it is pruned, whether it runs sparse, and what a forward product
+// over one batch costs each way (timed on random input, so it can be compared before converting).
+struct SparsityReport {
+	int layer;
+	int inputs;
+	int outputs;
+	float sparsity;
+	bool sparse;
+	double dense_us;
+	double sparse_us;
+	float speedup;
+};
+
+// A pruned weight matrix, kept both by input (CSR) and by output (CSC) so that every product gathers:
+// an output column of a batch accumulates in registers over its inputs' columns instead of being
+// read and written back once per nonzero. The pattern is fixed when it's built; refresh() only copies
+// the surviving values back out of the dense weights after they are updated.
+class SparseWeights {
+	struct Compressed {
+		std::vector<int> starts; // Line l's nonzeros are [starts[l], starts[l+1]).
+		std::vector<int> indices;
+		std::vector<float> values;
+	};
+	int inputs;
+	int outputs;
+	Compressed by_input; // Lines are inputs and indices outputs.
+	Compressed by_output; // Lines are outputs and indices inputs.
+public:
+	SparseWeights(const Eigen::MatrixXf& weights, const Eigen::MatrixXf& mask);
+	void refresh(const Eigen::MatrixXf& weights);
+	float density() const {return static_cast<float>(by_input.values.size()) / (inputs * outputs);}
+	size_t bytes() const;
+	// out = in * weights
+	void multiply(const Eigen::Ref<const Eigen::MatrixXf>& in, Eigen::Ref<Eigen::MatrixXf> out) const;
+	// out = gradient * weights^T
+	void multiply_transposed(const Eigen::Ref<const Eigen::MatrixXf>& gradient, Eigen::Ref<Eigen::MatrixXf> out) const;
+	// delta = in^T * gradient, computed only where the weights survive and zero everywhere else.
+	void masked_delta(const Eigen::Ref<const Eigen::MatrixXf>& in, const Eigen::Ref<const Eigen::MatrixXf>& gradient,
+					  Eigen::Ref<Eigen::MatrixXf> delta) const;
+};
+
+// The mask that keeps the largest (1 - sparsity) fraction of weights by magnitude.
+Eigen::MatrixXf magnitude_mask(const Eigen::MatrixXf& weights, float sparsity);
+}
+#endif /* PRUNE_H */
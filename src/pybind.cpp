@@ -9,12 +9,34 @@
 #include <pybind11/stl.h>
 #include <pybind11/functional.h>
 #include <pybind11/eigen.h>
+#include <pybind11/numpy.h>
 
 #include "bpnn.hpp"
 #include "utils.hpp"
+#include "sweep.hpp"
+#include "server.hpp"
+#include "predictor.hpp"
+#include "checkpoint.hpp"
+#include "quantize.hpp"
+#include "freeze.hpp"
+#include "expression.hpp"
+#include "scoring.hpp"
 using namespace Jacobian;
 namespace py = pybind11;
 
+typedef std::function<py::object(Eigen::Ref<Eigen::MatrixXf>)> PyArrayActivation;
+
+// A Python array activation gets a writeable NumPy view of a block of the layer, valid only during
+// the call. It can overwrite the view in place and return None, or return the new values.
+static ArrayActivation from_python(PyArrayActivation f)
+{
+	return [f](Eigen::Ref<Eigen::MatrixXf> values) {
+		py::gil_scoped_acquire gil;
+		py::object result = f(values);
+		if (!result.is_none()) values = result.cast<Eigen::MatrixXf>();
+	};
+}
+
 PYBIND11_MODULE(_jacobian, m)
 {
 	m.doc() = "Fast machine learning in C++"; // optional module docstring
@@ -31,7 +53,127 @@ PYBIND11_MODULE(_jacobian, m)
 		.def_readonly("m", &Layer::m)
 		.def_readonly("dZ", &Layer::dZ)
 		.def_readonly("activation", &Layer::activation)
-		.def_readonly("activation_deriv", &Layer::activation);
+		.def_readonly("activation_deriv", &Layer::activation_deriv);
+	py::class_<Transport, std::shared_ptr<Transport>>(m, "Transport")
+		.def("rank", &Transport::rank)
+		.def("world", &Transport::world);
+	py::class_<TcpTransport, Transport, std::shared_ptr<TcpTransport>>(m, "TcpTransport")
+		.def(py::init<int, const std::vector<std::string>&>(),
+			 py::arg("rank"), py::arg("peers"));
+	py::class_<ShmTransport, Transport, std::shared_ptr<ShmTransport>>(m, "ShmTransport")
+		.def(py::init<const std::string&, int, int, size_t>(),
+			 py::arg("name"), py::arg("rank"), py::arg("world"),
+			 py::arg("capacity") = 1 << 16);
+	py::class_<Dataset, std::shared_ptr<Dataset>>(m, "Dataset")
+		.def(py::init<const char *, float>(), py::arg("path"), py::arg("ratio"))
+		// Float32, C-contiguous arrays with the label last on each row, used in place (so never converted).
+		.def(py::init([](py::array_t<float, py::array::c_style> train, py::array_t<float, py::array::c_style> val) {
+				 if (train.ndim() != 2 || val.ndim() != 2 || train.shape(1) != val.shape(1))
+					 throw std::runtime_error{"Dataset arrays must be 2D with the same number of columns."};
+				 return std::make_shared<Dataset>(train.data(), train.shape(0), val.data(), val.shape(0), train.shape(1));
+			 }),
+			 py::arg("train").noconvert(), py::arg("val").noconvert(),
+			 py::keep_alive<1, 2>(), py::keep_alive<1, 3>())
+		.def_readonly("train_instances", &Dataset::train_instances)
+		.def_readonly("val_instances", &Dataset::val_instances);
+	py::class_<PipelineReport>(m, "PipelineReport")
+		.def_readonly("stages", &PipelineReport::stages)
+		.def_readonly("micro_batches", &PipelineReport::micro_batches)
+		.def_readonly("first_layers", &PipelineReport::first_layers)
+		.def_readonly("utilization", &PipelineReport::utilization)
+		.def_readonly("bubble", &PipelineReport::bubble)
+		.def_readonly("ideal_bubble", &PipelineReport::ideal_bubble);
+	py::class_<PruningSchedule>(m, "PruningSchedule")
+		.def(py::init([](float target, int start, int end, int frequency, float initial, float sparse_below) {
+				 return PruningSchedule {target, start, end, frequency, initial, sparse_below};
+			 }),
+			 py::arg("target"), py::arg("start"), py::arg("end"),
+			 py::arg("frequency") = 1, py::arg("initial") = 0,
+			 py::arg("sparse_below") = 0.3)
+		.def_readwrite("target", &PruningSchedule::target)
+		.def_readwrite("start", &PruningSchedule::start)
+		.def_readwrite("end", &PruningSchedule::end)
+		.def_readwrite("frequency", &PruningSchedule::frequency)
+		.def_readwrite("initial", &PruningSchedule::initial)
+		.def_readwrite("sparse_below", &PruningSchedule::sparse_below);
+	py::enum_<Phase>(m, "Phase")
+		.value("next_batch", Phase::next_batch)
+		.value("feedforward", Phase::feedforward)
+		.value("softmax", Phase::softmax)
+		.value("backpropagate", Phase::backpropagate)
+		.value("update", Phase::update)
+		.value("cost", Phase::cost)
+		.value("accuracy", Phase::accuracy)
+		.value("validate", Phase::validate)
+		.value("step", Phase::step)
+		.value("convolve", Phase::convolve);
+	py::enum_<Counter>(m, "Counter")
+		.value("cycles", Counter::cycles)
+		.value("instructions", Counter::instructions)
+		.value("cache_references", Counter::cache_references)
+		.value("cache_misses", Counter::cache_misses)
+		.value("branches", Counter::branches)
+		.value("branch_misses", Counter::branch_misses)
+		.value("flops", Counter::flops);
+	py::class_<Profile>(m, "Profile")
+		.def_readonly("epoch", &Profile::epoch)
+		.def_readonly("batches", &Profile::batches)
+		.def_readonly("seconds", &Profile::seconds)
+		.def_readonly("samples_per_second", &Profile::samples_per_second)
+		.def_readonly("gflops", &Profile::gflops)
+		.def("time", &Profile::time, py::arg("phase"))
+		.def("calls", &Profile::calls, py::arg("phase"))
+		.def_readonly("counted", &Profile::counted)
+		.def("count", &Profile::count, py::arg("phase"), py::arg("counter"))
+		.def("ipc", &Profile::ipc, py::arg("phase"))
+		.def("cache_miss_rate", &Profile::cache_miss_rate, py::arg("phase"))
+		.def("branch_miss_rate", &Profile::branch_miss_rate, py::arg("phase"))
+		.def("flops", &Profile::flops, py::arg("phase"))
+		.def_property_readonly("phases", [](const Profile& profile) {
+			py::dict phases;
+			for (int i = 0; i < PROFILE_PHASES; i++)
+				phases[phase_name(static_cast<Phase>(i))] = py::make_tuple(profile.phase_seconds[i], profile.phase_calls[i]);
+			return phases;
+		});
+	py::enum_<Category>(m, "Category")
+		.value("activations", Category::activations)
+		.value("params", Category::params)
+		.value("optimizer", Category::optimizer)
+		.value("scratch", Category::scratch);
+	auto categories = [](const std::array<size_t, MEMORY_CATEGORIES>& bytes) {
+		py::dict named;
+		for (int c = 0; c < MEMORY_CATEGORIES; c++) named[category_name(static_cast<Category>(c))] = bytes[c];
+		return named;
+	};
+	py::class_<MemoryReport>(m, "MemoryReport")
+		.def_readonly("epoch", &MemoryReport::epoch)
+		.def_readonly("steps", &MemoryReport::steps)
+		.def_readonly("tracked", &MemoryReport::tracked)
+		.def_readonly("allocations", &MemoryReport::allocations)
+		.def_readonly("allocated", &MemoryReport::allocated)
+		.def_readonly("heap_peak", &MemoryReport::heap_peak)
+		.def_readonly("resident", &MemoryReport::resident)
+		.def_readonly("peak_resident", &MemoryReport::peak_resident)
+		.def_readonly("peak_reset", &MemoryReport::peak_reset)
+		.def("bytes", &MemoryReport::bytes, py::arg("layer"), py::arg("category"))
+		.def("total", py::overload_cast<Category>(&MemoryReport::total, py::const_), py::arg("category"))
+		.def("total", py::overload_cast<>(&MemoryReport::total, py::const_))
+		.def("allocations_per_step", &MemoryReport::allocations_per_step)
+		.def_property_readonly("layers", [categories](const MemoryReport& report) {
+			py::list layers;
+			for (const LayerMemory& layer : report.layers) layers.append(categories(layer.bytes));
+			return layers;
+		})
+		.def_property_readonly("totals", [categories](const MemoryReport& report) {return categories(report.totals);});
+	py::class_<SparsityReport>(m, "SparsityReport")
+		.def_readonly("layer", &SparsityReport::layer)
+		.def_readonly("inputs", &SparsityReport::inputs)
+		.def_readonly("outputs", &SparsityReport::outputs)
+		.def_readonly("sparsity", &SparsityReport::sparsity)
+		.def_readonly("sparse", &SparsityReport::sparse)
+		.def_readonly("dense_us", &SparsityReport::dense_us)
+		.def_readonly("sparse_us", &SparsityReport::sparse_us)
+		.def_readonly("speedup", &SparsityReport::speedup);
 	py::class_<Network>(m, "Network")
 		.def(py::init<char *, int, float, float, Regularization, float,
 				  float, bool, float>(),
@@ -39,26 +181,217 @@ PYBIND11_MODULE(_jacobian, m)
 			 py::arg("bias_rate"), py::arg("regularization"),
 			 py::arg("lambda"), py::arg("ratio"),
 			 py::arg("early_exit") = true, py::arg("cutoff") = 0)
+		.def(py::init<std::shared_ptr<Dataset>, int, float, float, Regularization,
+				  float, bool, float>(),
+			 py::arg("dataset"), py::arg("batch"), py::arg("learn_rate"),
+			 py::arg("bias_rate"), py::arg("regularization"),
+			 py::arg("lambda"), py::arg("early_exit") = true,
+			 py::arg("cutoff") = 0)
 		.def("add_layer", &Network::add_layer, py::arg("nodes"),
 			 py::arg("activation"), py::arg("activation_deriv"))
 		.def("initialize", &Network::initialize)
 		.def("init_optimizer", &Network::init_optimizer, py::arg("optimizer"))
 		.def("init_decay", &Network::init_decay, py::arg("decay"))
+		.def("set_threads", &Network::set_threads, py::arg("threads"),
+			 py::arg("shards") = 0)
+		.def("set_task_graph", &Network::set_task_graph, py::arg("enabled"))
+		.def("set_numa", &Network::set_numa, py::arg("enabled"),
+			 py::arg("replicate_weights") = false)
+		.def("set_pipeline", &Network::set_pipeline, py::arg("stages"),
+			 py::arg("micro_batches"))
+		.def("pipeline_report", &Network::pipeline_report)
+		.def("set_pruning", &Network::set_pruning, py::arg("schedule"))
+		.def("prune", &Network::prune, py::arg("sparsity"))
+		.def("sparsity_report", &Network::sparsity_report)
+		.def("set_activation", &Network::set_expression,
+			 py::arg("index"), py::arg("expression"),
+			 py::arg("derivative") = "")
 		.def("set_activation", &Network::set_activation,
 			 py::arg("index"), py::arg("custom"),
 			 py::arg("custom_deriv"))
-		.def("feedforward", &Network::feedforward)
-		.def("backpropagate", &Network::backpropagate)
+		.def("set_array_activation", [](Network& net, int index, PyArrayActivation custom, PyArrayActivation custom_deriv) {
+				 net.set_array_activation(index, from_python(custom), from_python(custom_deriv));
+			 },
+			 py::arg("index"), py::arg("custom"), py::arg("custom_deriv"))
+		.def("feedforward", &Network::feedforward,
+			 py::call_guard<py::gil_scoped_release>())
+		.def("backpropagate", &Network::backpropagate,
+			 py::call_guard<py::gil_scoped_release>())
 		.def("list_net", &Network::list_net)
 		.def("next_batch", &Network::interactive_next_batch)
-		.def("cost", &Network::cost)
-		.def("accuracy", &Network::accuracy)
-		.def("train", &Network::train)
+		.def("cost", py::overload_cast<>(&Network::cost))
+		.def("accuracy", py::overload_cast<>(&Network::accuracy))
+		.def("predict", &Network::predict_rows, py::arg("input").noconvert(),
+			 py::call_guard<py::gil_scoped_release>())
+		.def("predict", &Network::predict, py::arg("input"),
+			 py::call_guard<py::gil_scoped_release>())
+		.def("save", &Network::save, py::arg("path"),
+			 py::arg("optimizer_state") = false)
+		.def("load", py::overload_cast<const Checkpoint&>(&Network::load),
+			 py::arg("checkpoint"))
+		.def("load", py::overload_cast<const char*>(&Network::load),
+			 py::arg("path"))
+		.def("train", &Network::train,
+			 py::call_guard<py::gil_scoped_release>())
+		.def("train_hogwild", &Network::train_hogwild, py::arg("threads"),
+			 py::call_guard<py::gil_scoped_release>())
+		.def("distribute", &Network::distribute, py::arg("transport"))
+		.def("get_throughput", &Network::get_throughput)
+		.def("get_profile", &Network::get_profile)
+		.def("set_counters", &Network::set_counters, py::arg("enabled"))
+		.def("set_tracing", &Network::set_tracing, py::arg("path"))
+		.def("write_trace", &Network::write_trace)
+		.def("memory_report", &Network::memory_report)
+		.def("set_async_validation", &Network::set_async_validation,
+			 py::arg("enabled"), py::arg("callback") = nullptr)
+		.def("wait_validation", &Network::wait_validation)
 		.def("get_cost", &Network::get_cost)
 		.def("get_acc", &Network::get_acc)
 		.def("get_val_cost", &Network::get_val_cost)
 		.def("get_val_acc", &Network::get_val_acc)
-		.def_readonly("layers", &Network::layers);
+		// Views of the network's own layers (whose matrices are views in turn) rather than copies.
+		.def_property_readonly("layers", [](py::object self) {
+			py::list views;
+			for (Layer& layer : self.cast<Network&>().layers)
+				views.append(py::cast(&layer, py::return_value_policy::reference_internal, self));
+			return views;
+		});
+	py::class_<Expression>(m, "Expression")
+		.def(py::init<const std::string&>(), py::arg("source"))
+		.def("derivative", &Expression::derivative)
+		.def("source", &Expression::source)
+		.def("__call__", &Expression::operator(), py::arg("x"));
+	py::class_<Checkpoint, std::shared_ptr<Checkpoint>>(m, "Checkpoint")
+		.def(py::init<const char*>(), py::arg("path"))
+		.def_static("save", &Checkpoint::save, py::arg("network"),
+					py::arg("path"), py::arg("optimizer_state") = false)
+		.def("layers", &Checkpoint::layers)
+		.def("batch_size", &Checkpoint::batch_size)
+		.def("has_optimizer_state", &Checkpoint::has_optimizer_state)
+		.def("nodes", &Checkpoint::nodes, py::arg("index"))
+		.def("activation", &Checkpoint::activation, py::arg("index"))
+		.def("weights", &Checkpoint::weights, py::arg("index"),
+			 py::return_value_policy::reference_internal)
+		.def("bias", &Checkpoint::bias, py::arg("index"),
+			 py::return_value_policy::reference_internal)
+		.def("m", &Checkpoint::m, py::arg("index"),
+			 py::return_value_policy::reference_internal)
+		.def("v", &Checkpoint::v, py::arg("index"),
+			 py::return_value_policy::reference_internal);
+	py::class_<Predictor>(m, "Predictor")
+		.def(py::init<const Network&>(), py::arg("network"),
+			 py::keep_alive<1, 2>())
+		.def(py::init<std::shared_ptr<Checkpoint>>(), py::arg("checkpoint"))
+		.def(py::init<std::vector<Eigen::MatrixXf>, const std::vector<Eigen::MatrixXf>&,
+				  std::vector<std::function<float(float)>>>(),
+			 py::arg("weights"), py::arg("biases"), py::arg("activations"))
+		.def("refresh", &Predictor::refresh, py::arg("network"),
+			 py::keep_alive<1, 2>())
+		.def("predict", [](Predictor& predictor, const Eigen::Ref<const RowMatrixXf>& input) {
+				 RowMatrixXf output (input.rows(), predictor.outputs());
+				 predictor.predict_rows(input, output);
+				 return output;
+			 },
+			 py::arg("input").noconvert(), py::call_guard<py::gil_scoped_release>())
+		.def("predict", py::overload_cast<const Eigen::Ref<const Eigen::MatrixXf>&>(&Predictor::predict),
+			 py::arg("input"), py::call_guard<py::gil_scoped_release>())
+		.def("predict_into", &Predictor::predict_rows, py::arg("input"),
+			 py::arg("output").noconvert(), py::call_guard<py::gil_scoped_release>())
+		.def("inputs", &Predictor::inputs)
+		.def("outputs", &Predictor::outputs);
+	py::class_<QuantizationReport>(m, "QuantizationReport")
+		.def_readonly("samples", &QuantizationReport::samples)
+		.def_readonly("fp32_acc", &QuantizationReport::fp32_acc)
+		.def_readonly("int8_acc", &QuantizationReport::int8_acc)
+		.def_readonly("agreement", &QuantizationReport::agreement)
+		.def_readonly("max_delta", &QuantizationReport::max_delta)
+		.def_readonly("mean_delta", &QuantizationReport::mean_delta)
+		.def_readonly("fp32_bytes", &QuantizationReport::fp32_bytes)
+		.def_readonly("int8_bytes", &QuantizationReport::int8_bytes);
+	py::class_<QuantizedNetwork>(m, "QuantizedNetwork")
+		.def(py::init<Network&, int>(), py::arg("network"),
+			 py::arg("calibration_rows") = 256)
+		.def("predict", &QuantizedNetwork::predict, py::arg("input"))
+		.def("compare", &QuantizedNetwork::compare, py::arg("network"))
+		.def("bytes", &QuantizedNetwork::bytes)
+		.def("inputs", &QuantizedNetwork::inputs)
+		.def("outputs", &QuantizedNetwork::outputs);
+	py::class_<FrozenNetwork>(m, "FrozenNetwork")
+		.def(py::init<const Network&>(), py::arg("network"))
+		.def("predict", &FrozenNetwork::predict_rows, py::arg("input"),
+			 py::call_guard<py::gil_scoped_release>())
+		.def("emit_header", &FrozenNetwork::emit_header, py::arg("path"), py::arg("name"))
+		.def("bytes", &FrozenNetwork::bytes)
+		.def("inputs", &FrozenNetwork::inputs)
+		.def("outputs", &FrozenNetwork::outputs);
+	py::enum_<ScoreOutput>(m, "ScoreOutput")
+		.value("probabilities", ScoreOutput::probabilities)
+		.value("argmax", ScoreOutput::argmax);
+	py::class_<ScoringReport>(m, "ScoringReport")
+		.def_readonly("rows", &ScoringReport::rows)
+		.def_readonly("batches", &ScoringReport::batches)
+		.def_readonly("seconds", &ScoringReport::seconds)
+		.def_readonly("rows_per_second", &ScoringReport::rows_per_second)
+		.def_readonly("read_busy", &ScoringReport::read_busy)
+		.def_readonly("compute_busy", &ScoringReport::compute_busy)
+		.def_readonly("write_busy", &ScoringReport::write_busy);
+	py::class_<BatchScorer>(m, "BatchScorer")
+		.def(py::init<const Network&, int, int, int>(), py::arg("network"),
+			 py::arg("threads"), py::arg("batch") = 4096, py::arg("queue_depth") = 4,
+			 py::keep_alive<1, 2>())
+		.def(py::init<std::shared_ptr<Checkpoint>, int, int, int>(), py::arg("checkpoint"),
+			 py::arg("threads"), py::arg("batch") = 4096, py::arg("queue_depth") = 4)
+		.def("score", &BatchScorer::score, py::arg("input"), py::arg("output"),
+			 py::arg("output_format") = ScoreOutput::probabilities,
+			 py::call_guard<py::gil_scoped_release>());
+	py::class_<LatencyReport>(m, "LatencyReport")
+		.def_readonly("requests", &LatencyReport::requests)
+		.def_readonly("batches", &LatencyReport::batches)
+		.def_readonly("mean_batch", &LatencyReport::mean_batch)
+		.def_readonly("p50", &LatencyReport::p50)
+		.def_readonly("p95", &LatencyReport::p95)
+		.def_readonly("p99", &LatencyReport::p99)
+		.def_readonly("max", &LatencyReport::max);
+	py::class_<InferenceServer>(m, "InferenceServer")
+		.def(py::init<Network&, const std::string&, int, int, int>(),
+			 py::arg("network"), py::arg("path"), py::arg("threads"),
+			 py::arg("batch") = 0, py::arg("deadline_us") = 1000,
+			 py::keep_alive<1, 2>())
+		.def("stop", &InferenceServer::stop,
+			 py::call_guard<py::gil_scoped_release>())
+		.def("report", &InferenceServer::report);
+	py::class_<InferenceClient>(m, "InferenceClient")
+		.def(py::init<const std::string&>(), py::arg("path"))
+		.def("predict", &InferenceClient::predict, py::arg("features"),
+			 py::arg("outputs"), py::call_guard<py::gil_scoped_release>());
+	py::class_<TrialConfig>(m, "TrialConfig")
+		.def(py::init([](int batch, float learn_rate, float bias_rate, Regularization regularization,
+						 float lambda, std::function<void(Network&)> build, bool early_exit, float cutoff) {
+			return TrialConfig {batch, learn_rate, bias_rate, regularization, lambda, build, early_exit, cutoff};
+		}), py::arg("batch"), py::arg("learn_rate"), py::arg("bias_rate"),
+			 py::arg("regularization"), py::arg("lambda"), py::arg("build"),
+			 py::arg("early_exit") = true, py::arg("cutoff") = 0);
+	py::class_<TrialResult>(m, "TrialResult")
+		.def_readonly("id", &TrialResult::id)
+		.def_readonly("running", &TrialResult::running)
+		.def_readonly("diverged", &TrialResult::diverged)
+		.def_readonly("stopped", &TrialResult::stopped)
+		.def_readonly("epochs", &TrialResult::epochs)
+		.def_readonly("cost", &TrialResult::cost)
+		.def_readonly("acc", &TrialResult::acc)
+		.def_readonly("val_cost", &TrialResult::val_cost)
+		.def_readonly("val_acc", &TrialResult::val_acc)
+		.def_readonly("best_val_cost", &TrialResult::best_val_cost);
+	py::class_<Sweep>(m, "Sweep")
+		.def(py::init<std::shared_ptr<Dataset>, int, int>(), py::arg("dataset"),
+			 py::arg("threads"), py::arg("patience") = 3)
+		.def("add", &Sweep::add, py::arg("config"))
+		.def("run", &Sweep::run, py::arg("epochs"),
+			 py::call_guard<py::gil_scoped_release>())
+		.def("running", &Sweep::running)
+		.def("best", &Sweep::best)
+		.def("results", &Sweep::results)
+		.def("network", &Sweep::network, py::arg("id"), py::return_value_policy::reference_internal);
 	auto a = m.def_submodule("activations", "Submodule supplying built-in activation functions.");
 	a.def("linear", &activations::linear, py::arg("x"));
 	a.def("linear_deriv", &activations::linear_deriv, py::arg("x"));
@@ -80,8 +413,10 @@ PYBIND11_MODULE(_jacobian, m)
 	a.def("hard_tanh_deriv", &activations::hard_tanh_deriv, py::arg("x"));
 	a.def("leaky_relu", &activations::leaky_relu, py::arg("x"));
 	a.def("leaky_relu_deriv", &activations::leaky_relu_deriv, py::arg("x"));
-	a.def("relu", (activations::rectifier(activations::linear)), py::arg("x"));
-	a.def("relu_deriv", (activations::rectifier(activations::linear_deriv)), py::arg("x"));
+	a.def("relu", &activations::relu, py::arg("x"));
+	a.def("relu_deriv", &activations::relu_deriv, py::arg("x"));
+	a.def("bipolar_sigmoid", &activations::bipolar_sigmoid, py::arg("x"));
+	a.def("bipolar_sigmoid_deriv", &activations::bipolar_sigmoid_deriv, py::arg("x"));
 	auto o = m.def_submodule("optimizers", "Submodule supplying built-in gradient descent optimizers.");
 	o.def("momentum", &optimizers::momentum, py::arg("beta"));
 	o.def("demon", &optimizers::demon, py::arg("beta"), py::arg("max_ep"));
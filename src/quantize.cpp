@@ -0,0 +1,254 @@
+//
+//  quantize.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <algorithm>
+#include <cstring>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "quantize.hpp"
+#include "predictor.hpp"
+
+namespace Jacobian {
+static_assert(QUANT_TILE % QUANT_ROWS == 0, "the kernel's rows past a tile's end must still be in sums");
+
+inline int round_up(int value, int multiple)
+{
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+// Activations work value by value, so a row-major block goes to them as its column-major transpose,
+// without being copied.
+inline void activate(const ArrayActivation& array_activation, const std::function<float(float)>& activation, Eigen::Map<RowMatrixXf>& values)
+{
+	Eigen::Map<Eigen::MatrixXf> transposed (values.data(), values.cols(), values.rows());
+	if (array_activation) array_activation(transposed);
+	else transposed = transposed.unaryExpr(activation);
+}
+
+// Quantizes a row of values, eight at a time where AVX2 can.
+inline void quantize(const float* values, int count, float scale, uint8_t* out)
+{
+	const float inverse = 1 / scale;
+	int j = 0;
+#if defined(__AVX2__)
+	const __m256 multiplier = _mm256_set1_ps(inverse);
+	for (; j + 8 <= count; j += 8) {
+		__m256 q = _mm256_round_ps(_mm256_mul_ps(_mm256_loadu_ps(values + j), multiplier), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+		q = _mm256_min_ps(_mm256_max_ps(q, _mm256_set1_ps(-127)), _mm256_set1_ps(127));
+		__m256i ints = _mm256_cvtps_epi32(_mm256_add_ps(q, _mm256_set1_ps(128)));
+		__m128i words = _mm_packus_epi32(_mm256_castsi256_si128(ints), _mm256_extracti128_si256(ints, 1));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(out + j), _mm_packus_epi16(words, words));
+	}
+#endif
+	for (; j < count; j++) out[j] = std::clamp(static_cast<int>(std::nearbyint(values[j] * inverse)), -127, 127) + 128;
+}
+
+// The same for a block of rows, into rows of bytes stride apart.
+inline void quantize(const Eigen::Map<RowMatrixXf>& values, float scale, uint8_t* rows, int stride)
+{
+	for (int r = 0; r < values.rows(); r++) quantize(values.data() + r * values.cols(), values.cols(), scale, rows + r * stride);
+}
+
+#if defined(__AVX2__)
+// Four activations broadcast to every lane, times four weights of each of eight channels, summed into
+// each channel's int32 lane. VNNI does it in one instruction. Plain AVX2's maddubs would saturate on
+// u8 x s8 pairs, so the activations' top bit is multiplied in separately: each half's pairs fit.
+#if defined(__AVXVNNI__)
+inline __m256i multiply_add(__m256i acc, __m256i a, __m256i b) {return _mm256_dpbusd_avx_epi32(acc, a, b);}
+#elif defined(__AVX512VNNI__) && defined(__AVX512VL__)
+inline __m256i multiply_add(__m256i acc, __m256i a, __m256i b) {return _mm256_dpbusd_epi32(acc, a, b);}
+#else
+inline __m256i multiply_add(__m256i acc, __m256i a, __m256i b)
+{
+	const __m256i ones = _mm256_set1_epi16(1);
+	__m256i low = _mm256_maddubs_epi16(_mm256_and_si256(a, _mm256_set1_epi8(0x7F)), b);
+	__m256i high = _mm256_maddubs_epi16(_mm256_and_si256(a, _mm256_set1_epi8(static_cast<char>(0x80))), b);
+	return _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_madd_epi16(low, ones), _mm256_madd_epi16(high, ones)));
+}
+#endif
+#endif
+
+// Sums of QUANT_ROWS rows of activations times one group of QUANT_CHANNELS output channels. Every
+// step broadcasts four of a row's activations against the group's weights for those inputs, which
+// are loaded once and reused from registers for every row, and no lanes need adding up at the end.
+inline void dot_group(const uint8_t* const* rows, const int8_t* weights, int stride, int32_t* sums, int sums_stride)
+{
+#if defined(__AVX2__)
+	static_assert(QUANT_CHANNELS == 16 && QUANT_LANES == 4, "a step loads two vectors of eight channels' four weights");
+	__m256i acc[QUANT_ROWS][2];
+	for (int r = 0; r < QUANT_ROWS; r++) acc[r][0] = acc[r][1] = _mm256_setzero_si256();
+	for (int k = 0; k < stride; k += QUANT_LANES) {
+		const int8_t* step = weights + k * QUANT_CHANNELS;
+		__m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(step));
+		__m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(step + 32));
+		for (int r = 0; r < QUANT_ROWS; r++) {
+			int32_t four;
+			std::memcpy(&four, rows[r] + k, sizeof(four));
+			__m256i a = _mm256_set1_epi32(four);
+			acc[r][0] = multiply_add(acc[r][0], a, b0);
+			acc[r][1] = multiply_add(acc[r][1], a, b1);
+		}
+	}
+	for (int r = 0; r < QUANT_ROWS; r++) {
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(sums + r * sums_stride), acc[r][0]);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(sums + r * sums_stride + 8), acc[r][1]);
+	}
+#else
+	for (int r = 0; r < QUANT_ROWS; r++) {
+		for (int c = 0; c < QUANT_CHANNELS; c++) {
+			int32_t sum = 0;
+			for (int k = 0; k < stride; k += QUANT_LANES)
+				for (int t = 0; t < QUANT_LANES; t++)
+					sum += static_cast<int32_t>(rows[r][k + t]) * weights[k * QUANT_CHANNELS + c * QUANT_LANES + t];
+			sums[r * sums_stride + c] = sum;
+		}
+	}
+#endif
+}
+
+QuantizedNetwork::QuantizedNetwork(Network& net, int calibration_rows)
+{
+	Expects(net.length > 1 && calibration_rows > 0);
+	Eigen::MatrixXf sample;
+	Eigen::MatrixXf labels;
+	if (net.validation_rows(calibration_rows, sample, labels) == 0)
+		throw std::runtime_error{"QuantizedNetwork needs at least a batch of validation data to calibrate on."};
+	input_activation = net.layers[0].activation;
+	input_array_activation = net.layers[0].array_activation ? net.layers[0].array_activation : vectorized(input_activation);
+	Eigen::MatrixXf current = sample.unaryExpr(input_activation);
+	for (int i = 0; i < net.length-1; i++) {
+		const Eigen::MatrixXf& w = net.layers[i].weights;
+		float range = current.cwiseAbs().maxCoeff();
+		layers.emplace_back();
+		QuantizedLayer& layer = layers.back();
+		layer.inputs = w.rows();
+		layer.outputs = w.cols();
+		layer.stride = round_up(w.rows(), QUANT_LANES);
+		layer.input_scale = range > 0 ? range / 127 : 1;
+		layer.weights.assign(round_up(w.cols(), QUANT_CHANNELS) * layer.stride, 0);
+		layer.scales.resize(w.cols());
+		layer.offsets.resize(w.cols());
+		widest = std::max(widest, round_up(w.cols(), QUANT_CHANNELS));
+		layer.bias = net.layers[i+1].bias.colwise().mean();
+		layer.activation = net.layers[i+1].activation;
+		layer.array_activation = net.layers[i+1].array_activation ? net.layers[i+1].array_activation : vectorized(layer.activation);
+		for (int j = 0; j < w.cols(); j++) {
+			float largest = w.col(j).cwiseAbs().maxCoeff();
+			float scale = largest > 0 ? largest / 127 : 1;
+			int32_t sum = 0;
+			for (int k = 0; k < w.rows(); k++) {
+				int q = std::clamp(static_cast<int>(std::nearbyint(w(k, j) / scale)), -127, 127);
+				int group = j / QUANT_CHANNELS * QUANT_CHANNELS * layer.stride;
+				layer.weights[group + k / QUANT_LANES * QUANT_LANES * QUANT_CHANNELS + j % QUANT_CHANNELS * QUANT_LANES + k % QUANT_LANES] = q;
+				sum += q;
+			}
+			layer.scales(j) = layer.input_scale * scale;
+			layer.offsets(j) = 128 * sum;
+		}
+		current = ((current * w).rowwise() + layer.bias).unaryExpr(layer.activation);
+	}
+	buffers.resize(layers.size());
+}
+
+// Like a Predictor, the input layer's activation is applied too and the output goes through softmax.
+void QuantizedNetwork::run(const Eigen::Ref<const Eigen::MatrixXf>& input)
+{
+	Expects(input.cols() == inputs());
+	const int rows = input.rows();
+	for (size_t i = 0; i < layers.size(); i++) {
+		size_t needed = static_cast<size_t>(rows) * layers[i].stride;
+		if (buffers[i].size() < needed) buffers[i].resize(needed, 128);
+	}
+	if (output.rows() < rows || output.cols() != outputs()) output.resize(rows, outputs());
+	if (sums.cols() < widest) sums.resize(QUANT_TILE, widest);
+	values.resize(QUANT_TILE * std::max(widest, inputs()));
+	const QuantizedLayer& first = layers.front();
+	for (int tile = 0; tile < rows; tile += QUANT_TILE) {
+		const int count = std::min(QUANT_TILE, rows - tile);
+		Eigen::Map<RowMatrixXf> block (values.data(), count, first.inputs);
+		block = input.middleRows(tile, count);
+		activate(input_array_activation, input_activation, block);
+		quantize(block, first.input_scale, buffers[0].data() + tile * first.stride, first.stride);
+	}
+	for (size_t i = 0; i < layers.size(); i++) {
+		const QuantizedLayer& layer = layers[i];
+		const QuantizedLayer* next = i+1 < layers.size() ? &layers[i+1] : nullptr;
+		// A tile's activations stay in cache while every group of channels passes over them; its sums
+		// are then finished all at once, while they are still in cache too. Past the tile's last row,
+		// the kernel sums that row again, into rows of sums that are never read.
+		for (int tile = 0; tile < rows; tile += QUANT_TILE) {
+			const int count = std::min(QUANT_TILE, rows - tile);
+			for (int j = 0; j < layer.outputs; j += QUANT_CHANNELS) {
+				const int8_t* weights = layer.weights.data() + j * layer.stride;
+				for (int r = 0; r < count; r += QUANT_ROWS) {
+					const uint8_t* group[QUANT_ROWS];
+					for (int g = 0; g < QUANT_ROWS; g++)
+						group[g] = buffers[i].data() + (tile + std::min(r + g, count - 1)) * layer.stride;
+					dot_group(group, weights, layer.stride, &sums(r, j), sums.cols());
+				}
+			}
+			Eigen::Map<RowMatrixXf> block (values.data(), count, layer.outputs);
+			for (int r = 0; r < count; r++)
+				block.row(r) = (sums.row(r).head(layer.outputs) - layer.offsets).cast<float>().cwiseProduct(layer.scales) + layer.bias;
+			activate(layer.array_activation, layer.activation, block);
+			if (next) quantize(block, next->input_scale, buffers[i+1].data() + tile * next->stride, next->stride);
+			else output.middleRows(tile, count) = block;
+		}
+	}
+	auto out = output.topRows(rows);
+	Eigen::VectorXf max = out.rowwise().maxCoeff();
+	out = (out.colwise() - max).array().exp().matrix();
+	Eigen::VectorXf sum = out.rowwise().sum();
+	out.array().colwise() /= sum.array();
+}
+
+Eigen::MatrixXf QuantizedNetwork::predict(const Eigen::Ref<const Eigen::MatrixXf>& input)
+{
+	run(input);
+	return output.topRows(input.rows());
+}
+
+QuantizationReport QuantizedNetwork::compare(Network& net)
+{
+	QuantizationReport report {0, 0, 0, 0, 0, 0, 0, bytes()};
+	for (int i = 0; i < net.length-1; i++)
+		report.fp32_bytes += (net.layers[i].weights.size() + net.layers[i].weights.cols()) * sizeof(float);
+	Eigen::MatrixXf features;
+	Eigen::MatrixXf labels;
+	report.samples = net.validation_rows(std::max(net.val_instances, 1), features, labels);
+	if (report.samples == 0) return report;
+	Predictor reference (net);
+	Eigen::MatrixXf expected = reference.predict(features);
+	Eigen::MatrixXf actual = predict(features);
+	for (int r = 0; r < report.samples; r++) {
+		Eigen::Index fp32_class;
+		Eigen::Index int8_class;
+		expected.row(r).maxCoeff(&fp32_class);
+		actual.row(r).maxCoeff(&int8_class);
+		report.fp32_acc += fp32_class == labels(r, 0);
+		report.int8_acc += int8_class == labels(r, 0);
+		report.agreement += fp32_class == int8_class;
+	}
+	report.fp32_acc /= report.samples;
+	report.int8_acc /= report.samples;
+	report.agreement /= report.samples;
+	Eigen::MatrixXf delta = (expected - actual).cwiseAbs();
+	report.max_delta = delta.maxCoeff();
+	report.mean_delta = delta.mean();
+	return report;
+}
+
+size_t QuantizedNetwork::bytes() const
+{
+	size_t total = 0;
+	for (const QuantizedLayer& layer : layers)
+		total += layer.weights.size() + (layer.scales.size() + layer.offsets.size() + layer.bias.size()) * 4;
+	return total;
+}
+}
@@ -0,0 +1,78 @@
+//
+//  quantize.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <cstdint>
+
+#include "bpnn.hpp"
+
+namespace Jacobian {
+#define QUANT_LANES 4 // Rows of int8 values are padded to a multiple of this, the inputs one kernel step takes.
+#define QUANT_CHANNELS 16 // Output channels one kernel call sums; a layer's are padded to a multiple of this.
+#define QUANT_ROWS 4 // Rows one kernel call sums at once.
+#define QUANT_TILE 32 // Rows whose activations are kept in cache while a layer's weights stream past.
+
+// How the int8 model compares with the fp32 one (a Predictor over the same network) on the
+// validation set. Deltas are on the output probabilities; bytes count weights, scales and biases.
+struct QuantizationReport {
+	int samples;
+	float fp32_acc;
+	float int8_acc;
+	float agreement; // Fraction of samples for which both predict the same class.
+	float max_delta;
+	float mean_delta;
+	size_t fp32_bytes;
+	size_t int8_bytes;
+};
+
+// Post-training int8 inference. Each layer's weights are quantized symmetrically per output channel,
+// and the activations entering it per tensor, with a scale calibrated from the largest magnitude seen
+// on a sample of the validation set. Activations are stored unsigned with a zero point of 128 so the
+// products map onto VNNI's u8 x s8 dot product (or a pair of AVX2 multiply-adds, split so they can't
+// saturate); the zero point is folded out using each channel's precomputed weight sum. Weights are
+// packed so that every int32 lane of the kernel accumulates one channel's whole sum. A layer's epilogue dequantizes its int32
+// sums, adds the bias, applies the next activation and requantizes straight into the next layer's
+// input, a tile of rows at a time, so no fp32 activations exist between layers beyond one tile's.
+// Built-in activations run as the same vectorized kernels a Predictor uses, only custom ones one
+// value at a time. Like a Predictor, biases are averaged over rows, the buffers are reused, and an
+// instance must not be shared between threads.
+class QuantizedNetwork {
+	struct QuantizedLayer {
+		int inputs;
+		int outputs;
+		int stride; // inputs rounded up to QUANT_LANES.
+		float input_scale; // An input value is (q - 128) * input_scale.
+		// Groups of QUANT_CHANNELS channels, each holding, for every QUANT_LANES inputs in turn, those
+		// inputs' weights for each of its channels.
+		std::vector<int8_t> weights;
+		Eigen::RowVectorXf scales; // input_scale times each channel's weight scale.
+		Eigen::Matrix<int32_t, 1, Eigen::Dynamic> offsets; // 128 times each channel's weight sum.
+		Eigen::RowVectorXf bias;
+		std::function<float(float)> activation; // Of the layer this one leads into.
+		ArrayActivation array_activation; // The same over a whole block, if it can be vectorized.
+	};
+	std::function<float(float)> input_activation;
+	ArrayActivation input_array_activation;
+	std::vector<QuantizedLayer> layers;
+	std::vector<std::vector<uint8_t>> buffers; // Each layer's quantized input, a stride-long run per row.
+	Eigen::Matrix<int32_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> sums; // One tile's, before its epilogue.
+	std::vector<float> values; // One tile's inputs or dequantized outputs, row after row, for its activation to run over.
+	int widest = 0;
+	Eigen::MatrixXf output;
+	void run(const Eigen::Ref<const Eigen::MatrixXf>& input);
+public:
+	QuantizedNetwork(Network& net, int calibration_rows=256);
+	Eigen::MatrixXf predict(const Eigen::Ref<const Eigen::MatrixXf>& input);
+	QuantizationReport compare(Network& net);
+	size_t bytes() const;
+	int inputs() const {return layers.front().inputs;}
+	int outputs() const {return layers.back().outputs;}
+};
+}
+#endif /* QUANTIZE_H */
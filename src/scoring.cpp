@@ -0,0 +1,297 @@
+//
+//  scoring.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <map>
+#include <chrono>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <charconv>
+#include <algorithm>
+
+#include "scoring.hpp"
+
+namespace Jacobian {
+BatchScorer::BatchScorer(const Network& net, int threads, int batch, int queue_depth)
+	:batch_rows(batch), depth(queue_depth)
+{
+	Expects(threads > 0 && batch > 0 && queue_depth > 0);
+	for (int i = 0; i < threads; i++) predictors.push_back(std::make_unique<Predictor>(net));
+}
+
+BatchScorer::BatchScorer(std::shared_ptr<const Checkpoint> model, int threads, int batch, int queue_depth)
+	:batch_rows(batch), depth(queue_depth)
+{
+	Expects(model && threads > 0 && batch > 0 && queue_depth > 0);
+	for (int i = 0; i < threads; i++) predictors.push_back(std::make_unique<Predictor>(model));
+}
+
+static bool ends_with(const std::string& text, const std::string& suffix)
+{
+	return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Reads until count bytes have arrived or the file ends; returns how many did.
+static size_t read_fully(int fd, char* data, size_t count)
+{
+	size_t done = 0;
+	while (done < count) {
+		ssize_t got = read(fd, data + done, count - done);
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0) throw std::runtime_error{"BatchScorer could not read its input."};
+		if (got == 0) break;
+		done += got;
+	}
+	return done;
+}
+
+static void write_fully(int fd, const char* data, size_t count)
+{
+	size_t done = 0;
+	while (done < count) {
+		ssize_t put = write(fd, data + done, count - done);
+		if (put < 0 && errno == EINTR) continue;
+		if (put < 0) throw std::runtime_error{"BatchScorer could not write its output."};
+		done += put;
+	}
+}
+
+// Parses the batch's lines into its features, growing them if there are more lines than batch_rows,
+// and returns how many rows there were. Blank lines are skipped.
+int BatchScorer::parse(Batch& batch) const
+{
+	if (batch.features.cols() != inputs()) batch.features.resize(batch_rows, inputs());
+	const char* p = batch.text.data();
+	const char* end = p + batch.text.size();
+	int rows = 0;
+	auto blank = [](char c) {return c == ' ' || c == '\t' || c == '\r';};
+	while (p < end) {
+		const char* line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+		if (!line_end) line_end = end;
+		const char* q = p;
+		while (q < line_end && blank(*q)) q++;
+		p = line_end + 1;
+		if (q == line_end) continue;
+		if (rows == batch.features.rows()) batch.features.conservativeResize(2 * rows, Eigen::NoChange);
+		int column = 0;
+		while (true) {
+			while (q < line_end && blank(*q)) q++;
+			float value;
+			auto [next, error] = std::from_chars(q, line_end, value);
+			if (error != std::errc()) throw std::runtime_error{"BatchScorer couldn't parse a CSV value."};
+			if (column < inputs()) batch.features(rows, column) = value;
+			column++;
+			q = next;
+			while (q < line_end && blank(*q)) q++;
+			if (q == line_end) break;
+			if (*q++ != ',') throw std::runtime_error{"BatchScorer couldn't parse a CSV value."};
+		}
+		if (column != inputs() && column != inputs() + 1)
+			throw std::runtime_error{"A CSV line doesn't have the model's number of features."};
+		rows++;
+	}
+	return rows;
+}
+
+void BatchScorer::format(Batch& batch, const RowMatrixXf& probabilities, ScoreOutput kind, bool binary) const
+{
+	const int rows = batch.rows;
+	if (binary && kind == ScoreOutput::probabilities) {
+		batch.out.resize(probabilities.size() * sizeof(float));
+		std::memcpy(batch.out.data(), probabilities.data(), batch.out.size());
+		return;
+	}
+	if (binary) {
+		batch.out.resize(rows * sizeof(int32_t));
+		for (int i = 0; i < rows; i++) {
+			Eigen::Index best;
+			probabilities.row(i).maxCoeff(&best);
+			int32_t index = best;
+			std::memcpy(batch.out.data() + i * sizeof(int32_t), &index, sizeof(index));
+		}
+		return;
+	}
+	// Shortest round-tripping text, which never takes more than 16 characters per float.
+	batch.out.resize(static_cast<size_t>(rows) * (kind == ScoreOutput::argmax ? 12 : 17 * outputs()));
+	char* o = batch.out.data();
+	char* const end = o + batch.out.size();
+	for (int i = 0; i < rows; i++) {
+		if (kind == ScoreOutput::argmax) {
+			Eigen::Index best;
+			probabilities.row(i).maxCoeff(&best);
+			o = std::to_chars(o, end, static_cast<int>(best)).ptr;
+		}
+		else {
+			for (int j = 0; j < outputs(); j++) {
+				if (j > 0) *o++ = ',';
+				o = std::to_chars(o, end, probabilities(i, j)).ptr;
+			}
+		}
+		*o++ = '\n';
+	}
+	batch.out.resize(o - batch.out.data());
+}
+
+ScoringReport BatchScorer::score(const std::string& input, const std::string& output, ScoreOutput kind)
+{
+	typedef std::chrono::steady_clock Clock;
+	auto since = [](Clock::time_point start) {return std::chrono::duration<double>(Clock::now() - start).count();};
+	const bool binary_in = ends_with(input, ".bin");
+	const bool binary_out = ends_with(output, ".bin");
+	const int width = inputs() + 1;
+	const int threads = predictors.size();
+	int in = open(input.c_str(), O_RDONLY);
+	if (in < 0) throw std::runtime_error{"BatchScorer could not open its input."};
+	const std::string temporary = output + ".tmp";
+	int out = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		close(in);
+		throw std::runtime_error{"BatchScorer could not create its output."};
+	}
+
+	// Every batch in flight comes from a fixed set: enough to fill both queues and keep every thread busy.
+	const int slots = 2 * depth + threads + 2;
+	BoundedQueue<std::unique_ptr<Batch>> spare (slots);
+	BoundedQueue<std::unique_ptr<Batch>> filled (depth);
+	BoundedQueue<std::unique_ptr<Batch>> scored (depth);
+	for (int i = 0; i < slots; i++) spare.push(std::make_unique<Batch>());
+	std::mutex error_lock;
+	std::exception_ptr error;
+	auto fail = [&] {
+		std::lock_guard<std::mutex> guard (error_lock);
+		if (!error) error = std::current_exception();
+		spare.close();
+		filled.close();
+		scored.close();
+	};
+	ScoringReport report {0, 0, 0, 0, 0, 0, 0};
+	std::vector<double> compute_busy (threads, 0);
+	const Clock::time_point start = Clock::now();
+
+	std::thread reader ([&] {
+		try {
+			size_t sequence = 0;
+			std::vector<char> carry; // The start of a line the last block cut off.
+			bool first = true;
+			bool done = false;
+			std::unique_ptr<Batch> batch;
+			while (!done && spare.pop(batch)) {
+				Clock::time_point begin = Clock::now();
+				batch->sequence = sequence;
+				if (binary_in) {
+					batch->features.resize(batch_rows, width);
+					const size_t want = static_cast<size_t>(batch_rows) * width * sizeof(float);
+					const size_t got = read_fully(in, reinterpret_cast<char*>(batch->features.data()), want);
+					if (got % (width * sizeof(float)) != 0) throw std::runtime_error{"The binary input ends partway through a row."};
+					batch->rows = got / (width * sizeof(float));
+					done = got < want;
+				}
+				else {
+					std::vector<char>& text = batch->text;
+					text.assign(carry.begin(), carry.end());
+					const size_t old = text.size();
+					text.resize(old + SCORING_BLOCK);
+					const size_t got = read_fully(in, text.data() + old, SCORING_BLOCK);
+					text.resize(old + got);
+					done = got < SCORING_BLOCK;
+					if (first && !text.empty()) {
+						// A header, if the file starts with one, is a line beginning with a name.
+						auto head = std::find_if(text.begin(), text.end(), [](char c) {return !std::isspace(static_cast<unsigned char>(c));});
+						if (head != text.end() && (std::isalpha(static_cast<unsigned char>(*head)) || *head == '"')) {
+							auto newline = std::find(head, text.end(), '\n');
+							text.erase(text.begin(), newline == text.end() ? newline : newline + 1);
+						}
+						first = false;
+					}
+					carry.clear();
+					if (!done) {
+						auto newline = std::find(text.rbegin(), text.rend(), '\n').base();
+						carry.assign(newline, text.end());
+						text.erase(newline, text.end());
+					}
+					batch->rows = 0;
+				}
+				report.read_busy += since(begin);
+				if (binary_in ? batch->rows == 0 : batch->text.empty()) {
+					spare.push(std::move(batch));
+					continue;
+				}
+				if (!filled.push(std::move(batch))) break;
+				sequence++;
+			}
+			filled.close();
+		}
+		catch (...) {
+			fail();
+		}
+	});
+
+	std::vector<std::thread> computers;
+	for (int t = 0; t < threads; t++) {
+		computers.emplace_back([&, t] {
+			try {
+				Predictor& predictor = *predictors[t];
+				RowMatrixXf probabilities;
+				std::unique_ptr<Batch> batch;
+				while (filled.pop(batch)) {
+					Clock::time_point begin = Clock::now();
+					if (!binary_in) batch->rows = parse(*batch);
+					probabilities.resize(batch->rows, outputs());
+					if (batch->rows > 0) predictor.predict_rows(batch->features.topLeftCorner(batch->rows, inputs()), probabilities);
+					format(*batch, probabilities, kind, binary_out);
+					compute_busy[t] += since(begin);
+					if (!scored.push(std::move(batch))) break;
+				}
+			}
+			catch (...) {
+				fail();
+			}
+		});
+	}
+
+	std::thread writer ([&] {
+		try {
+			std::map<size_t, std::unique_ptr<Batch>> waiting; // Batches that overtook an earlier one.
+			size_t next = 0;
+			std::unique_ptr<Batch> batch;
+			while (scored.pop(batch)) {
+				waiting.emplace(batch->sequence, std::move(batch));
+				while (!waiting.empty() && waiting.begin()->first == next) {
+					Clock::time_point begin = Clock::now();
+					Batch& ready = *waiting.begin()->second;
+					write_fully(out, ready.out.data(), ready.out.size());
+					report.rows += ready.rows;
+					report.batches++;
+					report.write_busy += since(begin);
+					spare.push(std::move(waiting.begin()->second));
+					waiting.erase(waiting.begin());
+					next++;
+				}
+			}
+		}
+		catch (...) {
+			fail();
+		}
+	});
+
+	reader.join();
+	for (std::thread& computer : computers) computer.join();
+	scored.close();
+	writer.join();
+	close(in);
+	if (close(out) != 0 && !error) error = std::make_exception_ptr(std::runtime_error{"BatchScorer could not write its output."});
+	if (error) {
+		unlink(temporary.c_str());
+		std::rethrow_exception(error);
+	}
+	if (rename(temporary.c_str(), output.c_str()) != 0) throw std::runtime_error{"BatchScorer could not rename its output into place."};
+	report.seconds = since(start);
+	report.rows_per_second = report.rows / report.seconds;
+	for (double busy : compute_busy) report.compute_busy += busy;
+	return report;
+}
+}
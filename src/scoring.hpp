@@ -0,0 +1,105 @@
+//
+//  scoring.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef SCORING_H
+#define SCORING_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include "bpnn.hpp"
+#include "predictor.hpp"
+
+namespace Jacobian {
+#define SCORING_BLOCK (1 << 20) // Bytes of CSV the reader hands on at a time (whole lines, so a little less).
+
+// Busy times are how long each stage spent working rather than waiting on its queues, in seconds
+// (summed over the compute threads). Whichever stage's is closest to seconds is the bottleneck.
+struct ScoringReport {
+	size_t rows;
+	size_t batches;
+	double seconds;
+	double rows_per_second;
+	double read_busy;
+	double compute_busy;
+	double write_busy;
+};
+
+enum class ScoreOutput {probabilities, argmax};
+
+// A FIFO whose push() blocks while it's full, so a fast stage can't run arbitrarily far ahead of a
+// slow one. Once closed, push() refuses and pop() fails as soon as what's left has been taken.
+template <typename T>
+class BoundedQueue {
+	std::deque<T> items;
+	size_t capacity;
+	bool closed = false;
+	std::mutex lock;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+public:
+	BoundedQueue(size_t max_items) :capacity(max_items) {}
+	bool push(T item)
+	{
+		std::unique_lock<std::mutex> guard (lock);
+		not_full.wait(guard, [this] {return closed || items.size() < capacity;});
+		if (closed) return false;
+		items.push_back(std::move(item));
+		not_empty.notify_one();
+		return true;
+	}
+	bool pop(T& item)
+	{
+		std::unique_lock<std::mutex> guard (lock);
+		not_empty.wait(guard, [this] {return closed || !items.empty();});
+		if (items.empty()) return false;
+		item = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+	void close()
+	{
+		std::lock_guard<std::mutex> guard (lock);
+		closed = true;
+		not_empty.notify_all();
+		not_full.notify_all();
+	}
+};
+
+// Offline scoring of a file of any size as a three-stage pipeline: one thread reads, the compute
+// threads parse and predict (each with its own Predictor) and format their results, and one thread
+// writes them out in the input's order. Stages hand batches on through bounded queues, and batches
+// are recycled, so memory stays fixed however large the file is. Input ending in .bin is prep()'s
+// binary layout (features then a label, which is ignored); anything else is CSV with either the
+// features or the features and a label on each line, after an optional header. Output ending in
+// .bin is float32 probabilities or int32 classes, row after row; anything else is CSV. The output
+// is written under a temporary name and renamed once complete.
+class BatchScorer {
+	struct Batch {
+		size_t sequence;
+		int rows;
+		std::vector<char> text; // CSV input, whole lines only.
+		RowMatrixXf features; // Read straight in from binary input, or parsed from text.
+		std::vector<char> out; // Formatted results, ready to be written.
+	};
+	std::vector<std::unique_ptr<Predictor>> predictors; // One per compute thread.
+	int batch_rows;
+	int depth;
+	int inputs() const {return predictors.front()->inputs();}
+	int outputs() const {return predictors.front()->outputs();}
+	int parse(Batch& batch) const;
+	void format(Batch& batch, const RowMatrixXf& probabilities, ScoreOutput format, bool binary) const;
+public:
+	// The network mustn't train while it's being scored with.
+	BatchScorer(const Network& net, int threads, int batch=4096, int queue_depth=4);
+	BatchScorer(std::shared_ptr<const Checkpoint> model, int threads, int batch=4096, int queue_depth=4);
+	ScoringReport score(const std::string& input, const std::string& output, ScoreOutput format=ScoreOutput::probabilities);
+};
+}
+#endif /* SCORING_H */
@@ -0,0 +1,307 @@
+//
+//  server.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#include "server.hpp"
+
+namespace Jacobian {
+inline bool send_all(int fd, const char* bytes, size_t count)
+{
+	while (count > 0) {
+		ssize_t sent = send(fd, bytes, count, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) return false;
+		bytes += sent;
+		count -= sent;
+	}
+	return true;
+}
+
+inline bool recv_all(int fd, char* bytes, size_t count)
+{
+	while (count > 0) {
+		ssize_t got = recv(fd, bytes, count, 0);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) return false;
+		bytes += got;
+		count -= got;
+	}
+	return true;
+}
+
+inline sockaddr_un socket_address(const std::string& path)
+{
+	sockaddr_un address {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) throw std::runtime_error{"Socket path is too long."};
+	std::strcpy(address.sun_path, path.c_str());
+	return address;
+}
+
+// Sends as much of the outbox as the socket takes without blocking, and says whether any is left.
+// A client that has gone away just misses its replies. Call with write_lock held.
+bool InferenceServer::Connection::flush()
+{
+	size_t sent = 0;
+	while (sent < outbox.size()) {
+		ssize_t count = send(fd, outbox.data() + sent, outbox.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (count < 0 && errno == EINTR) continue;
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (count <= 0) {
+			sent = outbox.size();
+			break;
+		}
+		sent += count;
+	}
+	outbox.erase(outbox.begin(), outbox.begin() + sent);
+	return !outbox.empty();
+}
+
+// batch is the most requests one forward pass takes; by default (0) the network's batch size.
+InferenceServer::InferenceServer(Network& network, const std::string& socket_path, int threads, int batch, int deadline_us)
+	:net(network), path(socket_path), max_batch(batch > 0 ? batch : network.batch_size), deadline(deadline_us)
+{
+	Expects(threads > 0 && net.length > 1 && deadline_us >= 0);
+	sockaddr_un address = socket_address(path);
+	unlink(path.c_str());
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+		listen(listener, SOMAXCONN) != 0) {
+		if (listener >= 0) close(listener);
+		throw std::runtime_error{"InferenceServer could not listen on its socket."};
+	}
+	if (pipe(wake) != 0) {
+		close(listener);
+		unlink(path.c_str());
+		throw std::runtime_error{"InferenceServer could not create its wake-up pipe."};
+	}
+	// A full pipe already has the I/O thread's attention, so writers needn't wait on it.
+	for (int end : wake) fcntl(end, F_SETFL, fcntl(end, F_GETFL) | O_NONBLOCK);
+	io = std::thread(&InferenceServer::read_requests, this);
+	for (int t = 0; t < threads; t++) batchers.emplace_back(&InferenceServer::serve_batches, this);
+}
+
+InferenceServer::~InferenceServer()
+{
+	stop();
+}
+
+// Stops accepting, drops whatever is still queued and waits for the batches in flight.
+void InferenceServer::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard (queue_lock);
+		if (stopping) return;
+		stopping = true;
+	}
+	arrived.notify_all();
+	write(wake[1], "x", 1);
+	io.join();
+	for (std::thread& batcher : batchers) batcher.join();
+	queue.clear();
+	close(listener);
+	close(wake[0]);
+	close(wake[1]);
+	unlink(path.c_str());
+}
+
+void InferenceServer::read_requests()
+{
+	const int features = net.layers[0].contents.cols();
+	const size_t request_bytes = sizeof(uint32_t) + features * sizeof(float);
+	std::vector<std::shared_ptr<Connection>> open;
+	std::vector<char> chunk (64 * 1024);
+	while (true) {
+		// A client that has stopped sending is let go once its replies are written (or it leaves).
+		// Batching threads may still hold it, to reply to requests of its that are still queued.
+		open.erase(std::remove_if(open.begin(), open.end(), [](const std::shared_ptr<Connection>& connection) {
+			std::lock_guard<std::mutex> guard (connection->write_lock);
+			return !connection->reading && connection->outbox.empty();
+		}), open.end());
+		std::vector<pollfd> fds {{wake[0], POLLIN, 0}, {listener, POLLIN, 0}};
+		for (const std::shared_ptr<Connection>& connection : open) {
+			std::lock_guard<std::mutex> guard (connection->write_lock);
+			short events = (connection->reading ? POLLIN : 0) | (connection->outbox.empty() ? 0 : POLLOUT);
+			fds.push_back({connection->fd, events, 0});
+		}
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		if (fds[0].revents) {
+			while (read(wake[0], chunk.data(), chunk.size()) > 0);
+			std::lock_guard<std::mutex> guard (queue_lock);
+			if (stopping) return;
+		}
+		if (fds[1].revents & POLLIN) {
+			int fd = accept(listener, nullptr, nullptr);
+			if (fd >= 0) {
+				open.push_back(std::make_shared<Connection>());
+				open.back()->fd = fd;
+			}
+		}
+		std::vector<Request> incoming;
+		auto now = std::chrono::steady_clock::now();
+		for (size_t i = 2; i < fds.size(); i++) {
+			if (!fds[i].revents) continue;
+			Connection& connection = *open[i-2];
+			if ((fds[i].revents & POLLOUT) || !connection.reading) {
+				std::lock_guard<std::mutex> guard (connection.write_lock);
+				connection.flush();
+			}
+			if (!connection.reading || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+			ssize_t got = recv(connection.fd, chunk.data(), chunk.size(), MSG_DONTWAIT);
+			if (got < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+			if (got <= 0) {
+				connection.reading = false;
+				if (got == 0) continue;
+				std::lock_guard<std::mutex> guard (connection.write_lock);
+				connection.outbox.clear(); // Broken, so nothing more will get through.
+				continue;
+			}
+			connection.partial.insert(connection.partial.end(), chunk.begin(), chunk.begin() + got);
+			size_t used = 0;
+			for (; connection.partial.size() - used >= request_bytes; used += request_bytes) {
+				Request request {open[i-2], 0, std::vector<float>(features), now};
+				std::memcpy(&request.id, connection.partial.data() + used, sizeof(uint32_t));
+				std::memcpy(request.features.data(), connection.partial.data() + used + sizeof(uint32_t), features * sizeof(float));
+				incoming.push_back(std::move(request));
+			}
+			connection.partial.erase(connection.partial.begin(), connection.partial.begin() + used);
+		}
+		if (incoming.empty()) continue;
+		{
+			std::lock_guard<std::mutex> guard (queue_lock);
+			for (Request& request : incoming) queue.push_back(std::move(request));
+		}
+		arrived.notify_all();
+	}
+}
+
+// A batch closes as soon as it is full or its oldest request is due; until then, more may join it.
+void InferenceServer::serve_batches()
+{
+	Predictor predictor (net);
+	Eigen::MatrixXf input (max_batch, predictor.inputs());
+	std::vector<Request> batch;
+	std::unique_lock<std::mutex> guard (queue_lock);
+	while (!stopping) {
+		if (queue.empty()) {
+			arrived.wait(guard);
+			continue;
+		}
+		auto due = queue.front().arrival + deadline;
+		if (static_cast<int>(queue.size()) < max_batch && std::chrono::steady_clock::now() < due) {
+			arrived.wait_until(guard, due);
+			continue;
+		}
+		batch.clear();
+		while (!queue.empty() && static_cast<int>(batch.size()) < max_batch) {
+			batch.push_back(std::move(queue.front()));
+			queue.pop_front();
+		}
+		guard.unlock();
+		answer(batch, predictor, input);
+		guard.lock();
+	}
+}
+
+void InferenceServer::answer(std::vector<Request>& batch, Predictor& predictor, Eigen::MatrixXf& input)
+{
+	const int rows = batch.size();
+	for (int j = 0; j < rows; j++)
+		input.row(j) = Eigen::Map<const Eigen::RowVectorXf>(batch[j].features.data(), batch[j].features.size());
+	Eigen::MatrixXf out = predictor.predict(input.topRows(rows));
+	std::vector<char> reply (sizeof(uint32_t) + out.cols() * sizeof(float));
+	std::vector<double> waited;
+	bool backlogged = false;
+	for (int j = 0; j < rows; j++) {
+		std::memcpy(reply.data(), &batch[j].id, sizeof(uint32_t));
+		for (int k = 0; k < out.cols(); k++) {
+			float value = out(j, k);
+			std::memcpy(reply.data() + sizeof(uint32_t) + k * sizeof(float), &value, sizeof(float));
+		}
+		{
+			Connection& to = *batch[j].from;
+			std::lock_guard<std::mutex> guard (to.write_lock);
+			to.outbox.insert(to.outbox.end(), reply.begin(), reply.end());
+			backlogged |= to.flush();
+		}
+		std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - batch[j].arrival;
+		waited.push_back(latency.count());
+	}
+	if (backlogged) write(wake[1], "x", 1); // So the I/O thread starts watching for the sockets to drain.
+	batch.clear(); // Drops the connections' references on this thread, not the next time round.
+	std::lock_guard<std::mutex> guard (stats_lock);
+	latencies.insert(latencies.end(), waited.begin(), waited.end());
+	batch_count++;
+}
+
+// Nearest-rank percentiles over every request served so far.
+LatencyReport InferenceServer::report()
+{
+	std::vector<double> sorted;
+	LatencyReport result {0, 0, 0, 0, 0, 0, 0};
+	{
+		std::lock_guard<std::mutex> guard (stats_lock);
+		sorted = latencies;
+		result.batches = batch_count;
+	}
+	result.requests = sorted.size();
+	if (sorted.empty()) return result;
+	std::sort(sorted.begin(), sorted.end());
+	auto percentile = [&sorted](double q) {
+		size_t rank = std::ceil(q * sorted.size());
+		return sorted[std::max<size_t>(rank, 1) - 1];
+	};
+	result.mean_batch = static_cast<float>(result.requests) / result.batches;
+	result.p50 = percentile(0.50);
+	result.p95 = percentile(0.95);
+	result.p99 = percentile(0.99);
+	result.max = sorted.back();
+	return result;
+}
+
+InferenceClient::InferenceClient(const std::string& socket_path)
+{
+	sockaddr_un address = socket_address(socket_path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+		if (fd >= 0) close(fd);
+		throw std::runtime_error{"InferenceClient could not connect to the server."};
+	}
+}
+
+InferenceClient::~InferenceClient()
+{
+	close(fd);
+}
+
+std::vector<float> InferenceClient::predict(const std::vector<float>& features, int outputs)
+{
+	uint32_t id = next_id++;
+	std::vector<char> request (sizeof(uint32_t) + features.size() * sizeof(float));
+	std::memcpy(request.data(), &id, sizeof(uint32_t));
+	std::memcpy(request.data() + sizeof(uint32_t), features.data(), features.size() * sizeof(float));
+	if (!send_all(fd, request.data(), request.size()))
+		throw std::runtime_error{"InferenceClient lost the server while sending."};
+	uint32_t answered;
+	std::vector<float> result (outputs);
+	if (!recv_all(fd, reinterpret_cast<char*>(&answered), sizeof(uint32_t)) ||
+		!recv_all(fd, reinterpret_cast<char*>(result.data()), outputs * sizeof(float)))
+		throw std::runtime_error{"InferenceClient lost the server while waiting for a reply."};
+	Ensures(answered == id);
+	return result;
+}
+}
@@ -0,0 +1,90 @@
+//
+//  server.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <deque>
+#include <chrono>
+#include <cstdint>
+
+#include "bpnn.hpp"
+#include "predictor.hpp"
+
+namespace Jacobian {
+// Latencies are in microseconds, from a request being read off its socket to its result being written
+// (or queued behind earlier replies to a client that is slow to read them).
+struct LatencyReport {
+	size_t requests;
+	size_t batches;
+	float mean_batch;
+	double p50;
+	double p95;
+	double p99;
+	double max;
+};
+
+// Serves a trained network over a Unix domain socket. A request is a uint32 id followed by one
+// sample's features (floats, host order); the reply is the same id followed by the output layer.
+// Clients may pipeline requests on a connection and replies can come back out of order, hence the
+// id. One I/O thread reads every connection and queues requests; each of the batching threads takes
+// whatever is queued, up to max_batch, once the batch is full or its oldest request has waited
+// deadline, and answers them all with one Predictor pass. The network mustn't train meanwhile.
+// Replies never block a batching thread: what a client's socket won't take right away waits in its
+// connection's outbox, and the I/O thread writes it once the socket drains.
+class InferenceServer {
+	struct Connection {
+		int fd;
+		std::mutex write_lock; // Guards outbox.
+		std::vector<char> outbox; // Reply bytes the socket hasn't taken yet.
+		std::vector<char> partial; // Bytes of a request still being read. Only the I/O thread touches this.
+		bool reading = true; // Until the client stops sending. Only the I/O thread touches this either.
+		bool flush();
+		~Connection() {close(fd);}
+	};
+	struct Request {
+		std::shared_ptr<Connection> from;
+		uint32_t id;
+		std::vector<float> features;
+		std::chrono::steady_clock::time_point arrival;
+	};
+	Network& net;
+	std::string path;
+	int max_batch;
+	std::chrono::microseconds deadline;
+	int listener;
+	int wake[2]; // Pipe that stop() and batchers with replies left over write to, to get the I/O thread out of poll().
+	std::thread io;
+	std::vector<std::thread> batchers;
+	std::deque<Request> queue;
+	std::mutex queue_lock;
+	std::condition_variable arrived;
+	bool stopping = false;
+	std::mutex stats_lock;
+	std::vector<double> latencies;
+	size_t batch_count = 0;
+	void read_requests();
+	void serve_batches();
+	void answer(std::vector<Request>& batch, Predictor& predictor, Eigen::MatrixXf& input);
+public:
+	InferenceServer(Network& network, const std::string& socket_path, int threads, int batch=0, int deadline_us=1000);
+	~InferenceServer();
+	void stop();
+	LatencyReport report();
+};
+
+// A blocking client for the protocol above, one request in flight at a time.
+class InferenceClient {
+	int fd;
+	uint32_t next_id = 0;
+public:
+	InferenceClient(const std::string& socket_path);
+	~InferenceClient();
+	std::vector<float> predict(const std::vector<float>& features, int outputs);
+};
+}
+#endif /* SERVER_H */
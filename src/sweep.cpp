@@ -0,0 +1,119 @@
+//
+//  sweep.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <algorithm>
+#include <chrono>
+
+#include "sweep.hpp"
+
+namespace Jacobian {
+Sweep::Sweep(std::shared_ptr<Dataset> data, int threads, int patience_epochs)
+	:dataset(data), pool(std::make_shared<ThreadPool>(threads)), patience(patience_epochs)
+{
+	Expects(dataset && patience > 0);
+}
+
+int Sweep::add(const TrialConfig& config)
+{
+	Expects(config.build);
+	auto net = std::make_unique<Network>(dataset, config.batch_size, config.learning_rate, config.bias_rate,
+										 config.regularization, config.lambda, config.early_exit, config.cutoff);
+	net->silenced = true;
+	config.build(*net);
+	net->initialize();
+	int id = trials.size();
+	trials.push_back({std::move(net), {id, true, false, false, 0, 0, 0, 0, 0, INFINITY}, 0, 0, 0});
+	return id;
+}
+
+void Sweep::run(int epochs)
+{
+	for (int e = 0; e < epochs; e++) {
+		std::vector<int> active;
+		for (Trial& trial : trials) {
+			if (!trial.result.running) continue;
+			trial.cost_sum = 0;
+			trial.acc_sum = 0;
+			active.push_back(trial.result.id);
+		}
+		if (active.empty()) return;
+		auto start = std::chrono::steady_clock::now();
+		for (int block = 0; block < dataset->train_instances; block += SWEEP_ROWS) {
+			pool->parallel_for(active.size(), [this, block, &active](int a) {
+				Trial& trial = trials[active[a]];
+				Network& net = *trial.net;
+				// This trial's batches that start inside the block.
+				int first = (block + net.batch_size - 1) / net.batch_size;
+				int last = std::min(net.instances / net.batch_size, (block + SWEEP_ROWS + net.batch_size - 1) / net.batch_size);
+				BatchView view = net.own_view(0, net.batch_size);
+				for (int b = first; b < last; b++) {
+					net.read_batch(false, b, view);
+					net.forward(view);
+					net.backprop_rows(view, net.scratch, true);
+					trial.cost_sum += net.cost(view);
+					trial.acc_sum += net.accuracy(view);
+				}
+			});
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		pool->parallel_for(active.size(), [this, &active, &elapsed](int a) {
+			Trial& trial = trials[active[a]];
+			Network& net = *trial.net;
+			net.finish_epoch(trial.cost_sum, trial.acc_sum, net.instances / net.batch_size, elapsed.count());
+			judge(trial);
+		});
+	}
+}
+
+// Records the epoch a trial just finished and decides whether it keeps going. Validation cost is
+// what's watched, or training cost if the validation set doesn't fill a batch.
+void Sweep::judge(Trial& trial)
+{
+	Network& net = *trial.net;
+	TrialResult& result = trial.result;
+	result.epochs = net.epochs;
+	result.cost = net.get_cost();
+	result.acc = net.get_acc();
+	result.val_cost = net.get_val_cost();
+	result.val_acc = net.get_val_acc();
+	float watched = net.val_instances >= net.batch_size ? result.val_cost : result.cost;
+	if (!std::isfinite(result.cost) || !std::isfinite(watched)) {
+		result.diverged = true;
+		result.running = false;
+	}
+	else if (watched < result.best_val_cost - net.threshold) {
+		result.best_val_cost = watched;
+		trial.since_best = 0;
+	}
+	else if (net.early_stop && ++trial.since_best >= patience) {
+		result.stopped = true;
+		result.running = false;
+	}
+}
+
+int Sweep::running() const
+{
+	return std::count_if(trials.begin(), trials.end(), [](const Trial& trial) {return trial.result.running;});
+}
+
+int Sweep::best() const
+{
+	int best = -1;
+	for (const Trial& trial : trials) {
+		if (trial.result.diverged || trial.result.epochs == 0) continue;
+		if (best < 0 || trial.result.best_val_cost < trials[best].result.best_val_cost) best = trial.result.id;
+	}
+	return best;
+}
+
+std::vector<TrialResult> Sweep::results() const
+{
+	std::vector<TrialResult> all;
+	for (const Trial& trial : trials) all.push_back(trial.result);
+	return all;
+}
+}
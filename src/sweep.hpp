@@ -0,0 +1,68 @@
+//
+//  sweep.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "bpnn.hpp"
+
+namespace Jacobian {
+#define SWEEP_ROWS 4096 // Rows of the dataset every trial works through before the next block.
+
+struct TrialConfig {
+	int batch_size;
+	float learning_rate;
+	float bias_rate;
+	Regularization regularization;
+	float lambda;
+	std::function<void(Network&)> build; // Adds layers, optimizer, decay... initialize() is called after it.
+	bool early_exit = true;
+	float cutoff = 0; // Smallest drop in validation cost that counts as an improvement.
+};
+
+struct TrialResult {
+	int id;
+	bool running;
+	bool diverged;
+	bool stopped; // Early-stopped for lack of improvement.
+	int epochs;
+	float cost;
+	float acc;
+	float val_cost;
+	float val_acc;
+	float best_val_cost;
+};
+
+// Trains many configurations at once on one shared dataset. Trials move through the data in lock
+// step, a block of SWEEP_ROWS rows at a time with every trial's share of a block running as one
+// task on the pool, so each block is pulled into cache once for all of them. Trials whose cost
+// stops being finite are dropped as diverged, and trials with early_exit set stop once their
+// validation cost hasn't improved for patience epochs.
+class Sweep {
+	struct Trial {
+		std::unique_ptr<Network> net;
+		TrialResult result;
+		int since_best;
+		float cost_sum;
+		float acc_sum;
+	};
+	std::shared_ptr<Dataset> dataset;
+	std::shared_ptr<ThreadPool> pool;
+	std::vector<Trial> trials;
+	int patience;
+	void judge(Trial& trial);
+public:
+	Sweep(std::shared_ptr<Dataset> data, int threads, int patience=3);
+	int add(const TrialConfig& config);
+	void run(int epochs);
+	int running() const;
+	int best() const; // Trial with the lowest validation cost seen, or -1.
+	std::vector<TrialResult> results() const;
+	Network& network(int id) {return *trials.at(id).net;}
+};
+}
+#endif /* SWEEP_H */
@@ -0,0 +1,187 @@
+//
+//  threads.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include "bpnn.hpp"
+#include "threads.hpp"
+#include "topology.hpp"
+
+namespace Jacobian {
+// Which pool (if any) the current thread works for, and its index in that pool.
+thread_local ThreadPool* current_pool = nullptr;
+thread_local int current_worker = -1;
+
+ThreadPool::ThreadPool(int threads, const std::vector<int>& cpus)
+{
+	Expects(threads > 0 && (cpus.empty() || static_cast<int>(cpus.size()) == threads));
+	for (int i = 0; i < threads; i++) queues.push_back(std::make_unique<Queue>());
+	for (int i = 0; i < threads; i++) {
+		workers.emplace_back([this, i, cpu = cpus.empty() ? -1 : cpus[i]] {
+			if (cpu >= 0) pin_thread(cpu);
+			work(i);
+		});
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> guard (sleep_lock);
+		stopping = true;
+	}
+	ready.notify_all();
+	for (std::thread& worker : workers) worker.join();
+}
+
+bool ThreadPool::pop(int index, std::packaged_task<void()>& task)
+{
+	{
+		Queue& own = *queues[index];
+		std::lock_guard<std::mutex> guard (own.lock);
+		if (!own.homed.empty()) {
+			task = std::move(own.homed.back());
+			own.homed.pop_back();
+			own.homed_count--;
+			return true;
+		}
+		if (!own.tasks.empty()) {
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			queued--;
+			return true;
+		}
+	}
+	for (int i = 1; i < static_cast<int>(queues.size()); i++) {
+		Queue& victim = *queues[(index + i) % queues.size()];
+		std::lock_guard<std::mutex> guard (victim.lock);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			queued--;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::work(int index)
+{
+	current_pool = this;
+	current_worker = index;
+	while (true) {
+		std::packaged_task<void()> task;
+		if (pop(index, task)) {
+			task();
+			continue;
+		}
+		std::unique_lock<std::mutex> guard (sleep_lock);
+		Queue& own = *queues[index];
+		ready.wait(guard, [this, &own] {return stopping || queued > 0 || own.homed_count > 0;});
+		if (stopping && queued == 0 && own.homed_count == 0) return;
+	}
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task)
+{
+	std::packaged_task<void()> packaged (std::move(task));
+	std::future<void> result = packaged.get_future();
+	int index = current_pool == this ? current_worker : next_queue++ % queues.size();
+	{
+		std::lock_guard<std::mutex> guard (queues[index]->lock);
+		queues[index]->tasks.push_back(std::move(packaged));
+	}
+	{
+		// Taking the lock orders this with a worker that is about to go to sleep.
+		std::lock_guard<std::mutex> guard (sleep_lock);
+		queued++;
+	}
+	ready.notify_one();
+	return result;
+}
+
+std::future<void> ThreadPool::submit_to(int worker, std::function<void()> task)
+{
+	Expects(worker >= 0 && worker < size());
+	std::packaged_task<void()> packaged (std::move(task));
+	std::future<void> result = packaged.get_future();
+	{
+		std::lock_guard<std::mutex> guard (queues[worker]->lock);
+		queues[worker]->homed.push_back(std::move(packaged));
+	}
+	{
+		std::lock_guard<std::mutex> guard (sleep_lock);
+		queues[worker]->homed_count++;
+	}
+	ready.notify_all(); // notify_one might wake someone other than the one worker that can run it.
+	return result;
+}
+
+void ThreadPool::parallel_for(int n, const std::function<void(int)>& f, bool homed)
+{
+	std::vector<std::future<void>> pending;
+	for (int i = 0; i < n; i++) {
+		if (homed) pending.push_back(submit_to(i % size(), [&f, i] {f(i);}));
+		else pending.push_back(submit([&f, i] {f(i);}));
+	}
+	// Every task borrows f, so wait for all of them before get() rethrows anything a task threw.
+	for (std::future<void>& result : pending) result.wait();
+	for (std::future<void>& result : pending) result.get();
+}
+
+int TaskGraph::add(std::function<void()> task, const std::vector<int>& after, int worker)
+{
+	nodes.push_back({std::move(task), {}, 0, worker});
+	int id = nodes.size() - 1;
+	for (int on : after) depend(id, on);
+	return id;
+}
+
+void TaskGraph::depend(int node, int on)
+{
+	Expects(on < node); // Keeps the graph acyclic.
+	nodes[on].successors.push_back(node);
+	nodes[node].dependencies++;
+}
+
+void TaskGraph::run(ThreadPool& pool)
+{
+	if (nodes.empty()) return;
+	std::unique_ptr<std::atomic<int>[]> pending (new std::atomic<int>[nodes.size()]);
+	for (size_t i = 0; i < nodes.size(); i++) pending[i] = nodes[i].dependencies;
+	std::atomic<int> remaining {static_cast<int>(nodes.size())};
+	std::mutex done_lock;
+	std::condition_variable done;
+	bool finished = false;
+	std::exception_ptr failure;
+	std::mutex failure_lock;
+	std::function<void(int)> launch = [&](int id) {
+		auto body = [&, id] {
+			try {
+				nodes[id].task();
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> guard (failure_lock);
+				if (!failure) failure = std::current_exception();
+			}
+			for (int next : nodes[id].successors)
+				if (--pending[next] == 0) launch(next);
+			if (--remaining == 0) {
+				// Notify under the lock so run() can't return (and destroy all this) until we're out.
+				std::lock_guard<std::mutex> guard (done_lock);
+				finished = true;
+				done.notify_all();
+			}
+		};
+		if (nodes[id].worker >= 0) pool.submit_to(nodes[id].worker % pool.size(), body);
+		else pool.submit(body);
+	};
+	for (size_t i = 0; i < nodes.size(); i++)
+		if (nodes[i].dependencies == 0) launch(i);
+	std::unique_lock<std::mutex> guard (done_lock);
+	done.wait(guard, [&finished] {return finished;});
+	if (failure) std::rethrow_exception(failure);
+}
+}
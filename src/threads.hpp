@@ -0,0 +1,72 @@
+//
+//  threads.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+
+namespace Jacobian {
+// Work-stealing pool. Every worker has its own deque: tasks a worker submits go on the back of its
+// own deque and it pops from the back (newest, hottest in cache first), while idle workers steal
+// from the front of everyone else's. Tasks submitted from outside are dealt out round-robin.
+// Homed tasks are the exception: they wait for their own worker and are never stolen, for work
+// that has to stay next to memory that worker allocated.
+class ThreadPool {
+	struct Queue {
+		std::deque<std::packaged_task<void()>> tasks;
+		std::deque<std::packaged_task<void()>> homed;
+		std::atomic<int> homed_count {0};
+		std::mutex lock;
+	};
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> workers;
+	std::mutex sleep_lock;
+	std::condition_variable ready;
+	std::atomic<int> queued {0};
+	std::atomic<unsigned> next_queue {0};
+	bool stopping = false;
+	void work(int index);
+	bool pop(int index, std::packaged_task<void()>& task);
+public:
+	ThreadPool(int threads, const std::vector<int>& cpus = {}); // Worker i is pinned to cpus[i], if given.
+	~ThreadPool();
+	std::future<void> submit(std::function<void()> task);
+	std::future<void> submit_to(int worker, std::function<void()> task); // A homed task.
+	// Runs f(0..n-1) and waits for all of them. If homed, f(i) runs on worker i % size().
+	void parallel_for(int n, const std::function<void(int)>& f, bool homed=false);
+	int size() const {return workers.size();}
+};
+
+// Tasks with dependencies between them. run() starts every task on the pool as soon as the tasks
+// it depends on have finished, and returns once all of them have. A graph can be run repeatedly.
+// A task given a worker runs homed on that worker (mod the pool's size).
+class TaskGraph {
+	struct Node {
+		std::function<void()> task;
+		std::vector<int> successors;
+		int dependencies;
+		int worker;
+	};
+	std::vector<Node> nodes;
+public:
+	int add(std::function<void()> task, const std::vector<int>& after = {}, int worker = -1);
+	void depend(int node, int on);
+	void run(ThreadPool& pool);
+	void clear() {nodes.clear();}
+	int size() const {return nodes.size();}
+};
+}
+#endif /* THREADS_H */
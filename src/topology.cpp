@@ -0,0 +1,101 @@
+//
+//  topology.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "bpnn.hpp"
+#include "topology.hpp"
+
+namespace Jacobian {
+// Parses a kernel CPU list such as "0-3,8,10-11".
+inline std::vector<int> parse_cpulist(const std::string& text)
+{
+	std::vector<int> cpus;
+	std::stringstream ranges (text);
+	std::string range;
+	while (std::getline(ranges, range, ',')) {
+		if (range.empty() || !isdigit(range[0])) continue;
+		size_t dash = range.find('-');
+		int lo = std::stoi(range.substr(0, dash));
+		int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash+1));
+		for (int cpu = lo; cpu <= hi; cpu++) cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+Topology Topology::detect()
+{
+	Topology topology;
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	if (DIR* dir = opendir("/sys/devices/system/node")) {
+		while (dirent* entry = readdir(dir)) {
+			int node;
+			if (sscanf(entry->d_name, "node%d", &node) != 1) continue;
+			std::ifstream list ("/sys/devices/system/node/" + std::string(entry->d_name) + "/cpulist");
+			std::string text;
+			std::getline(list, text);
+			if (static_cast<int>(topology.node_cpus.size()) <= node) topology.node_cpus.resize(node+1);
+			for (int cpu : parse_cpulist(text))
+				if (CPU_ISSET(cpu, &allowed)) topology.node_cpus[node].push_back(cpu);
+		}
+		closedir(dir);
+	}
+	bool found = std::any_of(topology.node_cpus.begin(), topology.node_cpus.end(),
+							 [](const std::vector<int>& cpus) {return !cpus.empty();});
+	if (!found) {
+		topology.node_cpus.assign(1, {});
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &allowed)) topology.node_cpus[0].push_back(cpu);
+	}
+	return topology;
+}
+
+int Topology::node_of(int cpu) const
+{
+	for (int node = 0; node < nodes(); node++)
+		if (std::find(node_cpus[node].begin(), node_cpus[node].end(), cpu) != node_cpus[node].end()) return node;
+	return -1;
+}
+
+// A CPU for each of threads workers, filling one node before moving on to the next so that workers
+// share a node (and its memory) whenever they can. Wraps around if there are more threads than CPUs.
+std::vector<int> Topology::place(int threads) const
+{
+	std::vector<int> order;
+	for (const std::vector<int>& cpus : node_cpus) order.insert(order.end(), cpus.begin(), cpus.end());
+	Expects(!order.empty());
+	std::vector<int> cpus;
+	for (int t = 0; t < threads; t++) cpus.push_back(order[t % order.size()]);
+	return cpus;
+}
+
+std::string Topology::describe(const std::vector<int>& cpus) const
+{
+	std::stringstream text;
+	int used = 0;
+	for (const std::vector<int>& node : node_cpus) used += !node.empty();
+	text << "Topology - " << used << " NUMA node" << (used == 1 ? "" : "s") << "\n";
+	for (size_t t = 0; t < cpus.size(); t++)
+		text << "Worker " << t << " - cpu " << cpus[t] << " - node " << node_of(cpus[t]) << "\n";
+	return text.str();
+}
+
+bool pin_thread(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+}
@@ -0,0 +1,29 @@
+//
+//  topology.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <vector>
+#include <string>
+
+namespace Jacobian {
+// The NUMA nodes of this machine and the CPUs on each that this process may run on, read from
+// /sys/devices/system/node. Without NUMA information everything is one node.
+struct Topology {
+	std::vector<std::vector<int>> node_cpus;
+
+	static Topology detect();
+	int nodes() const {return node_cpus.size();}
+	int node_of(int cpu) const;
+	std::vector<int> place(int threads) const;
+	std::string describe(const std::vector<int>& cpus) const;
+};
+
+bool pin_thread(int cpu);
+}
+#endif /* TOPOLOGY_H */
@@ -0,0 +1,96 @@
+//
+//  trace.cpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.hpp"
+
+namespace Jacobian {
+std::atomic<uint64_t> Tracer::next_id {1};
+thread_local int TraceContext::batch = -1;
+thread_local int TraceContext::epoch = -1;
+
+Tracer::Tracer(const std::string& output)
+	:id(next_id++), path(output), origin(std::chrono::steady_clock::now())
+{
+}
+
+// The calling thread's buffer, which only it ever appends to.
+Tracer::Buffer& Tracer::local()
+{
+	thread_local uint64_t owner = 0;
+	thread_local Buffer* buffer = nullptr;
+	if (owner == id) return *buffer;
+	// The thread may have recorded here before, in between recording for another tracer.
+	const pid_t thread = syscall(SYS_gettid);
+	std::lock_guard<std::mutex> guard (lock);
+	auto found = std::find_if(buffers.begin(), buffers.end(), [thread](const std::unique_ptr<Buffer>& b) {return b->thread == thread;});
+	if (found == buffers.end()) {
+		buffers.push_back(std::make_unique<Buffer>());
+		buffers.back()->thread = thread;
+		buffers.back()->events.reserve(TRACE_RESERVE);
+		found = buffers.end() - 1;
+	}
+	buffer = found->get();
+	owner = id;
+	return *buffer;
+}
+
+void Tracer::record(const char* name, int64_t begin, int layer)
+{
+	const bool own = TraceContext::batch >= 0;
+	local().events.push_back({name, begin, now(), layer, own ? TraceContext::batch : batch.load(std::memory_order_relaxed),
+							  own ? TraceContext::epoch : epoch.load(std::memory_order_relaxed)});
+}
+
+size_t Tracer::size()
+{
+	std::lock_guard<std::mutex> guard (lock);
+	size_t events = 0;
+	for (const std::unique_ptr<Buffer>& buffer : buffers) events += buffer->events.size();
+	return events;
+}
+
+// Complete ("X") events, which Chrome and Perfetto nest by time on each thread.
+void Tracer::write()
+{
+	std::lock_guard<std::mutex> guard (lock);
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file) throw std::runtime_error{"The tracer could not open its output."};
+	const int process = getpid();
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	bool first = true;
+	for (const std::unique_ptr<Buffer>& buffer : buffers) {
+		for (const TraceEvent& event : buffer->events) {
+			fprintf(file, "%s\n{\"name\": \"%s\", \"cat\": \"train\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %i, \"tid\": %i, \"args\": {",
+					first ? "" : ",", event.name, event.begin / 1e3, (event.end - event.begin) / 1e3, process, static_cast<int>(buffer->thread));
+			if (event.layer >= 0) fprintf(file, "\"layer\": %i, ", event.layer);
+			fprintf(file, "\"batch\": %i, \"epoch\": %i}}", event.batch, event.epoch);
+			first = false;
+		}
+	}
+	fprintf(file, "\n]}\n");
+	if (fclose(file) != 0) throw std::runtime_error{"The tracer could not write its output."};
+}
+
+TraceContext::TraceContext(int batch_number, int epoch_number)
+	:previous_batch(batch), previous_epoch(epoch)
+{
+	batch = batch_number;
+	epoch = epoch_number;
+}
+
+TraceContext::~TraceContext()
+{
+	batch = previous_batch;
+	epoch = previous_epoch;
+}
+}
@@ -0,0 +1,99 @@
+//
+//  trace.hpp
+//  Jacobian
+//
+//  Created by David Freifeld
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace Jacobian {
+#define TRACE_RESERVE 4096 // Events a thread's buffer has room for before it first has to grow.
+
+struct TraceEvent {
+	const char* name; // A string literal, so nothing is copied while recording.
+	int64_t begin; // Nanoseconds since the tracer started.
+	int64_t end;
+	int layer; // -1 if the event isn't about one layer.
+	int batch;
+	int epoch;
+};
+
+// Records spans of work on every thread into buffers of their own, so recording never takes a lock
+// (besides once per thread, to hand the tracer its buffer), and writes them out as Chrome trace
+// events that chrome://tracing and Perfetto can show as a timeline. Events are tagged with the
+// batch and epoch the recording thread's TraceContext gives, or else the tracer's current ones.
+// write() mustn't run while anything is still recording.
+class Tracer {
+	struct Buffer {
+		pid_t thread;
+		std::vector<TraceEvent> events;
+	};
+	static std::atomic<uint64_t> next_id;
+	const uint64_t id; // Tells a thread's cached buffer apart from one of an earlier tracer's.
+	std::string path;
+	std::chrono::steady_clock::time_point origin;
+	std::mutex lock;
+	std::vector<std::unique_ptr<Buffer>> buffers;
+	Buffer& local();
+public:
+	std::atomic<int> batch {-1}; // What the training thread is on, for threads without a context.
+	std::atomic<int> epoch {-1};
+	Tracer(const std::string& output);
+	Tracer(const Tracer&) = delete;
+	void operator=(const Tracer&) = delete;
+	int64_t now() const {return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();}
+	void record(const char* name, int64_t begin, int layer);
+	size_t size();
+	void write();
+};
+
+// Sets the batch and epoch the calling thread's events are tagged with, for threads that work
+// through batches of their own (Hogwild workers) or on an earlier epoch's weights (validation).
+class TraceContext {
+	int previous_batch;
+	int previous_epoch;
+public:
+	static thread_local int batch;
+	static thread_local int epoch;
+	TraceContext(int batch_number, int epoch_number);
+	~TraceContext();
+	TraceContext(const TraceContext&) = delete;
+	void operator=(const TraceContext&) = delete;
+};
+
+// Records a span from construction to destruction, if there's a tracer.
+class TraceScope {
+	Tracer* tracer;
+	const char* name;
+	int layer;
+	int64_t begin;
+public:
+	TraceScope(Tracer* to, const char* event, int index=-1)
+		:tracer(to), name(event), layer(index)
+	{
+		if (tracer) begin = tracer->now();
+	}
+	~TraceScope()
+	{
+		if (tracer) tracer->record(name, begin, layer);
+	}
+	TraceScope(const TraceScope&) = delete;
+	void operator=(const TraceScope&) = delete;
+};
+
+#define TRACE_CONCAT(a, b) a##b
+#define TRACE_NAME(line) TRACE_CONCAT(trace_scope_, line)
+#define TRACE(tracer, name, layer) Jacobian::TraceScope TRACE_NAME(__LINE__) (tracer, name, layer)
+}
+#endif /* TRACE_H */
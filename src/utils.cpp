@@ -13,6 +13,7 @@
 #include <ctime>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -25,17 +26,9 @@ namespace activations {
 
 inline float sgn(float val) {return (0.0f < val) - (val < 0.0f);}
 
-double fexp(double val)
-{
-	long tmp = static_cast<long>(1512775 * val + 1072632447) << 32;
-	return *reinterpret_cast<double*>(&tmp);
-}
-
-float ftanh(float x)
-{
-	return (x*(10+pow(x,2))*(60+pow(x,2)))/
-		(600+(270*pow(x,2))+(11*pow(x,4))+(pow(x,6)/24));
-}
+#define DEFINE_HELPER(type, name, parameter, body) type name(parameter) {body}
+ACTIVATION_HELPERS(DEFINE_HELPER)
+#undef DEFINE_HELPER
 
 //float ftanh(float val) {return sgn(val) * (1 - 2/(fexp(2*abs(val))+1));}
 float fcosh(float val) {return (fexp(val) + fexp(-val)) * 0.5;}
@@ -43,64 +36,44 @@ float fcosh(float val) {return (fexp(val) + fexp(-val)) * 0.5;}
 // A bunch of hardcoded activation functions. Avoids much of the slowness of custom functions.
 // Although the std::function makes it not the fastest way, the functionality is worth it.
 // Yes, these functions may be a frustrating to read but they're just equations and I want to conserve space.
+// The activations themselves come from ACTIVATION_SOURCES in utils.hpp; only their derivatives are here.
+
+#define DEFINE_ACTIVATION(name, expression) float name(float x) {return expression;}
+ACTIVATION_SOURCES(DEFINE_ACTIVATION)
+#undef DEFINE_ACTIVATION
 
-float sigmoid(float x) {return 1.0/(1+fexp(-x));}
 float sigmoid_deriv(float x) {return 1.0/(1+fexp(-x)) * (1 - 1.0/(1+fexp(-x)));}
 
-float linear(float x) {return x;}
 float linear_deriv(float x) {return 1;}
 
-float lecun_tanh(float x) {
-	//std::cout << ftanh(x) << " vs " << tanh(x) << "\n";
-	return 1.7159 * ftanh(0.66f * x);}
 float lecun_tanh_deriv(float x) {return 1.14393 * pow(1.0/fcosh(0.66f * x), 2);}
 
-float inverse_logit(float x) {return (fexp(x)/(fexp(x)+1));}
 float inverse_logit_deriv(float x) {return (fexp(x)/pow(fexp(x)+1, 2));}
 
-float softplus(float x) {return log(1+fexp(x));}
 float softplus_deriv(float x) {return fexp(x)/(fexp(x)+1);}
 
-float cloglog(float x) {return 1-fexp(-fexp(x));}
 float cloglog_deriv(float x) {return fexp(x-fexp(x));}
 
-float step(float x)
-{
-	if (x > 0) return 1;
-	else return 0;
-}
 float step_deriv(float x) {return 0;}
 
-float bipolar(float x)
-{
-	if (x > 0) return 1;
-	else if (x == 0) return 0;
-	else return -1;
-}
 float bipolar_deriv(float x) {return 0;}
 
-float bipolar_sigmoid(float x) {return (1-fexp(-x))/(1+fexp(-x));}
 float bipolar_sigmoid_deriv(float x) {return (2*fexp(x))/(pow(fexp(x)+1,2));}
 
-float hard_tanh(float x) {return fmax(-1, fmin(1,x));}
 float hard_tanh_deriv(float x)
 {
 	if (-1 < x && x < 1) return 1;
 	else return 0;
 }
 
-float leaky_relu(float x)
-{
-	if (x > 0) return x;
-	else return 0.01 * x;
-}
-
 float leaky_relu_deriv(float x)
 {
 	if (x > 0) return 1;
 	else return 0.01;
 }
 
+float relu_deriv(float x) {return x > 0 ? 1 : 0;}
+
 std::function<float(float)> rectifier(float (*activation)(float))
 {
 	auto rectified = [activation](float x) -> float {
@@ -111,21 +84,58 @@ std::function<float(float)> rectifier(float (*activation)(float))
 	};
 	return rectified;
 }
+
+const std::vector<Named>& registry()
+{
+	static const std::vector<Named> named {
+		{"linear", linear, linear_deriv},
+		{"sigmoid", sigmoid, sigmoid_deriv},
+		{"lecun_tanh", lecun_tanh, lecun_tanh_deriv},
+		{"inverse_logit", inverse_logit, inverse_logit_deriv},
+		{"softplus", softplus, softplus_deriv},
+		{"cloglog", cloglog, cloglog_deriv},
+		{"step", step, step_deriv},
+		{"bipolar", bipolar, bipolar_deriv},
+		{"bipolar_sigmoid", bipolar_sigmoid, bipolar_sigmoid_deriv},
+		{"hard_tanh", hard_tanh, hard_tanh_deriv},
+		{"leaky_relu", leaky_relu, leaky_relu_deriv},
+		{"relu", relu, relu_deriv},
+	};
+	return named;
+}
+
+const Named* find(const std::string& name)
+{
+	for (const Named& entry : registry())
+		if (name == entry.name) return &entry;
+	return nullptr;
+}
+
+// Only plain function pointers can be recognised (Python's built-ins arrive as such too); anything
+// else, rectifier() included, is a custom activation and has no name.
+std::string name_of(const std::function<float(float)>& activation)
+{
+	auto pointer = activation.target<float(*)(float)>();
+	if (!pointer) return "";
+	for (const Named& entry : registry())
+		if (*pointer == entry.activation) return entry.name;
+	return "";
+}
 } // namespace activations
 
 namespace optimizers {
-std::function<void(Layer&, Eigen::MatrixXf, float)> momentum(float beta) {
-	return [beta](Layer& layer, const Eigen::MatrixXf delta, const float learning_rate) {
+std::function<void(Layer&, const Eigen::Ref<const Eigen::MatrixXf>&, float)> momentum(float beta) {
+	return [beta](Layer& layer, const Eigen::Ref<const Eigen::MatrixXf>& delta, const float learning_rate) {
 	  layer.weights -= (beta * layer.m) + (learning_rate * delta);
 	  layer.m = (learning_rate * delta);
 	};
 }
 
-std::function<void(Layer&, Eigen::MatrixXf, float)> demon(float beta, int max_ep) {
+std::function<void(Layer&, const Eigen::Ref<const Eigen::MatrixXf>&, float)> demon(float beta, int max_ep) {
 	float beta_init = beta;
 	float prev_epoch = -1;
 	float epochs = 0;
-	return [max_ep, epochs, beta_init, beta](Layer& layer, const Eigen::MatrixXf delta, const float learning_rate) mutable {
+	return [max_ep, epochs, beta_init, beta](Layer& layer, const Eigen::Ref<const Eigen::MatrixXf>& delta, const float learning_rate) mutable {
 		beta = beta_init * (1-(epochs/max_ep)) / ((beta_init * (1-(epochs/max_ep))) + (1-beta_init));
 		layer.weights -= (beta * layer.m) + (learning_rate * delta);
 		layer.m = (learning_rate * delta);
@@ -133,8 +143,8 @@ std::function<void(Layer&, Eigen::MatrixXf, float)> demon(float beta, int max_ep
 	};
 }
 
-std::function<void(Layer&, Eigen::MatrixXf, float)> adam(float beta1, float beta2, float epsilon) {
-	return [beta1, beta2, epsilon](Layer& layer, const Eigen::MatrixXf delta, const float learning_rate) {
+std::function<void(Layer&, const Eigen::Ref<const Eigen::MatrixXf>&, float)> adam(float beta1, float beta2, float epsilon) {
+	return [beta1, beta2, epsilon](Layer& layer, const Eigen::Ref<const Eigen::MatrixXf>& delta, const float learning_rate) {
 		layer.m = (beta1 * layer.m) + ((1-beta1)*delta);
 		layer.v = (beta2 * layer.v) + (1-beta2)*(delta.cwiseProduct(delta));
 		layer.weights -= learning_rate *
@@ -142,9 +152,9 @@ std::function<void(Layer&, Eigen::MatrixXf, float)> adam(float beta1, float beta
 	};
 }
 
-std::function<void(Layer&, Eigen::MatrixXf, float)> adamax(float beta1, float beta2, float epsilon) {
+std::function<void(Layer&, const Eigen::Ref<const Eigen::MatrixXf>&, float)> adamax(float beta1, float beta2, float epsilon) {
 	return [beta1, beta2, epsilon](Layer &layer,
-					   const Eigen::MatrixXf delta,
+					   const Eigen::Ref<const Eigen::MatrixXf>& delta,
 					   const float learning_rate) {
 		layer.m = (beta1 * layer.m) + ((1 - beta1) * delta);
 		if ((beta2 * layer.v).sum() > delta.array().abs().sum())
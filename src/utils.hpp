@@ -14,6 +14,28 @@
 
 namespace Jacobian {
 namespace activations {
+// The built-in activations as expressions in x, and the helpers they call. utils.cpp defines the
+// functions from these and FrozenNetwork::emit_header() writes out the same source, so the two agree.
+// Commas in an expression have to sit inside parentheses.
+#define ACTIVATION_HELPERS(X) \
+	X(double, fexp, double val, long tmp = static_cast<long>(1512775 * val + 1072632447) << 32; \
+		double result; std::memcpy(&result, &tmp, sizeof(result)); return result;) \
+	X(float, ftanh, float x, return (x*(10+std::pow(x,2))*(60+std::pow(x,2)))/ \
+		(600+(270*std::pow(x,2))+(11*std::pow(x,4))+(std::pow(x,6)/24));)
+#define ACTIVATION_SOURCES(X) \
+	X(linear, x) \
+	X(sigmoid, 1.0/(1+fexp(-x))) \
+	X(lecun_tanh, 1.7159 * ftanh(0.66f * x)) \
+	X(inverse_logit, fexp(x)/(fexp(x)+1)) \
+	X(softplus, std::log(1+fexp(x))) \
+	X(cloglog, 1-fexp(-fexp(x))) \
+	X(step, x > 0 ? 1 : 0) \
+	X(bipolar, x > 0 ? 1 : x == 0 ? 0 : -1) \
+	X(bipolar_sigmoid, (1-fexp(-x))/(1+fexp(-x))) \
+	X(hard_tanh, std::fmax(-1, std::fmin(1, x))) \
+	X(leaky_relu, x > 0 ? x : 0.01 * x) \
+	X(relu, x > 0 ? x : 0)
+
 float sigmoid(float x);
 float sigmoid_deriv(float x);
 float linear(float x);
@@ -38,14 +60,26 @@ float bipolar_sigmoid(float x);
 float bipolar_sigmoid_deriv(float x);
 float leaky_relu(float x);
 float leaky_relu_deriv(float x);
+float relu(float x);
+float relu_deriv(float x);
 std::function<float(float)> rectifier(float (*activation)(float));
+
+// The built-in activations by name, which is how checkpoints record them.
+struct Named {
+	const char* name;
+	float (*activation)(float);
+	float (*activation_deriv)(float);
+};
+const std::vector<Named>& registry();
+const Named* find(const std::string& name);
+std::string name_of(const std::function<float(float)>& activation);
 }
 
 namespace optimizers {
-std::function<void(Layer&, Eigen::MatrixXf, float)> momentum(float beta);
-std::function<void(Layer&, Eigen::MatrixXf, float)> demon(float beta_init, int max_ep);
-std::function<void(Layer&, Eigen::MatrixXf, float)> adam(float beta1, float beta2, float epsilon);
-std::function<void(Layer&, Eigen::MatrixXf, float)> adamax(float beta1, float beta2, float epsilon);
+std::function<void(Layer&, const Eigen::Ref<const Eigen::MatrixXf>&, float)> momentum(float beta);
+std::function<void(Layer&, const Eigen::Ref<const Eigen::MatrixXf>&, float)> demon(float beta_init, int max_ep);
+std::function<void(Layer&, const Eigen::Ref<const Eigen::MatrixXf>&, float)> adam(float beta1, float beta2, float epsilon);
+std::function<void(Layer&, const Eigen::Ref<const Eigen::MatrixXf>&, float)> adamax(float beta1, float beta2, float epsilon);
 }
 
 namespace decays {